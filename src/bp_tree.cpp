@@ -1,7 +1,9 @@
 #include "bp_tree.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "serialization.h"
 
@@ -15,14 +17,23 @@ namespace niffler {
     static
     stringstream& append_key_to_stringstream(const key &key, stringstream& ss)
     {
-        ss << key.data;
+        ss << key.to_string();
         return ss;
     }
 
+    // Rewrites a key read from a file with legacy_string keys, the characters up to the terminator, in place
+    static
+    void encode_legacy_key(key &key)
+    {
+        char chars[KEY_SIZE + 1] = { 0 };
+        memcpy(chars, key.data, KEY_SIZE);
+        key = niffler::key(chars);
+    }
+
     template<u32 N>
     constexpr void bp_tree<N>::assert_sizes()
     {
-        static_assert(sizeof(bp_tree_header) == 32, "sizeof(bp_tree_header) != 32");
+        static_assert(sizeof(bp_tree_header) == 36, "sizeof(bp_tree_header) != 36");
         static_assert(sizeof(bp_tree_node_child) == 20, "sizeof(bp_tree_node_child) != 24");
         static_assert(sizeof(bp_tree_record) == 24, "sizeof(bp_tree_record) != 24");
         static_assert(sizeof(bp_tree_node<N>) == (20 + sizeof(bp_tree_node_child) * N), "wrong size: bp_tree_node<N>");
@@ -36,42 +47,70 @@ namespace niffler {
         
         auto t = std::make_unique<bp_tree<N>>(pager);
         t->load(t->header_, HEADER_PAGE_INDEX);
-        
+
+        // The order is a template parameter, a tree can only be loaded by the instantiation it was created with
+        if (t->header_.order != N)
+            return result<bp_tree<N>>(false);
+
+        // The header of older files ends at leaf_page, the bytes read as the key format may hold anything
+        const auto version = pager->opened_version();
+        const auto legacy_keys = strcmp(version, FREE_LIST_FILE_VERSION) == 0 || strcmp(version, U16_PAGE_SIZE_FILE_VERSION) == 0;
+
+        if (legacy_keys)
+        {
+            t->header_.key_format = key_format::legacy_string;
+
+            // Both formats order keys the same way so only the keys change, not the shape of the tree
+            t->encode_legacy_keys();
+            if (!pager->sync())
+                return result<bp_tree<N>>(false);
+        }
+        else if (t->header_.key_format != key_format::ordered_string && t->header_.key_format != key_format::integer)
+        {
+            return result<bp_tree<N>>(false);
+        }
+
         return result<bp_tree<N>>(true, std::move(t));
     }
 
     template<u32 N>
-    result<bp_tree<N>> bp_tree<N>::create(pager *pager)
+    result<bp_tree<N>> bp_tree<N>::create(pager *pager, niffler::key_format format)
     {
+        assert(format != key_format::legacy_string);
+
         bp_tree<N>::assert_sizes();
 
+        if (bp_tree_leaf<N>::DISK_SIZE() > pager->header().page_size)
+            return result<bp_tree<N>>(false);
+
         auto t = std::make_unique<bp_tree<N>>(pager);
 
-        auto header_page = pager->get_free_page();
-        assert(header_page.index == HEADER_PAGE_INDEX);
+        const page_index header_page = pager->get_free_page()->index;
+        assert(header_page == HEADER_PAGE_INDEX);
 
         t->header_.order = N;
         t->header_.key_size = KEY_SIZE;
+        t->header_.key_format = format;
         t->header_.height = 1;
 
-        auto root_page = pager->get_free_page();
+        const page_index root_page = pager->get_free_page()->index;
         t->header_.num_internal_nodes = 1;
         bp_tree_node<N> root;
-        t->header_.root_page = root_page.index;
+        t->header_.root_page = root_page;
 
         bp_tree_leaf<N> leaf;
         leaf.parent_page = t->header_.root_page;
 
-        auto leaf_page = pager->get_free_page();
+        const page_index leaf_page = pager->get_free_page()->index;
         t->header_.num_leaf_nodes = 1;
-        t->header_.leaf_page = leaf_page.index;
-        root.children[0].page = leaf_page.index;
+        t->header_.leaf_page = leaf_page;
+        root.children[0].page = leaf_page;
         root.num_children = 1;
 
         // Save inital tree to the underlying storage
         t->save(t->header_, HEADER_PAGE_INDEX);
-        t->save(root, root_page.index);
-        t->save(leaf, leaf_page.index);
+        t->save(root, root_page);
+        t->save(leaf, leaf_page);
 
         auto sync_result = pager->sync();
         return result<bp_tree<N>>(sync_result, std::move(t));
@@ -109,70 +148,171 @@ namespace niffler {
     template<u32 N>
     unique_ptr<find_result> bp_tree<N>::find(const key & key) const
     {
-        auto parent_page = search_tree(key);
-        assert(parent_page != 0);
-
-        bp_tree_node<N> parent;
-        load(parent, parent_page);
-
-        auto leaf_page = search_node(parent, key);
-        assert(leaf_page != 0);
-
-        bp_tree_leaf<N> leaf;
-        load(leaf, leaf_page);
+        // The leaf stays latched until the value is copied, a concurrent remove could free the data page otherwise
+        const auto leaf_guard = latch_leaf(key, latch_mode::shared);
+        const bp_tree_leaf_view<N> leaf(leaf_guard->content);
 
         auto result = std::make_unique<find_result>();
 
-        auto index = binary_search_record(leaf, key);
+        const auto index = leaf.find(key);
         if (index < 0)
             return result;
 
-
-        const auto& value = leaf.children[index].value;
-        const auto& page = pager_->get_page(value.first_page);
-
-        result->size = value.size;
-        result->data = malloc(value.size);
-        memcpy(result->data, page.content, value.size);
-        result->found = true;
+        read_value(leaf.value_at(static_cast<u32>(index)), *result);
 
         return result;
     }
 
     template<u32 N>
-    bool bp_tree<N>::exists(const key & key) const
+    vector<unique_ptr<find_result>> bp_tree<N>::find(const key *keys, u32 num_keys) const
     {
-        auto parent_page = search_tree(key);
-        assert(parent_page != 0);
+        vector<unique_ptr<find_result>> results(num_keys);
 
-        bp_tree_node<N> parent;
-        load(parent, parent_page);
+        // Walk the keys in sorted order so keys that share a node are next to each other, each node is then loaded once
+        // and every level's pages can be read as one batch before it's searched
+        vector<u32> order(num_keys);
+        for (auto i = 0u; i < num_keys; i++)
+            order[i] = i;
 
-        auto leaf_page = search_node(parent, key);
-        assert(leaf_page != 0);
+        std::sort(order.begin(), order.end(), [keys](u32 lhs, u32 rhs) { return keys[lhs] < keys[rhs]; });
 
-        bp_tree_leaf<N> leaf;
-        load(leaf, leaf_page);
+        vector<page_index> pages(num_keys, header_.root_page);
+        vector<page_index> batch;
+
+        for (auto height = header_.height; height > 0; height--)
+        {
+            prefetch(pages, batch);
+
+            page_guard node_guard;
+            page_index node_page = 0;
 
-        return binary_search_record(leaf, key) >= 0;
+            for (auto i = 0u; i < num_keys; i++)
+            {
+                if (pages[i] != node_page)
+                {
+                    node_page = pages[i];
+                    node_guard.release();
+                    node_guard = pager_->get_page(node_page, latch_mode::shared);
+                }
+
+                const bp_tree_node_view<N> node(node_guard->content);
+                pages[i] = node.page_at(node.find_child(keys[order[i]]));
+            }
+        }
+
+        prefetch(pages, batch);
+        const auto leaf_pages = pages;
+
+        page_guard leaf_guard;
+        page_index leaf_page = 0;
+
+        for (auto i = 0u; i < num_keys; i++)
+        {
+            if (leaf_pages[i] != leaf_page)
+            {
+                leaf_page = leaf_pages[i];
+                leaf_guard.release();
+                leaf_guard = pager_->get_page(leaf_page, latch_mode::shared);
+            }
+
+            // 0 is the file header page, prefetch skips it
+            const bp_tree_leaf_view<N> leaf(leaf_guard->content);
+            const auto index = leaf.find(keys[order[i]]);
+            pages[i] = index >= 0 ? leaf.value_at(static_cast<u32>(index)).first_page : 0;
+        }
+
+        leaf_guard.release();
+        prefetch(pages, batch);
+
+        // The records are looked up again with their leaf latched, like find the leaf has to stay latched while the values are copied
+        leaf_page = 0;
+
+        for (auto i = 0u; i < num_keys; i++)
+        {
+            if (leaf_pages[i] != leaf_page)
+            {
+                leaf_page = leaf_pages[i];
+                leaf_guard.release();
+                leaf_guard = pager_->get_page(leaf_page, latch_mode::shared);
+            }
+
+            results[order[i]] = std::make_unique<find_result>();
+
+            const bp_tree_leaf_view<N> leaf(leaf_guard->content);
+            const auto index = leaf.find(keys[order[i]]);
+            if (index >= 0)
+                read_value(leaf.value_at(static_cast<u32>(index)), *results[order[i]]);
+        }
+
+        return results;
+    }
+
+    template<u32 N>
+    bool bp_tree<N>::exists(const key & key) const
+    {
+        const auto leaf_guard = latch_leaf(key, latch_mode::shared);
+        return bp_tree_leaf_view<N>(leaf_guard->content).find(key) >= 0;
     }
 
     template<u32 N>
     bool bp_tree<N>::insert(const key &key, const void *data, u32 data_size)
     {
-        if (insert_internal(key, data, data_size))
-            return pager_->sync();
+        if (!accepts(key))
+            return false;
 
-        return false;
+        return insert_internal(key, data, data_size);
     }
 
     template<u32 N>
     bool bp_tree<N>::remove(const key &key)
     {
-        if (remove_internal(key))
-            return pager_->sync();
+        return remove_internal(key);
+    }
+
+    template<u32 N>
+    latched_result bp_tree<N>::try_insert(const key &key, const void *data, u32 data_size)
+    {
+        if (!accepts(key))
+            return latched_result::failed;
+
+        // The new record's data pages, the bitmap and the leaf are committed together
+        const auto operation_lock = pager_->lock_operation();
+        auto leaf_guard = latch_leaf(key, latch_mode::exclusive);
+        bp_tree_leaf_view<N> leaf(leaf_guard->content);
+
+        if (leaf.find(key) >= 0)
+            return latched_result::failed;
+
+        // A split changes the parent as well
+        if (leaf.num_children() == header_.order)
+            return latched_result::restart;
+
+        insert_record_in_place(leaf, key, data, data_size);
+        pager_->mark_dirty(*leaf_guard);
+
+        return latched_result::ok;
+    }
+
+    template<u32 N>
+    latched_result bp_tree<N>::try_remove(const key &key)
+    {
+        const auto operation_lock = pager_->lock_operation();
+        auto leaf_guard = latch_leaf(key, latch_mode::exclusive);
+        bp_tree_leaf_view<N> leaf(leaf_guard->content);
+
+        const auto index = leaf.find(key);
+        if (index < 0)
+            return latched_result::failed;
 
-        return false;
+        // Same rule as remove_internal, an underflowing leaf borrows from or merges with its siblings
+        const auto min_num_records = header_.num_leaf_nodes == 1 ? 0 : MIN_NUM_CHILDREN();
+        if (leaf.num_children() - 1 < min_num_records)
+            return latched_result::restart;
+
+        remove_record_in_place(leaf, static_cast<u32>(index));
+        pager_->mark_dirty(*leaf_guard);
+
+        return latched_result::ok;
     }
 
     template<u32 N>
@@ -191,79 +331,326 @@ namespace niffler {
         auto leaf_page = search_node(parent_page, key);
         assert(leaf_page != 0);
 
+        {
+            auto leaf_guard = pager_->get_page(leaf_page, latch_mode::exclusive);
+            bp_tree_leaf_view<N> leaf(leaf_guard->content);
+
+            // Key already exists
+            if (leaf.find(key) >= 0)
+                return false;
+
+            if (leaf.num_children() < header_.order)
+            {
+                insert_record_in_place(leaf, key, data, data_size);
+                pager_->mark_dirty(*leaf_guard);
+                return true;
+            }
+        }
+
         bp_tree_leaf<N> leaf;
         load(leaf, leaf_page);
 
-        // Key already exists
-        if (binary_search_record(leaf, key) >= 0)
-            return false;
+        bp_tree_leaf<N> new_leaf;
+        insert_record_split(key, data, data_size, leaf_page, leaf, new_leaf);
+        insert_key(parent_page, new_leaf.children[0].key, leaf_page, leaf.next_page);
+
+        return true;
+    }
+
+    template<u32 N>
+    bool bp_tree<N>::remove_internal(const key &key)
+    {
+        auto parent_page = search_tree(key);
+        assert(parent_page != 0);
+
+        auto leaf_page = search_node(parent_page, key);
+        assert(leaf_page != 0);
+
+        // If this is the only leaf we cant really borrow/merge so we accept any number of records
+        const auto min_num_records = header_.num_leaf_nodes == 1 ? 0 : MIN_NUM_CHILDREN();
 
-        if (leaf.num_children == header_.order)
         {
-            bp_tree_leaf<N> new_leaf;
-            insert_record_split(key, data, data_size, leaf_page, leaf, new_leaf);
-            insert_key(parent_page, new_leaf.children[0].key, leaf_page, leaf.next_page);
+            auto leaf_guard = pager_->get_page(leaf_page, latch_mode::exclusive);
+            bp_tree_leaf_view<N> leaf(leaf_guard->content);
+
+            // Return false if the key does not exists
+            const auto index = leaf.find(key);
+            if (index < 0)
+                return false;
+
+            if (leaf.num_children() - 1 >= min_num_records)
+            {
+                remove_record_in_place(leaf, static_cast<u32>(index));
+                pager_->mark_dirty(*leaf_guard);
+                return true;
+            }
         }
-        else
+
+        bp_tree_leaf<N> leaf;
+        load(leaf, leaf_page);
+
+        // The leaf underflows
+        remove_record(leaf, key);
+
+        if (borrow_key(leaf))
         {
-            insert_record_non_full(leaf, key, data, data_size);
             save(leaf, leaf_page);
+            return true;
         }
 
+        // Most merges only take one child out of the parent
+        auto merge_result = merge_leaf(leaf, leaf_page, leaf.next_page == 0);
+        if (remove_by_page_in_place(merge_result.parent_page, merge_result.page_to_delete))
+            return true;
+
+        bp_tree_node<N> parent;
+        load(parent, merge_result.parent_page);
+        remove_by_page(merge_result.parent_page, parent, merge_result.page_to_delete);
+
         return true;
     }
 
     template<u32 N>
-    bool bp_tree<N>::remove_internal(const key &key)
+    bool bp_tree<N>::accepts(const key &key) const
     {
-        auto parent_page = search_tree(key);
-        assert(parent_page != 0);
+        return key.is_valid() && key.is_integer() == (header_.key_format == key_format::integer);
+    }
 
-        bp_tree_node<N> parent;
-        load(parent, parent_page);
+    template<u32 N>
+    u32 bp_tree<N>::vacuum(u32 max_pages)
+    {
+        // Once the file is compact every page at or past this index is free
+        const auto num_used_pages = pager_->header().num_pages - pager_->header().num_free_pages;
+        auto num_moved = 0u;
+        // Nodes and leaves read, a step stops after max_pages of them and the next one goes on from there
+        auto num_visited = 0u;
+
+        // A split or merge since the last step may have freed the page it stopped at
+        auto& cursor = vacuum_cursor_;
+        if (cursor.page == 0 || cursor.shape_version != shape_version_)
+        {
+            cursor.level = 0;
+            cursor.page = header_.root_page;
+            cursor.next_level_page = 0;
+        }
 
-        auto leaf_page = search_node(parent, key);
-        assert(leaf_page != 0);
+        // Level by level from the root, a moved node fixes its parent, siblings and children so the walk can continue from its new page
+        while (cursor.level < header_.height && num_moved < max_pages && num_visited < max_pages)
+        {
+            if (cursor.page >= num_used_pages)
+            {
+                cursor.page = move_node(cursor.page, cursor.level + 1 == header_.height);
+                num_moved++;
+            }
 
-        bp_tree_leaf<N> leaf;
-        load(leaf, leaf_page);
+            bp_tree_node<N> node;
+            load(node, cursor.page);
+            num_visited++;
 
-        // Return false if the key does not exists
-        if (!remove_record(leaf, key))
-            return false;
+            if (cursor.next_level_page == 0)
+                cursor.next_level_page = node.children[0].page;
 
-        // If this is the only leaf we cant really borrow/merge so we accept any number of records
-        const auto min_num_records = header_.num_leaf_nodes == 1 ? 0 : MIN_NUM_CHILDREN();
+            cursor.page = node.next_page;
+
+            // The first child of the first node of the last level is the first leaf
+            if (cursor.page == 0)
+            {
+                cursor.level++;
+                cursor.page = cursor.next_level_page;
+                cursor.next_level_page = 0;
+            }
+        }
 
-        if (leaf.num_children < min_num_records)
+        while (cursor.level == header_.height && cursor.page != 0 && num_moved < max_pages && num_visited < max_pages)
         {
-            auto could_borrow = borrow_key(leaf);
+            if (cursor.page >= num_used_pages)
+            {
+                cursor.page = move_leaf(cursor.page);
+                num_moved++;
+            }
 
-            if (!could_borrow)
+            bp_tree_leaf<N> leaf;
+            load(leaf, cursor.page);
+            num_visited++;
+
+            auto changed = false;
+            auto i = 0u;
+            for (; i < leaf.num_children && num_moved < max_pages; i++)
             {
-                auto merge_result = merge_leaf(leaf, leaf_page, leaf.next_page == 0);
+                auto& value = leaf.children[i].value;
+                if (value.first_page < num_used_pages)
+                    continue;
 
-                if (merge_result.parent_page != parent_page)
-                {
-                    load(parent, merge_result.parent_page);
-                    remove_by_page(merge_result.parent_page, parent, merge_result.page_to_delete);
-                }
-                else
-                {
-                    remove_by_page(parent_page, parent, merge_result.page_to_delete);
-                }
+                value.first_page = pager_->move_page(value.first_page);
+                changed = true;
+                num_moved++;
+            }
+
+            if (changed)
+                save(leaf, cursor.page);
+
+            // The next step looks at the rest of the data pages of this leaf again
+            if (i == leaf.num_children)
+                cursor.page = leaf.next_page;
+        }
+
+        // Past the last leaf the next step starts over from the root
+        cursor.shape_version = shape_version_;
+
+        // The root or the first leaf may have moved
+        if (num_moved > 0)
+            save(header_, HEADER_PAGE_INDEX);
+
+        return num_moved;
+    }
+
+    template<u32 N>
+    page_index bp_tree<N>::move_node(page_index node_page, bool leaf_children)
+    {
+        const auto new_page = pager_->move_page(node_page);
+
+        bp_tree_node<N> node;
+        load(node, new_page);
+
+        if (node.parent_page == 0)
+        {
+            header_.root_page = new_page;
+        }
+        else
+        {
+            bp_tree_node<N> parent;
+            load(parent, node.parent_page);
+            for (auto i = 0u; i < parent.num_children; i++)
+            {
+                if (parent.children[i].page == node_page)
+                    parent.children[i].page = new_page;
+            }
+
+            save(parent, node.parent_page);
+        }
+
+        if (node.prev_page != 0)
+        {
+            bp_tree_node<N> prev;
+            load(prev, node.prev_page);
+            prev.next_page = new_page;
+            save(prev, node.prev_page);
+        }
+
+        if (node.next_page != 0)
+        {
+            bp_tree_node<N> next;
+            load(next, node.next_page);
+            next.prev_page = new_page;
+            save(next, node.next_page);
+        }
+
+        // Only the parent page of the children changes, it is at the same place in nodes and leaves
+        for (auto i = 0u; i < node.num_children; i++)
+        {
+            auto child = pager_->get_page(node.children[i].page, latch_mode::exclusive);
+            if (leaf_children)
+            {
+                bp_tree_leaf_view<N>(child->content).set_parent_page(new_page);
             }
             else
             {
-                save(leaf, leaf_page);
+                bp_tree_node_view<N>(child->content).set_parent_page(new_page);
             }
+
+            pager_->mark_dirty(*child);
+        }
+
+        return new_page;
+    }
+
+    template<u32 N>
+    page_index bp_tree<N>::move_leaf(page_index leaf_page)
+    {
+        const auto new_page = pager_->move_page(leaf_page);
+
+        bp_tree_leaf<N> leaf;
+        load(leaf, new_page);
+
+        bp_tree_node<N> parent;
+        load(parent, leaf.parent_page);
+        for (auto i = 0u; i < parent.num_children; i++)
+        {
+            if (parent.children[i].page == leaf_page)
+                parent.children[i].page = new_page;
+        }
+
+        save(parent, leaf.parent_page);
+
+        if (leaf.prev_page != 0)
+        {
+            bp_tree_leaf<N> prev;
+            load(prev, leaf.prev_page);
+            prev.next_page = new_page;
+            save(prev, leaf.prev_page);
         }
         else
         {
+            header_.leaf_page = new_page;
+        }
+
+        if (leaf.next_page != 0)
+        {
+            bp_tree_leaf<N> next;
+            load(next, leaf.next_page);
+            next.prev_page = new_page;
+            save(next, leaf.next_page);
+        }
+
+        return new_page;
+    }
+
+    template<u32 N>
+    void bp_tree<N>::encode_legacy_keys()
+    {
+        // Same walk as vacuum, level by level through the nodes and then along the leaves
+        auto level_page = header_.root_page;
+        for (auto level = 0u; level < header_.height; level++)
+        {
+            page_index next_level_page = 0;
+
+            for (auto node_page = level_page; node_page != 0;)
+            {
+                bp_tree_node<N> node;
+                load(node, node_page);
+
+                for (auto i = 0u; i < node.num_children; i++)
+                {
+                    encode_legacy_key(node.children[i].key);
+                }
+
+                save(node, node_page);
+
+                if (next_level_page == 0)
+                    next_level_page = node.children[0].page;
+
+                node_page = node.next_page;
+            }
+
+            level_page = next_level_page;
+        }
+
+        for (auto leaf_page = header_.leaf_page; leaf_page != 0;)
+        {
+            bp_tree_leaf<N> leaf;
+            load(leaf, leaf_page);
+
+            for (auto i = 0u; i < leaf.num_children; i++)
+            {
+                encode_legacy_key(leaf.children[i].key);
+            }
+
             save(leaf, leaf_page);
+            leaf_page = leaf.next_page;
         }
 
-        return true;
+        header_.key_format = key_format::ordered_string;
+        save(header_, HEADER_PAGE_INDEX);
     }
 
     template<u32 N>
@@ -273,7 +660,7 @@ namespace niffler {
         if (node_page == 0)
         {
             bp_tree_node<N> root;
-            header_.root_page = alloc_node(root);
+            header_.root_page = alloc_node(left_page);
             header_.height++;
 
             root.num_children = 2;
@@ -289,13 +676,16 @@ namespace niffler {
             return;
         }
 
+        if (insert_key_in_place(node_page, key, right_page))
+            return;
+
         bp_tree_node<N> node;
         load(node, node_page);
 
         if (node.num_children == header_.order)
         {
             bp_tree_node<N> new_node;
-            auto new_node_page = create(node_page, node, new_node, [this](auto n) { return alloc_node(n); });
+            auto new_node_page = create(node_page, node, new_node, [this](page_index hint) { return alloc_node(hint); });
 
             bool key_greater_than_key_at_split;
             u32 split_index;
@@ -346,6 +736,21 @@ namespace niffler {
         }
     }
 
+    template<u32 N>
+    bool bp_tree<N>::insert_key_in_place(page_index node_page, const key &key, page_index right_page)
+    {
+        auto node_guard = pager_->get_page(node_page, latch_mode::exclusive);
+        bp_tree_node_view<N> node(node_guard->content);
+
+        if (node.num_children() == header_.order)
+            return false;
+
+        node.insert_at(node.find_child(key), key, right_page);
+        pager_->mark_dirty(*node_guard);
+
+        return true;
+    }
+
     template<u32 N>
     void bp_tree<N>::insert_key_non_full(bp_tree_node<N> &node, const key &key, page_index next_page)
     {
@@ -400,13 +805,41 @@ namespace niffler {
     template<u32 N>
     void bp_tree<N>::set_parent_ptr(bp_tree_node_child *children, u32 c_length, page_index parent_page)
     {
-        bp_tree_node<N> node;
+        // The children may be nodes or leaves, the parent page is at the same place in both
         for (auto i = 0u; i < c_length; i++)
         {
-            load(node, children[i].page);
-            node.parent_page = parent_page;
-            save(node, children[i].page);
+            auto child = pager_->get_page(children[i].page, latch_mode::exclusive);
+            bp_tree_node_view<N>(child->content).set_parent_page(parent_page);
+            pager_->mark_dirty(*child);
+        }
+    }
+
+    template<u32 N>
+    bool bp_tree<N>::remove_by_page_in_place(page_index node_page, page_index page_to_delete)
+    {
+        auto node_guard = pager_->get_page(node_page, latch_mode::exclusive);
+        bp_tree_node_view<N> node(node_guard->content);
+
+        // Same cases as remove_by_page: a root that is left with a single child is replaced by it, other nodes must not underflow
+        const auto num_children = node.num_children() - 1;
+        const auto is_root = node_page == header_.root_page;
+        if (is_root ? num_children == 0 || (num_children == 1 && header_.num_internal_nodes != 1) : num_children < MIN_NUM_CHILDREN())
+            return false;
+
+        const auto delete_index = node.find_page(page_to_delete);
+        assert(delete_index >= 0 && "delete_index not set");
+
+        const auto index = static_cast<u32>(delete_index);
+        if (index > 0)
+        {
+            const auto key = node.key_at(index);
+            node.set_key_at(index - 1, key);
         }
+
+        node.remove_at(index);
+        pager_->mark_dirty(*node_guard);
+
+        return true;
     }
 
     template<u32 N>
@@ -459,6 +892,8 @@ namespace niffler {
             if (!could_borrow)
             {
                 auto merge_result = merge_node(node, node_page, node.next_page == 0);
+                if (remove_by_page_in_place(merge_result.parent_page, merge_result.page_to_delete))
+                    return;
 
                 bp_tree_node<N> parent;
                 load(parent, merge_result.parent_page);
@@ -781,7 +1216,7 @@ namespace niffler {
         auto& src = lender.children[src_index];
         insert_record_at(borrower, src.key, src.value, dest_index);
 
-        remove_record_at(lender, src_index);
+        erase_record_at(lender, src_index);
         save(lender, lender_page);
 
         return true;
@@ -900,17 +1335,42 @@ namespace niffler {
         }
 
         leaf.children[index].key = key;
-        create_data_page(leaf.children[index].value, data, data_size);
+        // Next to the value of the previous key so values are read in key order mostly sequentially
+        create_data_page(leaf.children[index].value, data, data_size, index > 0 ? leaf.children[index - 1].value.first_page : 0);
 
         leaf.num_children++;
     }
 
+    template<u32 N>
+    void bp_tree<N>::insert_record_in_place(bp_tree_leaf_view<N> &leaf, const key &key, const void *data, u32 data_size)
+    {
+        assert(leaf.num_children() < header_.order);
+
+        const auto index = leaf.find_insert_index(key);
+
+        // Next to the value of the previous key like insert_record_at_new_value
+        value value;
+        create_data_page(value, data, data_size, index > 0 ? leaf.value_at(index - 1).first_page : 0);
+        leaf.insert_at(index, key, value);
+    }
+
+    template<u32 N>
+    void bp_tree<N>::remove_record_in_place(bp_tree_leaf_view<N> &leaf, u32 index)
+    {
+        // Page 0 is the file header, a record that points there has no data page
+        const auto first_page = leaf.value_at(index).first_page;
+        if (first_page != 0)
+            pager_->free_page(first_page);
+
+        leaf.remove_at(index);
+    }
+
     template<u32 N>
     void bp_tree<N>::insert_record_split(const key& key, const void *data, u32 data_size, page_index leaf_page, bp_tree_leaf<N> &leaf, bp_tree_leaf<N> &new_leaf)
     {
         assert(leaf.num_children == header_.order);
 
-        auto new_leaf_page = create(leaf_page, leaf, new_leaf, [this](auto l) { return alloc_leaf(l); });
+        auto new_leaf_page = create(leaf_page, leaf, new_leaf, [this](page_index hint) { return alloc_leaf(hint); });
 
         bool key_greater_than_key_at_split;
         u32 split_index;
@@ -932,15 +1392,16 @@ namespace niffler {
     }
 
     template<u32 N>
-    void bp_tree<N>::create_data_page(value &value, const void *data, u32 data_size)
+    void bp_tree<N>::create_data_page(value &value, const void *data, u32 data_size, page_index hint)
     {
-        assert(data_size <= PAGE_SIZE && "Values spanning multiple pages not yet supported");
+        assert(data_size <= pager_->header().page_size && "Values spanning multiple pages not yet supported");
 
-        auto data_page = pager_->get_free_page();
-        memcpy(data_page.content, data, data_size);
-        data_page.dirty = true;
+        // Latched so a concurrent sync can't write the page half copied and then mark it as clean
+        auto data_page = pager_->get_free_page(latch_mode::exclusive, hint);
+        memcpy(data_page->content, data, data_size);
+        pager_->mark_dirty(*data_page);
 
-        value.first_page = data_page.index;
+        value.first_page = data_page->index;
         value.size = data_size;
     }
 
@@ -975,7 +1436,17 @@ namespace niffler {
     {
         assert(index < source.num_children);
 
-        pager_->free_page(source.children[index].value.first_page);
+        // Page 0 is the file header, a record that points there has no data page
+        if (source.children[index].value.first_page != 0)
+            pager_->free_page(source.children[index].value.first_page);
+
+        erase_record_at(source, index);
+    }
+
+    template<u32 N>
+    void bp_tree<N>::erase_record_at(bp_tree_leaf<N> &source, u32 index)
+    {
+        assert(index < source.num_children);
 
         for (auto i = index; i < source.num_children - 1; i++)
         {
@@ -1081,6 +1552,53 @@ namespace niffler {
         return std::make_tuple(key_greater_than_key_at_split, split_index);
     }
 
+    template<u32 N>
+    void bp_tree<N>::prefetch(const vector<page_index> &pages, vector<page_index> &batch) const
+    {
+        batch.clear();
+
+        for (auto page : pages)
+        {
+            // pages is sorted by key so repeated pages are next to each other
+            if (page != 0 && (batch.empty() || batch.back() != page))
+                batch.push_back(page);
+        }
+
+        pager_->prefetch(batch.data(), static_cast<u32>(batch.size()));
+    }
+
+    template<u32 N>
+    page_guard bp_tree<N>::latch_leaf(const key &key, latch_mode leaf_mode) const
+    {
+        // Latch coupling, a child is latched before its parent is released
+        auto guard = pager_->get_page(header_.root_page, latch_mode::shared);
+
+        for (auto height = header_.height; height > 0; height--)
+        {
+            const bp_tree_node_view<N> node(guard->content);
+
+            const auto child_page = node.page_at(node.find_child(key));
+            assert(child_page != 0);
+
+            auto child_guard = pager_->get_page(child_page, height == 1 ? leaf_mode : latch_mode::shared);
+            guard = std::move(child_guard);
+        }
+
+        return guard;
+    }
+
+    template<u32 N>
+    void bp_tree<N>::read_value(const value &value, find_result &result) const
+    {
+        // Data pages are written before the record pointing to them is inserted, the caller keeps the leaf latched so it can't be freed
+        const auto page = pager_->get_page(value.first_page);
+
+        result.size = value.size;
+        result.data = malloc(value.size);
+        memcpy(result.data, page->content, value.size);
+        result.found = true;
+    }
+
     template<u32 N>
     page_index bp_tree<N>::search_tree(const key &key) const
     {
@@ -1089,9 +1607,7 @@ namespace niffler {
 
         while (height > 1)
         {
-            bp_tree_node<N> node;
-            load(node, current_page);
-            current_page = find_node_child(node, key).page;
+            current_page = search_node(current_page, key);
             height -= 1;
         }
 
@@ -1101,9 +1617,9 @@ namespace niffler {
     template<u32 N>
     page_index bp_tree<N>::search_node(page_index page, const key &key) const
     {
-        bp_tree_node<N> node;
-        load(node, page);
-        return find_node_child(node, key).page;
+        const auto guard = pager_->get_page(page, latch_mode::shared);
+        const bp_tree_node_view<N> node(guard->content);
+        return node.page_at(node.find_child(key));
     }
 
     template<u32 N>
@@ -1115,15 +1631,7 @@ namespace niffler {
     template<u32 N>
     u32 bp_tree<N>::find_insert_index(const bp_tree_leaf<N> &leaf, const key &key) const
     {
-        for (auto i = 0u; i < leaf.num_children; i++)
-        {
-            if (leaf.children[i].key > key)
-            {
-                return i;
-            }
-        }
-
-        return leaf.num_children;
+        return upper_bound_key(reinterpret_cast<const u8*>(leaf.children), sizeof(bp_tree_record), leaf.num_children, key);
     }
 
     template<u32 N>
@@ -1131,15 +1639,8 @@ namespace niffler {
     {
         assert(node.num_children > 0);
 
-        for (auto i = 0u; i < node.num_children; i++)
-        {
-            if (node.children[i].key > key)
-            {
-                return i;
-            }
-        }
-
-        return node.num_children - 1;
+        // The key of the last child is not a separator, every key that isn't less than the others goes there
+        return upper_bound_key(reinterpret_cast<const u8*>(node.children), sizeof(bp_tree_node_child), node.num_children - 1, key);
     }
 
     template<u32 N>
@@ -1148,83 +1649,62 @@ namespace niffler {
         if (node.num_children == 0)
             return node.children[0];
 
-        for (auto i = 0u; i < node.num_children; i++)
-        {
-            if (node.children[i].key > key)
-            {
-                return node.children[i];
-            }
-        }
-
-        return node.children[node.num_children - 1];
+        return node.children[find_insert_index(node, key)];
     }
 
     template<u32 N>
     int64_t bp_tree<N>::binary_search_record(const bp_tree_leaf<N> &leaf, const key &key) const
     {
-        if (leaf.num_children == 0)
+        const auto index = find_insert_index(leaf, key);
+        if (index == 0 || leaf.children[index - 1].key != key)
             return -1;
 
-        int64_t low = 0;
-        int64_t high = static_cast<int64_t>(leaf.num_children - 1);
-
-        while (low <= high)
-        {
-            auto mid = low + (high - low) / 2;
-            auto current_key = leaf.children[mid].key;
-            if (current_key == key)
-                return mid;
-
-            if (current_key < key)
-            {
-                low = mid + 1;
-            }
-            else
-            {
-                high = mid - 1;
-            }
-        }
-
-        return -1;
+        return index - 1;
     }
 
     template<u32 N>
-    page_index bp_tree<N>::alloc_node(bp_tree_node<N> &node)
+    page_index bp_tree<N>::alloc_node(page_index hint)
     {
+        assert(sizeof(bp_tree_node<N>) <= pager_->header().page_size);
         header_.num_internal_nodes++;
-        return alloc(sizeof(bp_tree_node<N>));
+        shape_version_++;
+        return alloc(hint);
     }
 
     template<u32 N>
-    page_index bp_tree<N>::alloc_leaf(bp_tree_leaf<N> &leaf)
+    page_index bp_tree<N>::alloc_leaf(page_index hint)
     {
+        assert(sizeof(bp_tree_leaf<N>) <= pager_->header().page_size);
         header_.num_leaf_nodes++;
-        return alloc(sizeof(bp_tree_leaf<N>));
+        shape_version_++;
+        return alloc(hint);
     }
 
     template<u32 N>
-    page_index bp_tree<N>::alloc(u32 size)
+    page_index bp_tree<N>::alloc(page_index hint)
     {
-        assert(size <= PAGE_SIZE);
-        return pager_->get_free_page().index;
+        return pager_->get_free_page(latch_mode::none, hint)->index;
     }
 
     template<u32 N>
-    void bp_tree<N>::free(bp_tree_node<N> &node, page_index node_page)
+    void bp_tree<N>::free(bp_tree_node<N> &, page_index node_page)
     {
+        // The node only picks the overload
         header_.num_internal_nodes -= 1;
-        free(sizeof(bp_tree_node<N>), node_page);
+        shape_version_++;
+        free(node_page);
     }
 
     template<u32 N>
-    void bp_tree<N>::free(bp_tree_leaf<N> &leaf, page_index leaf_page)
+    void bp_tree<N>::free(bp_tree_leaf<N> &, page_index leaf_page)
     {
         header_.num_leaf_nodes -= 1;
-        free(sizeof(bp_tree_leaf<N>), leaf_page);
+        shape_version_++;
+        free(leaf_page);
     }
 
     template<u32 N>
-    void bp_tree<N>::free(u32 size, page_index page)
+    void bp_tree<N>::free(page_index page)
     {
         pager_->free_page(page);
     }
@@ -1249,7 +1729,8 @@ namespace niffler {
         new_node.parent_page = node.parent_page;
         new_node.next_page = node.next_page;
         new_node.prev_page = node_page;
-        node.next_page = node_allocator(new_node);
+        // Right after node/leaf in the file if there is a free page there, so scans along the level read forward
+        node.next_page = node_allocator(node_page);
 
         if (new_node.next_page != 0)
         {
@@ -1346,9 +1827,16 @@ namespace niffler {
     template<class T>
     void bp_tree<N>::load(T &t, page_index page) const
     {
-        assert(sizeof(T) <= PAGE_SIZE);
+        // The guard keeps the page pinned and latched so a concurrent writer can't change it while it's being deserialized
+        const auto page_to_load = pager_->get_page(page, latch_mode::shared);
+        load(t, *page_to_load);
+    }
 
-        auto& page_to_load = pager_->get_page(page);
+    template<u32 N>
+    template<class T>
+    void bp_tree<N>::load(T &t, const page &page_to_load) const
+    {
+        assert(T::DISK_SIZE() <= page_to_load.size);
 
         if constexpr (std::is_same<T, bp_tree_node<N>>::value)
         {
@@ -1364,7 +1852,7 @@ namespace niffler {
         }
         else
         {
-            static_assert(false, "bp_tree<N>::load: Unsupported type");
+            static_assert(dependent_false<T>::value, "bp_tree<N>::load: Unsupported type");
         }
     }
 
@@ -1372,16 +1860,22 @@ namespace niffler {
     template<class T>
     void bp_tree<N>::save(const T &t, page_index page) const
     {
-        auto& page_to_save = pager_->get_page(page);
+        auto page_to_save = pager_->get_page(page, latch_mode::exclusive);
+        save(t, *page_to_save);
+    }
 
+    template<u32 N>
+    template<class T>
+    void bp_tree<N>::save(const T &t, page &page_to_save) const
+    {
         if constexpr (std::is_same<T, bp_tree_node<N>>::value)
         {
-            static_assert(bp_tree_node<N>::DISK_SIZE() <= PAGE_SIZE);
+            assert(bp_tree_node<N>::DISK_SIZE() <= page_to_save.size);
             serialize_bp_tree_node(page_to_save.content, t);
         }
         else if constexpr (std::is_same<T, bp_tree_leaf<N>>::value)
         {
-            static_assert(bp_tree_leaf<N>::DISK_SIZE() <= PAGE_SIZE);
+            assert(bp_tree_leaf<N>::DISK_SIZE() <= page_to_save.size);
             serialize_bp_tree_leaf(page_to_save.content, t);
         }
         else if constexpr (std::is_same<T, bp_tree_header>::value)
@@ -1390,14 +1884,18 @@ namespace niffler {
         }
         else
         {
-            static_assert(false, "bp_tree<N>::save: Unsupported type");
+            static_assert(dependent_false<T>::value, "bp_tree<N>::save: Unsupported type");
         }
 
-        page_to_save.dirty = true;
+        pager_->mark_dirty(page_to_save);
     }
 
     template class bp_tree<4>;
     template class bp_tree<6>;
     template class bp_tree<10>;
-    template class bp_tree<DEFAULT_TREE_ORDER>;
+    template class bp_tree<tree_order(4 * 1024)>;
+    template class bp_tree<tree_order(8 * 1024)>;
+    template class bp_tree<tree_order(16 * 1024)>;
+    template class bp_tree<tree_order(32 * 1024)>;
+    template class bp_tree<tree_order(64 * 1024)>;
 }
\ No newline at end of file
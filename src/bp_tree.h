@@ -5,12 +5,15 @@
 #include <type_traits>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <assert.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "include/define.h"
 #include "include/db.h"
+#include "key_search.h"
 #include "util.h"
 #include "pager.h"
 
@@ -20,17 +23,29 @@ namespace niffler {
     using std::string;
     using std::stringstream;
     using std::unique_ptr;
+    using std::vector;
 
     struct value {
         u32 size = 0;
         page_index first_page = 0;
     };
 
+    enum class key_format : u32 {
+        // Null terminated strings compared by length and then strcmp, files written before keys were encoded
+        legacy_string = 0,
+        // The memcmp ordered encoding of niffler::key
+        ordered_string = 1,
+        // key::integer keys only, in the same 16 byte slots and compared like the other encoding
+        integer = 2
+    };
+
     struct bp_tree_header {
         page_index page = 0;
 
         u32 order = 0;
         u32 key_size = 0;
+        // Stored after leaf_page. Files older than NifflerDB 0.3 don't have it, their keys are legacy_string
+        niffler::key_format key_format = niffler::key_format::legacy_string;
         u32 num_internal_nodes = 0;
         u32 num_leaf_nodes = 0;
         u32 height = 0;
@@ -40,12 +55,12 @@ namespace niffler {
         static inline constexpr u32 DISK_SIZE()
         {
             return sizeof(order) + sizeof(key_size) + sizeof(num_internal_nodes)
-                + sizeof(num_leaf_nodes) + sizeof(height) + sizeof(root_page) + sizeof(leaf_page);
+                + sizeof(num_leaf_nodes) + sizeof(height) + sizeof(root_page) + sizeof(leaf_page) + sizeof(key_format);
         }
     };
 
     struct bp_tree_node_child {
-        key key;
+        niffler::key key;
         page_index page;
 
         static inline constexpr u32 DISK_SIZE() { return sizeof(key) + sizeof(page); }
@@ -69,8 +84,8 @@ namespace niffler {
     };
 
     struct bp_tree_record {
-        key key;
-        value value;
+        niffler::key key;
+        niffler::value value;
 
         static inline constexpr u32 DISK_SIZE() { return sizeof(key) + sizeof(value); }
     };
@@ -95,6 +110,162 @@ namespace niffler {
     static_assert(bp_tree_record::DISK_SIZE() == 24, "bp_tree_record: wrong disk size");
     static_assert(page_header::DISK_SIZE() == 8, "page_header: wrong disk size");
 
+    // Parent, next and previous page and the number of children, in front of the children of a node or leaf on disk
+    constexpr u32 BP_TREE_PAGE_HEADER_SIZE = 4 * sizeof(u32);
+
+    // Reads and changes a node in place in the content of its page, in the layout written by serialize_bp_tree_node.
+    // Lookups only touch the keys they compare and inserts/removes only move the children after the index. Splits, merges and
+    // borrows change several pages and still go through bp_tree_node
+    template<u32 N>
+    class bp_tree_node_view {
+    public:
+        explicit bp_tree_node_view(u8 *content) : content_(content) {}
+
+        page_index parent_page() const { return read_u32(0); }
+        u32 num_children() const { return read_u32(3 * sizeof(u32)); }
+        void set_parent_page(page_index page) { write_u32(0, page); }
+
+        const niffler::key &key_at(u32 index) const { return *reinterpret_cast<const niffler::key*>(child(index)); }
+        page_index page_at(u32 index) const { return read_u32(child_offset(index) + sizeof(niffler::key)); }
+
+        // Same rule as bp_tree::find_node_child, the first child whose key is greater than key or else the last one.
+        // The key of the last child is not a separator and is left out of the search
+        u32 find_child(const niffler::key &key) const
+        {
+            const auto count = num_children();
+            if (count == 0)
+                return 0;
+
+            return upper_bound_key(child(0), bp_tree_node_child::DISK_SIZE(), count - 1, key);
+        }
+
+        // Index of the child that points to page, -1 if there is none
+        int64_t find_page(page_index page) const
+        {
+            const auto count = num_children();
+            for (auto i = 0u; i < count; i++)
+            {
+                if (page_at(i) == page)
+                    return i;
+            }
+
+            return -1;
+        }
+
+        void set_key_at(u32 index, const niffler::key &key) { memcpy(child(index), key.data, sizeof(key.data)); }
+
+        // Same as bp_tree::insert_key_at: key goes in front of the child at index, whose keys from then on start at right_page
+        void insert_at(u32 index, const niffler::key &key, page_index right_page)
+        {
+            const auto count = num_children();
+            assert(index <= count && count < N);
+
+            memmove(child(index + 1), child(index), static_cast<size_t>(count - index) * bp_tree_node_child::DISK_SIZE());
+            set_key_at(index, key);
+
+            // The child at index keeps its page, it now covers the keys up to the new one
+            write_u32(child_offset(index < count ? index + 1 : index) + sizeof(niffler::key), right_page);
+            write_u32(3 * sizeof(u32), count + 1);
+        }
+
+        void remove_at(u32 index)
+        {
+            const auto count = num_children();
+            assert(index < count);
+
+            memmove(child(index), child(index + 1), static_cast<size_t>(count - index - 1) * bp_tree_node_child::DISK_SIZE());
+            write_u32(3 * sizeof(u32), count - 1);
+        }
+
+    private:
+        u8 *child(u32 index) const { return content_ + child_offset(index); }
+        static u32 child_offset(u32 index) { return BP_TREE_PAGE_HEADER_SIZE + index * bp_tree_node_child::DISK_SIZE(); }
+
+        u32 read_u32(u32 offset) const
+        {
+            u32 value;
+            memcpy(&value, content_ + offset, sizeof(value));
+            return value;
+        }
+
+        void write_u32(u32 offset, u32 value) { memcpy(content_ + offset, &value, sizeof(value)); }
+
+        u8 *content_;
+    };
+
+    // Like bp_tree_node_view for a leaf, in the layout written by serialize_bp_tree_leaf
+    template<u32 N>
+    class bp_tree_leaf_view {
+    public:
+        explicit bp_tree_leaf_view(u8 *content) : content_(content) {}
+
+        page_index parent_page() const { return read_u32(0); }
+        u32 num_children() const { return read_u32(3 * sizeof(u32)); }
+        void set_parent_page(page_index page) { write_u32(0, page); }
+
+        const niffler::key &key_at(u32 index) const { return *reinterpret_cast<const niffler::key*>(record(index)); }
+
+        niffler::value value_at(u32 index) const
+        {
+            niffler::value value;
+            value.size = read_u32(record_offset(index) + sizeof(niffler::key));
+            value.first_page = read_u32(record_offset(index) + sizeof(niffler::key) + sizeof(u32));
+            return value;
+        }
+
+        // Index of the record with key, -1 if there is none
+        int64_t find(const niffler::key &key) const
+        {
+            const auto index = find_insert_index(key);
+            if (index == 0 || key_at(index - 1) != key)
+                return -1;
+
+            return index - 1;
+        }
+
+        // Index of the first record whose key is greater than key
+        u32 find_insert_index(const niffler::key &key) const
+        {
+            return upper_bound_key(record(0), bp_tree_record::DISK_SIZE(), num_children(), key);
+        }
+
+        void insert_at(u32 index, const niffler::key &key, const niffler::value &value)
+        {
+            const auto count = num_children();
+            assert(index <= count && count < N);
+
+            memmove(record(index + 1), record(index), static_cast<size_t>(count - index) * bp_tree_record::DISK_SIZE());
+            memcpy(record(index), key.data, sizeof(key.data));
+            write_u32(record_offset(index) + sizeof(niffler::key), value.size);
+            write_u32(record_offset(index) + sizeof(niffler::key) + sizeof(u32), value.first_page);
+            write_u32(3 * sizeof(u32), count + 1);
+        }
+
+        void remove_at(u32 index)
+        {
+            const auto count = num_children();
+            assert(index < count);
+
+            memmove(record(index), record(index + 1), static_cast<size_t>(count - index - 1) * bp_tree_record::DISK_SIZE());
+            write_u32(3 * sizeof(u32), count - 1);
+        }
+
+    private:
+        u8 *record(u32 index) const { return content_ + record_offset(index); }
+        static u32 record_offset(u32 index) { return BP_TREE_PAGE_HEADER_SIZE + index * bp_tree_record::DISK_SIZE(); }
+
+        u32 read_u32(u32 offset) const
+        {
+            u32 value;
+            memcpy(&value, content_ + offset, sizeof(value));
+            return value;
+        }
+
+        void write_u32(u32 offset, u32 value) { memcpy(content_ + offset, &value, sizeof(value)); }
+
+        u8 *content_;
+    };
+
     enum class lender_side : uint8_t {
         left,
         right
@@ -105,6 +276,26 @@ namespace niffler {
         page_index page_to_delete;
     };
 
+    // Where the next bp_tree::vacuum step goes on with its walk over the nodes, level by level, and then the leaves
+    struct vacuum_cursor {
+        // header.height once the walk is at the leaves
+        u32 level = 0;
+        // 0 once the walk is done, the next step starts over from the root
+        page_index page = 0;
+        // First page of the level below, taken from the first node of this level
+        page_index next_level_page = 0;
+        // bp_tree::shape_version_ when the walk stopped
+        u64 shape_version = 0;
+    };
+
+    enum class latched_result : uint8_t {
+        ok,
+        // The key already exists(insert) or does not exist(remove)
+        failed,
+        // The leaf has to be split or merged, retry with the whole tree locked
+        restart
+    };
+
     template<u32 N>
     class bp_tree {
     public:
@@ -113,15 +304,31 @@ namespace niffler {
 
         static constexpr void assert_sizes();
         static result<bp_tree<N>> load(pager *pager);
-        static result<bp_tree<N>> create(pager *pager);
+        static result<bp_tree<N>> create(pager *pager, niffler::key_format format = niffler::key_format::ordered_string);
 
         const bp_tree_header &header() const;
         string print() const;
         unique_ptr<find_result> find(const key& key) const;
+        vector<unique_ptr<find_result>> find(const key *keys, u32 num_keys) const;
         bool exists(const key& key) const;
+        // Changes stay in the pager until pager::sync, when to sync is up to the caller(db syncs according to options::durability)
         bool insert(const key& key, const void *data, u32 data_size);
         bool remove(const key& key);
 
+        // Insert/remove that only latch the leaf the key belongs to. Can run concurrently with finds and each other as long as
+        // nothing changes the structure of the tree at the same time, return latched_result::restart if the leaf would have to be split or merged
+        latched_result try_insert(const key& key, const void *data, u32 data_size);
+        latched_result try_remove(const key& key);
+
+        // Moves up to max_pages nodes, leaves and data pages from the end of the file into free pages closer to the start so
+        // pager::truncate can give the end back. Reads up to max_pages nodes and leaves but no data pages, each call goes on with the
+        // walk from the root where the last one stopped. Returns the number of pages moved
+        u32 vacuum(u32 max_pages);
+
+        // Integer keys in a tree of integer keys, string keys in any other. Keys of the other kind and oversized keys can't be inserted,
+        // finds and removes don't have to check since they never match a key in the tree
+        bool accepts(const key &key) const;
+
         constexpr u32 MIN_NUM_CHILDREN() const { return N / 2; }
         constexpr u32 MAX_NUM_CHILDREN() const { return N; }
 
@@ -136,6 +343,9 @@ namespace niffler {
         void remove_key_at(bp_tree_node<N> &source, u32 index);
         void set_parent_ptr(bp_tree_node_child *children, u32 c_length, page_index parent_page);
         void remove_by_page(page_index node_page, bp_tree_node<N> &node, page_index page_to_delete);
+        // Insert/remove a key directly in the page of a node that doesn't have to split, merge or borrow. False if it has to
+        bool insert_key_in_place(page_index node_page, const key &key, page_index right_page);
+        bool remove_by_page_in_place(page_index node_page, page_index page_to_delete);
         bool borrow_key(bp_tree_node<N> &borrower, page_index node_page);
         bool borrow_key(lender_side from_side, bp_tree_node<N> &borrower, page_index node_page);
         void insert_node_at(bp_tree_node<N> &node, const key &key, page_index page, u32 index);
@@ -153,11 +363,21 @@ namespace niffler {
         void insert_record_non_full(bp_tree_leaf<N> &leaf, const key &key, const void *data, u32 data_size);
         void insert_record_at(bp_tree_leaf<N> &leaf, const key &key, const value &value, u32 index);
         void insert_record_at_new_value(bp_tree_leaf<N> &leaf, const key &key, const void *data, u32 data_size, u32 index);
+        // Insert/remove a record directly in the page of a leaf that doesn't have to split or merge
+        void insert_record_in_place(bp_tree_leaf_view<N> &leaf, const key &key, const void *data, u32 data_size);
+        void remove_record_in_place(bp_tree_leaf_view<N> &leaf, u32 index);
         void insert_record_split(const key& key, const void *data, u32 data_size, page_index leaf_page, bp_tree_leaf<N> &leaf, bp_tree_leaf<N> &new_leaf);
-        void create_data_page(value &value, const void *data, u32 data_size);
+        void create_data_page(value &value, const void *data, u32 data_size, page_index hint);
         void transfer_records(bp_tree_leaf<N> &source, bp_tree_leaf<N> &target, u32 from_index);
         bool remove_record(bp_tree_leaf<N> &source, const key &key);
         void remove_record_at(bp_tree_leaf<N> &source, u32 index);
+        // Like remove_record_at but keeps the data page, for records that move to another leaf
+        void erase_record_at(bp_tree_leaf<N> &source, u32 index);
+
+        page_index move_node(page_index node_page, bool leaf_children);
+        page_index move_leaf(page_index leaf_page);
+        // Converts the keys of every node and leaf of a file with legacy_string keys, load calls it
+        void encode_legacy_keys();
 
         void promote_larger_key(const key &key_to_promote, page_index node_page, page_index parent_page);
         void promote_smaller_key(const key &key_to_promote, page_index node_page, page_index parent_page);
@@ -165,6 +385,10 @@ namespace niffler {
         template<class T>
         tuple<bool, u32> find_split_index(const T *arr, u32 arr_len, const key &key);
 
+        void prefetch(const vector<page_index> &pages, vector<page_index> &batch) const;
+        page_guard latch_leaf(const key &key, latch_mode leaf_mode) const;
+        void read_value(const value &value, find_result &result) const;
+
         page_index search_tree(const key &key) const;
         page_index search_node(page_index page, const key &key) const;
         page_index search_node(bp_tree_node<N> &node, const key &key) const;
@@ -173,12 +397,13 @@ namespace niffler {
         bp_tree_node_child &find_node_child(bp_tree_node<N> &node, const key &key) const;
         int64_t binary_search_record(const bp_tree_leaf<N> &leaf, const key &key) const;
 
-        page_index alloc_node(bp_tree_node<N> &node);
-        page_index alloc_leaf(bp_tree_leaf<N> &leaf);
-        page_index alloc(u32 size);
+        // hint is a page the new one should be close to in the file
+        page_index alloc_node(page_index hint);
+        page_index alloc_leaf(page_index hint);
+        page_index alloc(page_index hint);
         void free(bp_tree_node<N> &node, page_index node_page);
         void free(bp_tree_leaf<N> &leaf, page_index leaf_page);
-        void free(u32 size, page_index page);
+        void free(page_index page);
 
         template<class T, class NodeAllocator>
         page_index create(page_index node_page, T &node, T &new_node, NodeAllocator node_allocator);
@@ -192,10 +417,17 @@ namespace niffler {
         template<class T>
         void load(T &t, page_index page) const;
         template<class T>
+        void load(T &t, const page &page) const;
+        template<class T>
         void save(const T &t, page_index page) const;
+        template<class T>
+        void save(const T &t, page &page) const;
 
         pager *pager_;
         bp_tree_header header_;
+        // Bumped whenever a node or leaf is allocated or freed, a vacuum step that finds it changed starts its walk over
+        u64 shape_version_ = 0;
+        vacuum_cursor vacuum_cursor_;
     };
  
 }
@@ -1,6 +1,6 @@
 #include "include/db.h"
 
-#include <mutex>
+#include <chrono>
 
 #include "include/exceptions.h"
 #include "pager.h"
@@ -8,36 +8,85 @@
 
 namespace niffler {
 
-    using factory_fn = result<bp_tree<DEFAULT_TREE_ORDER>>(*)(pager*);
+    template<u32 N>
+    static
+    bp_tree_ptr open_tree(pager *pager, bool create, const options &opts)
+    {
+        const auto format = opts.integer_keys ? key_format::integer : key_format::ordered_string;
+        auto result = create ? bp_tree<N>::create(pager, format) : bp_tree<N>::load(pager);
+        if (!result.ok)
+            throw niffler_exception("could not create database");
+
+        return result.value.release();
+    }
 
-    db::db(const char *file_path, bool truncate_existing_file)
+    db::db(const char *file_path, bool truncate_existing_file, const options &opts)
     {
-        pager_ = new pager(file_path, truncate_existing_file);
+        pager_ = new pager(file_path, truncate_existing_file, opts);
         if (!pager_->ok())
+        {
+            delete pager_;
+            pager_ = nullptr;
             throw niffler_exception("Could not create or load db file");
+        }
 
-        factory_fn db_factory = bp_tree<DEFAULT_TREE_ORDER>::load;
-
-        if (truncate_existing_file)
+        try
+        {
+            switch (pager_->header().page_size)
+            {
+            case 4 * 1024:
+                bp_tree_ = open_tree<tree_order(4 * 1024)>(pager_, truncate_existing_file, opts);
+                break;
+            case 8 * 1024:
+                bp_tree_ = open_tree<tree_order(8 * 1024)>(pager_, truncate_existing_file, opts);
+                break;
+            case 16 * 1024:
+                bp_tree_ = open_tree<tree_order(16 * 1024)>(pager_, truncate_existing_file, opts);
+                break;
+            case 32 * 1024:
+                bp_tree_ = open_tree<tree_order(32 * 1024)>(pager_, truncate_existing_file, opts);
+                break;
+            case 64 * 1024:
+                bp_tree_ = open_tree<tree_order(64 * 1024)>(pager_, truncate_existing_file, opts);
+                break;
+            default:
+                throw niffler_exception("unsupported page size");
+            }
+        }
+        catch (...)
         {
-            db_factory = bp_tree<DEFAULT_TREE_ORDER>::create;
+            delete pager_;
+            pager_ = nullptr;
+            throw;
         }
 
-        auto result = db_factory(pager_);
-        if (!result.ok)
-            throw niffler_exception("could not create database");
+        durability_ = opts.durability;
+        sync_interval_ms_ = opts.sync_interval_ms > 0 ? opts.sync_interval_ms : 1;
+        sync_interval_ops_ = opts.sync_interval_ops > 0 ? opts.sync_interval_ops : 1;
 
-        bp_tree_ = result.value.release();
+        if (durability_ == durability::periodic)
+            flusher_ = std::thread(&db::run_flusher, this);
     }
 
     db::~db()
     {
-        if (bp_tree_ != nullptr)
+        if (flusher_.joinable())
         {
-            delete bp_tree_;
-            bp_tree_ = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(flusher_mutex_);
+                stop_flusher_ = true;
+            }
+
+            flusher_wakeup_.notify_one();
+            flusher_.join();
         }
 
+        // Whatever has not been synced yet is synced on close, whatever the durability level
+        if (pager_ != nullptr)
+            pager_->sync();
+
+        std::visit([](auto tree) { delete tree; }, bp_tree_);
+
         if (pager_ != nullptr)
         {
             delete pager_;
@@ -48,24 +97,134 @@ namespace niffler {
     std::unique_ptr<find_result> db::find(const key &key) const
     {
         std::shared_lock<std::shared_mutex> lock(mutex_);
-        return bp_tree_->find(key);
+        return std::visit([&](auto tree) { return tree->find(key); }, bp_tree_);
+    }
+
+    std::vector<std::unique_ptr<find_result>> db::find(const std::vector<key> &keys) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return std::visit([&](auto tree) { return tree->find(keys.data(), static_cast<u32>(keys.size())); }, bp_tree_);
     }
 
     bool db::exists(const key &key) const
     {
         std::shared_lock<std::shared_mutex> lock(mutex_);
-        return bp_tree_->exists(key);
+        return std::visit([&](auto tree) { return tree->exists(key); }, bp_tree_);
     }
 
     bool db::insert(const key &key, const void *data, u32 data_size)
     {
-        std::unique_lock<std::shared_mutex> lock(mutex_);
-        return bp_tree_->insert(key, data, data_size);
+        {
+            // Most inserts only change a single leaf, those latch just that leaf and run next to finds and other writers
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            const auto result = std::visit([&](auto tree) { return tree->try_insert(key, data, data_size); }, bp_tree_);
+            if (result != latched_result::restart)
+                return result == latched_result::ok && commit();
+        }
+
+        {
+            // Splits change several nodes and take the whole tree
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            if (!std::visit([&](auto tree) { return tree->insert(key, data, data_size); }, bp_tree_))
+                return false;
+        }
+
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return commit();
     }
 
     bool db::remove(const key &key)
     {
-        std::unique_lock<std::shared_mutex> lock(mutex_);
-        return bp_tree_->remove(key);
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            const auto result = std::visit([&](auto tree) { return tree->try_remove(key); }, bp_tree_);
+            if (result != latched_result::restart)
+                return result == latched_result::ok && commit();
+        }
+
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            if (!std::visit([&](auto tree) { return tree->remove(key); }, bp_tree_))
+                return false;
+        }
+
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return commit();
+    }
+
+    u32 db::vacuum(u32 max_pages)
+    {
+        u32 num_truncated_pages = 0;
+        u32 num_free_pages = 0;
+
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            std::visit([&](auto tree) { tree->vacuum(max_pages); }, bp_tree_);
+
+            num_truncated_pages = pager_->truncate();
+            num_free_pages = pager_->header().num_free_pages;
+        }
+
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        if (!commit())
+            throw niffler_exception("could not commit vacuum");
+
+        // The file is cut by a sync or, with a write-ahead log, a checkpoint. The last step doesn't wait for the next one to happen
+        if (num_free_pages == 0 && num_truncated_pages > 0 && !pager_->checkpoint())
+            throw niffler_exception("could not commit vacuum");
+
+        return num_free_pages;
+    }
+
+    bool db::commit()
+    {
+        // Called with the shared lock held so a commit never sees a split or merge that is only half done. Inserts and removes
+        // that only latch a leaf run next to it, the pager waits for those that are half done. Commits at the same time share the sync
+        switch (durability_)
+        {
+        case durability::full:
+            return pager_->sync();
+        case durability::periodic:
+        {
+            {
+                std::lock_guard<std::mutex> lock(flusher_mutex_);
+                if (++pending_ops_ >= sync_interval_ops_)
+                    flusher_wakeup_.notify_one();
+            }
+
+            return !sync_failed_;
+        }
+        case durability::none:
+            return pager_->flush();
+        }
+
+        return false;
+    }
+
+    void db::run_flusher()
+    {
+        std::unique_lock<std::mutex> lock(flusher_mutex_);
+
+        while (!stop_flusher_)
+        {
+            flusher_wakeup_.wait_for(lock, std::chrono::milliseconds(sync_interval_ms_), [this]() {
+                return stop_flusher_ || pending_ops_ >= sync_interval_ops_;
+            });
+
+            // The destructor syncs once the flusher has stopped
+            if (stop_flusher_ || pending_ops_ == 0)
+                continue;
+
+            pending_ops_ = 0;
+            lock.unlock();
+
+            {
+                std::shared_lock<std::shared_mutex> db_lock(mutex_);
+                if (!pager_->sync())
+                    sync_failed_ = true;
+            }
+
+            lock.lock();
+        }
     }
 }
@@ -7,44 +7,94 @@
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-#include <io.h>
+#include <winioctl.h>
+#include <malloc.h>
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #endif
 
 namespace niffler {
 
-    const char *get_file_mode(file_mode mode)
+    static
+    void copy_file_path(char *dest, const char *path)
+    {
+        const auto path_length = strlen(path);
+        assert(path_length < FILE_PATH_BUFFER_SIZE);
+
+        memcpy(dest, path, path_length < FILE_PATH_BUFFER_SIZE ? path_length : FILE_PATH_BUFFER_SIZE - 1);
+    }
+
+#if (defined _WIN32 || defined __WIN32__)
+
+    static
+    HANDLE open_file(const char *path, file_mode mode, bool direct_io)
     {
+        DWORD access = 0;
+        DWORD disposition = 0;
+
         switch (mode)
         {
         case file_mode::read:
-            return "rb";
+            access = GENERIC_READ;
+            disposition = OPEN_EXISTING;
+            break;
         case file_mode::write:
-            return "wb";
+            access = GENERIC_WRITE;
+            disposition = CREATE_ALWAYS;
+            break;
         case file_mode::append:
-            return "ab";
+            access = FILE_APPEND_DATA;
+            disposition = OPEN_ALWAYS;
+            break;
         case file_mode::read_update:
-            return "rb+";
+            access = GENERIC_READ | GENERIC_WRITE;
+            disposition = OPEN_EXISTING;
+            break;
         case file_mode::write_update:
-            return "wb+";
+            access = GENERIC_READ | GENERIC_WRITE;
+            disposition = CREATE_ALWAYS;
+            break;
         case file_mode::append_update:
-            return "ab+";
+            access = GENERIC_READ | FILE_APPEND_DATA;
+            disposition = OPEN_ALWAYS;
+            break;
+        case file_mode::open_update:
+            access = GENERIC_READ | GENERIC_WRITE;
+            disposition = OPEN_ALWAYS;
+            break;
         default:
-            return "";
+            return nullptr;
         }
+
+        const DWORD flags = FILE_ATTRIBUTE_NORMAL | (direct_io ? FILE_FLAG_NO_BUFFERING : 0);
+
+        auto handle = CreateFileA(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, disposition, flags, nullptr);
+        return handle == INVALID_HANDLE_VALUE ? nullptr : handle;
     }
 
-    file_handle::file_handle(const char *path, file_mode mode)
+    file_handle::file_handle(const char *path, file_mode mode, bool direct_io)
     {
-        strcpy_s(file_path, FILE_PATH_BUFFER_SIZE, path);
-        fopen_s(&file, file_path, get_file_mode(mode));
+        copy_file_path(file_path, path);
+        file = open_file(file_path, mode, direct_io);
+        this->direct_io = direct_io && file != nullptr;
         assert(file != nullptr);
     }
 
     file_handle::~file_handle()
     {
         if (file != nullptr)
-            fclose(file);
+            CloseHandle(file);
     }
 
     bool file_handle::ok() const
@@ -52,28 +102,487 @@ namespace niffler {
         return file != nullptr;
     }
 
-#if (defined _WIN32 || defined __WIN32__)
+    size_t read_at(const file_handle &handle, void *buffer, size_t size, uint64_t offset)
+    {
+        // An OVERLAPPED offset on a synchronous handle makes ReadFile a positioned read
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
 
-    int fsync(FILE *file)
+        DWORD bytes_read = 0;
+        if (!ReadFile(handle.file, buffer, static_cast<DWORD>(size), &bytes_read, &overlapped))
+            return 0;
+
+        return bytes_read;
+    }
+
+    size_t write_at(const file_handle &handle, const void *buffer, size_t size, uint64_t offset)
     {
-        auto handle = (HANDLE)_get_osfhandle(_fileno(file));
-        if (handle == INVALID_HANDLE_VALUE)
-            return -1;
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD bytes_written = 0;
+        if (!WriteFile(handle.file, buffer, static_cast<DWORD>(size), &bytes_written, &overlapped))
+            return 0;
+
+        return bytes_written;
+    }
 
-        if (!FlushFileBuffers(handle))
+    // ReadFileScatter/WriteFileGather only work on unbuffered, overlapped handles so every buffer is transferred on its own
+    size_t read_vectored_at(const file_handle &handle, const io_buffer *buffers, size_t num_buffers, uint64_t offset)
+    {
+        size_t total = 0;
+
+        for (size_t i = 0; i < num_buffers; i++)
+        {
+            const auto bytes_read = read_at(handle, buffers[i].data, buffers[i].size, offset + total);
+            total += bytes_read;
+
+            if (bytes_read < buffers[i].size)
+                break;
+        }
+
+        return total;
+    }
+
+    size_t write_vectored_at(const file_handle &handle, const io_buffer *buffers, size_t num_buffers, uint64_t offset)
+    {
+        size_t total = 0;
+
+        for (size_t i = 0; i < num_buffers; i++)
+        {
+            const auto bytes_written = write_at(handle, buffers[i].data, buffers[i].size, offset + total);
+            total += bytes_written;
+
+            if (bytes_written < buffers[i].size)
+                break;
+        }
+
+        return total;
+    }
+
+    int fsync(const file_handle &handle)
+    {
+        if (!FlushFileBuffers(handle.file))
             return -1;
 
         return 0;
     }
 
-    int ftruncate(FILE *file, size_t length)
+    int ftruncate(const file_handle &handle, size_t length)
+    {
+        FILE_END_OF_FILE_INFO info;
+        info.EndOfFile.QuadPart = static_cast<LONGLONG>(length);
+
+        return SetFileInformationByHandle(handle.file, FileEndOfFileInfo, &info, sizeof(info)) ? 0 : -1;
+    }
+
+    int fallocate(const file_handle &handle, uint64_t offset, uint64_t length)
+    {
+        // Reserve the clusters first so growing the file doesn't allocate them one write at a time
+        FILE_ALLOCATION_INFO allocation;
+        allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(offset + length);
+        if (!SetFileInformationByHandle(handle.file, FileAllocationInfo, &allocation, sizeof(allocation)))
+            return -1;
+
+        if (file_size(handle) >= offset + length)
+            return 0;
+
+        return ftruncate(handle, static_cast<size_t>(offset + length));
+    }
+
+    int punch_hole(const file_handle &handle, uint64_t offset, uint64_t length)
+    {
+        // Only sparse files give zeroed ranges back, marking a file sparse more than once does nothing
+        DWORD bytes_returned = 0;
+        if (!DeviceIoControl(handle.file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytes_returned, nullptr))
+            return -1;
+
+        FILE_ZERO_DATA_INFORMATION zero_data;
+        zero_data.FileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        zero_data.BeyondFinalZero.QuadPart = static_cast<LONGLONG>(offset + length);
+
+        return DeviceIoControl(handle.file, FSCTL_SET_ZERO_DATA, &zero_data, sizeof(zero_data), nullptr, 0, &bytes_returned, nullptr) ? 0 : -1;
+    }
+
+    size_t file_size(const file_handle &handle)
+    {
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(handle.file, &size))
+            return 0;
+
+        return static_cast<size_t>(size.QuadPart);
+    }
+
+    void *map_file(const file_handle &handle, size_t offset, size_t length)
+    {
+        const auto mapping_size = static_cast<uint64_t>(offset) + length;
+        auto mapping = CreateFileMappingA(handle.file, nullptr, PAGE_READWRITE, static_cast<DWORD>(mapping_size >> 32), static_cast<DWORD>(mapping_size), nullptr);
+        if (mapping == nullptr)
+            return nullptr;
+
+        const auto offset_64 = static_cast<uint64_t>(offset);
+        auto address = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, static_cast<DWORD>(offset_64 >> 32), static_cast<DWORD>(offset_64), length);
+
+        // The view keeps the mapping object alive
+        CloseHandle(mapping);
+
+        return address;
+    }
+
+    int unmap_file(void *address, size_t length)
+    {
+        return UnmapViewOfFile(address) ? 0 : -1;
+    }
+
+    int flush_mapped_file(void *address, size_t length)
+    {
+        return FlushViewOfFile(address, length) ? 0 : -1;
+    }
+
+    void *alloc_aligned(size_t size, size_t alignment)
+    {
+        return _aligned_malloc(size, alignment);
+    }
+
+    void free_aligned(void *address)
+    {
+        _aligned_free(address);
+    }
+
+    void *alloc_arena(size_t size, bool huge_pages)
     {
-        assert(length >= 0);
-        return _chsize(_fileno(file), static_cast<long>(length));
+        if (huge_pages)
+        {
+            // Large pages need the SeLockMemoryPrivilege, without it VirtualAlloc fails and we fall back to normal pages
+            const auto large_page_size = GetLargePageMinimum();
+            if (large_page_size != 0 && size % large_page_size == 0)
+            {
+                auto address = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+                if (address != nullptr)
+                    return address;
+            }
+        }
+
+        return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    int free_arena(void *address, size_t size)
+    {
+        return VirtualFree(address, 0, MEM_RELEASE) ? 0 : -1;
     }
 
 #else
-# error "niffler::fsync and niffler::ftruncate not implemented"
+
+    static
+    int get_open_flags(file_mode mode)
+    {
+        switch (mode)
+        {
+        case file_mode::read:
+            return O_RDONLY;
+        case file_mode::write:
+            return O_WRONLY | O_CREAT | O_TRUNC;
+        case file_mode::append:
+            return O_WRONLY | O_CREAT | O_APPEND;
+        case file_mode::read_update:
+            return O_RDWR;
+        case file_mode::write_update:
+            return O_RDWR | O_CREAT | O_TRUNC;
+        case file_mode::append_update:
+            return O_RDWR | O_CREAT | O_APPEND;
+        case file_mode::open_update:
+            return O_RDWR | O_CREAT;
+        default:
+            return O_RDONLY;
+        }
+    }
+
+    file_handle::file_handle(const char *path, file_mode mode, bool direct_io)
+    {
+        copy_file_path(file_path, path);
+        const auto flags = get_open_flags(mode) | O_CLOEXEC;
+
+#if defined(O_DIRECT)
+        if (direct_io)
+        {
+            // Not every file system supports O_DIRECT(tmpfs for example), those fall back to the page cache
+            file = ::open(file_path, flags | O_DIRECT, 0644);
+            this->direct_io = file != -1;
+        }
+#endif
+
+        if (file == -1)
+            file = ::open(file_path, flags, 0644);
+
+#if defined(__APPLE__)
+        if (direct_io && file != -1)
+            this->direct_io = ::fcntl(file, F_NOCACHE, 1) != -1;
+#endif
+
+        assert(file != -1);
+    }
+
+    file_handle::~file_handle()
+    {
+        if (file != -1)
+            ::close(file);
+    }
+
+    bool file_handle::ok() const
+    {
+        return file != -1;
+    }
+
+    size_t read_at(const file_handle &handle, void *buffer, size_t size, uint64_t offset)
+    {
+        auto dest = static_cast<char*>(buffer);
+        size_t total = 0;
+
+        // pread may return less than requested without being at the end of the file
+        while (total < size)
+        {
+            const auto result = ::pread(handle.file, dest + total, size - total, static_cast<off_t>(offset + total));
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                break;
+            }
+
+            if (result == 0)
+                break;
+
+            total += static_cast<size_t>(result);
+        }
+
+        return total;
+    }
+
+    size_t write_at(const file_handle &handle, const void *buffer, size_t size, uint64_t offset)
+    {
+        auto src = static_cast<const char*>(buffer);
+        size_t total = 0;
+
+        while (total < size)
+        {
+            const auto result = ::pwrite(handle.file, src + total, size - total, static_cast<off_t>(offset + total));
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                break;
+            }
+
+            total += static_cast<size_t>(result);
+        }
+
+        return total;
+    }
+
+    static_assert(sizeof(io_buffer) == sizeof(iovec) && offsetof(io_buffer, data) == offsetof(iovec, iov_base)
+        && offsetof(io_buffer, size) == offsetof(iovec, iov_len), "io_buffer has to match iovec");
+
+    static
+    size_t transfer_vectored_at(const file_handle &handle, const io_buffer *buffers, size_t num_buffers, uint64_t offset, bool write)
+    {
+        size_t total = 0;
+        size_t next_buffer = 0;
+        // Bytes of buffers[next_buffer] that have already been transferred
+        size_t partial = 0;
+
+        while (next_buffer < num_buffers)
+        {
+            ssize_t result = 0;
+
+            if (partial > 0)
+            {
+                // Finish a buffer the last call stopped in the middle of on its own
+                auto data = static_cast<char*>(buffers[next_buffer].data) + partial;
+                const auto size = buffers[next_buffer].size - partial;
+                result = write ? ::pwrite(handle.file, data, size, static_cast<off_t>(offset + total))
+                    : ::pread(handle.file, data, size, static_cast<off_t>(offset + total));
+            }
+            else
+            {
+                const auto count = num_buffers - next_buffer < IOV_MAX ? num_buffers - next_buffer : IOV_MAX;
+                const auto vectors = reinterpret_cast<const iovec*>(buffers + next_buffer);
+                result = write ? ::pwritev(handle.file, vectors, static_cast<int>(count), static_cast<off_t>(offset + total))
+                    : ::preadv(handle.file, vectors, static_cast<int>(count), static_cast<off_t>(offset + total));
+            }
+
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                break;
+            }
+
+            if (result == 0)
+                break;
+
+            total += static_cast<size_t>(result);
+
+            // Skip the buffers that are done
+            auto remaining = static_cast<size_t>(result) + partial;
+            partial = 0;
+
+            while (next_buffer < num_buffers && remaining >= buffers[next_buffer].size)
+            {
+                remaining -= buffers[next_buffer].size;
+                next_buffer++;
+            }
+
+            partial = remaining;
+        }
+
+        return total;
+    }
+
+    size_t read_vectored_at(const file_handle &handle, const io_buffer *buffers, size_t num_buffers, uint64_t offset)
+    {
+        return transfer_vectored_at(handle, buffers, num_buffers, offset, false);
+    }
+
+    size_t write_vectored_at(const file_handle &handle, const io_buffer *buffers, size_t num_buffers, uint64_t offset)
+    {
+        return transfer_vectored_at(handle, buffers, num_buffers, offset, true);
+    }
+
+    int fsync(const file_handle &handle)
+    {
+#if defined(__linux__)
+        // The pager doesn't rely on timestamps so there is no need to flush them
+        return ::fdatasync(handle.file);
+#else
+        return ::fsync(handle.file);
+#endif
+    }
+
+    int ftruncate(const file_handle &handle, size_t length)
+    {
+        return ::ftruncate(handle.file, static_cast<off_t>(length));
+    }
+
+    int fallocate(const file_handle &handle, uint64_t offset, uint64_t length)
+    {
+#if defined(__linux__)
+        while (::fallocate(handle.file, 0, static_cast<off_t>(offset), static_cast<off_t>(length)) != 0)
+        {
+            if (errno != EINTR)
+                return -1;
+        }
+
+        return 0;
+#elif defined(__APPLE__)
+        // Ask for a contiguous range first and take whatever is available if there isn't one
+        fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, static_cast<off_t>(length), 0 };
+        if (::fcntl(handle.file, F_PREALLOCATE, &store) == -1)
+        {
+            store.fst_flags = F_ALLOCATEALL;
+            if (::fcntl(handle.file, F_PREALLOCATE, &store) == -1)
+                return -1;
+        }
+
+        if (file_size(handle) >= offset + length)
+            return 0;
+
+        return ftruncate(handle, static_cast<size_t>(offset + length));
+#else
+        return ::posix_fallocate(handle.file, static_cast<off_t>(offset), static_cast<off_t>(length)) == 0 ? 0 : -1;
+#endif
+    }
+
+    int punch_hole(const file_handle &handle, uint64_t offset, uint64_t length)
+    {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        while (::fallocate(handle.file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length)) != 0)
+        {
+            if (errno != EINTR)
+                return -1;
+        }
+
+        return 0;
+#elif defined(__APPLE__) && defined(F_PUNCHHOLE)
+        fpunchhole_t hole = { 0, 0, static_cast<off_t>(offset), static_cast<off_t>(length) };
+        return ::fcntl(handle.file, F_PUNCHHOLE, &hole) == -1 ? -1 : 0;
+#else
+        return -1;
+#endif
+    }
+
+    size_t file_size(const file_handle &handle)
+    {
+        struct stat st;
+        if (::fstat(handle.file, &st) != 0)
+            return 0;
+
+        return static_cast<size_t>(st.st_size);
+    }
+
+    void *map_file(const file_handle &handle, size_t offset, size_t length)
+    {
+        auto address = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, handle.file, static_cast<off_t>(offset));
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    int unmap_file(void *address, size_t length)
+    {
+        return ::munmap(address, length);
+    }
+
+    int flush_mapped_file(void *address, size_t length)
+    {
+        return ::msync(address, length, MS_SYNC);
+    }
+
+    void *alloc_aligned(size_t size, size_t alignment)
+    {
+        void *address = nullptr;
+        if (::posix_memalign(&address, alignment, size) != 0)
+            return nullptr;
+
+        return address;
+    }
+
+    void free_aligned(void *address)
+    {
+        ::free(address);
+    }
+
+    void *alloc_arena(size_t size, bool huge_pages)
+    {
+#if defined(MAP_HUGETLB)
+        // Explicit huge pages only work if the system has reserved some(vm.nr_hugepages)
+        if (huge_pages)
+        {
+            auto address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (address != MAP_FAILED)
+                return address;
+        }
+#endif
+
+        auto address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED)
+            return nullptr;
+
+#if defined(MADV_HUGEPAGE)
+        if (huge_pages)
+            ::madvise(address, size, MADV_HUGEPAGE);
+#endif
+
+        return address;
+    }
+
+    int free_arena(void *address, size_t size)
+    {
+        return ::munmap(address, size);
+    }
+
 #endif
 
 }
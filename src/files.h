@@ -1,6 +1,7 @@
 #pragma once
 
-#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 namespace niffler {
 
@@ -10,20 +11,68 @@ namespace niffler {
         append,
         read_update,
         write_update,
-        append_update
+        append_update,
+        // Like read_update but creates the file if it doesn't exist
+        open_update
     };
 
     constexpr size_t FILE_PATH_BUFFER_SIZE = 1024;
+    // Buffers, offsets and sizes used with a direct I/O handle have to be multiples of this
+    constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+    // Arena sizes have to be a multiple of this so they can be backed by huge pages
+    constexpr size_t ARENA_ALIGNMENT = 2 * 1024 * 1024;
+
+    // One piece of a vectored transfer. Has the same layout as struct iovec so it can be handed to the OS as is
+    struct io_buffer {
+        void *data;
+        size_t size;
+    };
 
     struct file_handle {
-        FILE *file = nullptr;
+#if (defined _WIN32 || defined __WIN32__)
+        // HANDLE, void* to avoid pulling windows.h into every file
+        void *file = nullptr;
+#else
+        int file = -1;
+#endif
         char file_path[FILE_PATH_BUFFER_SIZE] = { 0 };
+        // Set if the file was opened with direct_io and the file system supports it
+        bool direct_io = false;
 
-        file_handle(const char *path, file_mode mode);
+        file_handle(const char *path, file_mode mode, bool direct_io = false);
         ~file_handle();
         bool ok() const;
     };
 
-    int fsync(FILE *file);
-    int ftruncate(FILE *file, size_t length);
-}
\ No newline at end of file
+    // Positioned reads/writes don't use or move a shared file position so they can be called from multiple threads at once.
+    // Both return the number of bytes transferred, which is less than size at the end of the file or on error
+    size_t read_at(const file_handle &handle, void *buffer, size_t size, uint64_t offset);
+    size_t write_at(const file_handle &handle, const void *buffer, size_t size, uint64_t offset);
+    // Like read_at/write_at for a range of the file that is scattered over several buffers, transferred with as few calls as possible(preadv/pwritev)
+    size_t read_vectored_at(const file_handle &handle, const io_buffer *buffers, size_t num_buffers, uint64_t offset);
+    size_t write_vectored_at(const file_handle &handle, const io_buffer *buffers, size_t num_buffers, uint64_t offset);
+
+    int fsync(const file_handle &handle);
+    int ftruncate(const file_handle &handle, size_t length);
+    // Allocates disk space for the range and grows the file to cover it, the new part reads as zeros. Returns -1 if the
+    // file system can't preallocate
+    int fallocate(const file_handle &handle, uint64_t offset, uint64_t length);
+    // Gives the disk space of the range back, it reads as zeros afterwards and the file size doesn't change. Returns -1 if the
+    // file system can't punch holes
+    int punch_hole(const file_handle &handle, uint64_t offset, uint64_t length);
+    size_t file_size(const file_handle &handle);
+
+    // offset has to be a multiple of the OS allocation granularity and the file has to be at least offset + length bytes
+    void *map_file(const file_handle &handle, size_t offset, size_t length);
+    int unmap_file(void *address, size_t length);
+    int flush_mapped_file(void *address, size_t length);
+
+    // alignment has to be a power of two, memory has to be released with free_aligned
+    void *alloc_aligned(size_t size, size_t alignment);
+    void free_aligned(void *address);
+
+    // Reserves a large block of zeroed, page aligned memory straight from the OS. With huge_pages it tries explicit huge pages first
+    // (MAP_HUGETLB, MEM_LARGE_PAGES) and falls back to normal pages, on Linux those are marked for transparent huge pages
+    void *alloc_arena(size_t size, bool huge_pages);
+    int free_arena(void *address, size_t size);
+}
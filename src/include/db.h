@@ -1,9 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <shared_mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
 
 #include "define.h"
+#include "options.h"
 
 namespace niffler {
 
@@ -23,27 +33,89 @@ namespace niffler {
     };
 
     constexpr u32 KEY_SIZE = 16;
-
+    // Characters of the longest key, the first byte holds the length
+    constexpr u32 MAX_KEY_LENGTH = KEY_SIZE - 1;
+    // First byte of an integer key instead of a length
+    constexpr u8 INTEGER_KEY_TAG = 0xff;
+    // First byte of a key made from a string longer than MAX_KEY_LENGTH. Such a key is never stored, inserts reject it and finds
+    // and removes don't match it
+    constexpr u8 OVERSIZED_KEY_TAG = 0xfe;
+
+    // Keys are kept, in memory and on disk, in an encoding that orders like the string they were made from(shorter strings first,
+    // then byte by byte) under a plain memcmp of all KEY_SIZE bytes: the length, the characters and zeros after them.
+    // Integer keys(key::integer) are INTEGER_KEY_TAG followed by the value as a big-endian integer with the sign bit flipped,
+    // so they order like the numbers and not like their decimal strings. key(int) is still a string key
     struct key {
-        char data[KEY_SIZE] = { 0 };
+        u8 data[KEY_SIZE] = { 0 };
 
         inline key() {}
 
         inline key(int key) {
-            _itoa_s(key, data, 10);
+            char buffer[KEY_SIZE];
+            snprintf(buffer, sizeof(buffer), "%d", key);
+            set(buffer, strlen(buffer));
         }
 
         inline key(const char *key) {
-            strcpy_s(data, sizeof(data), key);
+            // Keys longer than MAX_KEY_LENGTH are rejected, see OVERSIZED_KEY_TAG
+            set(key, strlen(key));
+        }
+
+        static inline key integer(i64 value) {
+            key k;
+            k.data[0] = INTEGER_KEY_TAG;
+
+            const auto bits = static_cast<u64>(value) ^ (u64(1) << 63);
+            for (auto i = 0u; i < sizeof(bits); i++)
+            {
+                k.data[1 + i] = static_cast<u8>(bits >> (56 - 8 * i));
+            }
+
+            return k;
+        }
+
+        inline bool is_integer() const { return data[0] == INTEGER_KEY_TAG; }
+        // False for a key made from a string longer than MAX_KEY_LENGTH
+        inline bool is_valid() const { return data[0] <= MAX_KEY_LENGTH || is_integer(); }
+
+        inline i64 to_integer() const {
+            u64 bits = 0;
+            for (auto i = 0u; i < sizeof(bits); i++)
+            {
+                bits = (bits << 8) | data[1 + i];
+            }
+
+            return static_cast<i64>(bits ^ (u64(1) << 63));
+        }
+
+        // Length of a string key
+        inline u32 length() const { return data[0]; }
+        // Characters of a string key, not null terminated, use to_string for a C string
+        inline const char *chars() const { return reinterpret_cast<const char*>(data + 1); }
+        inline std::string to_string() const
+        {
+            if (is_integer())
+                return std::to_string(to_integer());
+
+            return is_valid() ? std::string(chars(), length()) : std::string();
+        }
+
+    private:
+        inline void set(const char *chars, size_t length) {
+            // Cutting it to MAX_KEY_LENGTH would make it equal to every other key that starts the same way
+            if (length > MAX_KEY_LENGTH)
+            {
+                data[0] = OVERSIZED_KEY_TAG;
+                return;
+            }
+
+            data[0] = static_cast<u8>(length);
+            memcpy(data + 1, chars, length);
         }
     };
 
     inline int key_cmp(const key &lhs, const key &rhs) {
-        const auto len_diff = strlen(lhs.data) - strlen(rhs.data);
-        if (len_diff == 0)
-            return strcmp(lhs.data, rhs.data);
-
-        return len_diff;
+        return memcmp(lhs.data, rhs.data, KEY_SIZE);
     }
 
     inline bool operator==(const key& lhs, const key& rhs) { return key_cmp(lhs, rhs) == 0; }
@@ -56,21 +128,51 @@ namespace niffler {
     class pager;
     template<u32 N> class bp_tree;
 
+    // One tree instantiation per supported page size, the order is picked from the page size of the file
+    using bp_tree_ptr = std::variant<
+        bp_tree<tree_order(4 * 1024)>*,
+        bp_tree<tree_order(8 * 1024)>*,
+        bp_tree<tree_order(16 * 1024)>*,
+        bp_tree<tree_order(32 * 1024)>*,
+        bp_tree<tree_order(64 * 1024)>*>;
+
     class db
     {
     public:
         db() = delete;
-        db(const char *file_path, bool truncate_existing_file);
+        db(const char *file_path, bool truncate_existing_file, const options &opts = options());
         ~db();
 
         std::unique_ptr<find_result> find(const key& key) const;
+        // Looks up all keys at once, pages needed by several keys are read once and each tree level is read as a batch.
+        // Results are in the same order as keys
+        std::vector<std::unique_ptr<find_result>> find(const std::vector<key> &keys) const;
         bool exists(const key& key) const;
         bool insert(const key& key, const void *data, u32 data_size);
         bool remove(const key& key);
+        // Gives the space of removed records back to the file system a step at a time. Each step moves up to max_pages pages from the end of the file
+        // into free pages closer to the start, drops the free pages at the end and commits, blocking writers only for that step.
+        // Returns the number of free pages left in the file, call it until that is 0
+        u32 vacuum(u32 max_pages);
 
     private:
+        bool commit();
+        void run_flusher();
+
         pager *pager_ = nullptr;
-        bp_tree<DEFAULT_TREE_ORDER> *bp_tree_ = nullptr;
+        bp_tree_ptr bp_tree_;
         mutable std::shared_mutex mutex_;
+
+        niffler::durability durability_ = niffler::durability::full;
+        u32 sync_interval_ms_ = DEFAULT_SYNC_INTERVAL_MS;
+        u32 sync_interval_ops_ = DEFAULT_SYNC_INTERVAL_OPS;
+        // Background thread that syncs in durability::periodic
+        std::thread flusher_;
+        std::mutex flusher_mutex_;
+        std::condition_variable flusher_wakeup_;
+        u32 pending_ops_ = 0;
+        bool stop_flusher_ = false;
+        // Set if a background sync failed, reported by the next insert or remove
+        std::atomic<bool> sync_failed_ = false;
     };
 }
@@ -8,13 +8,35 @@ namespace niffler {
     using u8 = uint8_t;
     using u16 = uint16_t;
     using u32 = uint32_t;
+    using u64 = uint64_t;
+    using i64 = int64_t;
     using page_index = u32;
 
+    // Page size of new files unless options::page_size says otherwise, existing files keep the size they were created with
     constexpr u32 PAGE_SIZE = 4096;
+    constexpr u32 MIN_PAGE_SIZE = 4096;
+    constexpr u32 MAX_PAGE_SIZE = 64 * 1024;
     constexpr u32 DEFAULT_PAGER_SIZE = 1000;
+    constexpr u32 DEFAULT_PAGER_SHARDS = 16;
+    constexpr u32 DEFAULT_IO_QUEUE_DEPTH = 64;
+    constexpr u32 DEFAULT_WAL_CHECKPOINT_PAGES = 1000;
+    constexpr u32 DEFAULT_SYNC_INTERVAL_MS = 100;
+    constexpr u32 DEFAULT_SYNC_INTERVAL_OPS = 1000;
+    constexpr u32 DEFAULT_WRITER_DIRTY_PERCENT = 10;
+    constexpr u32 DEFAULT_WRITER_INTERVAL_MS = 10;
+    constexpr u32 DEFAULT_FILE_GROWTH_PAGES = 256;
+    // Memory-mapped files are mapped and grown in segments of this size, has to be a multiple of PAGE_SIZE and the OS allocation granularity
+    constexpr u32 MMAP_SEGMENT_SIZE = 64 * 1024 * 1024;
     constexpr u32 NODE_DISK_SIZE_NO_CHILDREN = sizeof(page_index) + sizeof(page_index) + sizeof(page_index) + sizeof(u32);
 
     // 24 == bp_tree_record::DISK_SIZE()
     // 8  == page_header::DISK_SIZE() 
-    constexpr u32 DEFAULT_TREE_ORDER = ((PAGE_SIZE - NODE_DISK_SIZE_NO_CHILDREN) / 24) - 8;
+    constexpr u32 tree_order(u32 page_size) { return ((page_size - NODE_DISK_SIZE_NO_CHILDREN) / 24) - 8; }
+    constexpr u32 DEFAULT_TREE_ORDER = tree_order(PAGE_SIZE);
+
+    // Page sizes are powers of two between MIN_PAGE_SIZE and MAX_PAGE_SIZE so frames stay aligned for direct I/O and mmap segments
+    constexpr bool valid_page_size(u32 page_size)
+    {
+        return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
+    }
 }
\ No newline at end of file
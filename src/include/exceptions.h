@@ -10,7 +10,7 @@ namespace niffler {
     public:
         inline niffler_exception(const std::string &message) : message_(message) {}
 
-        inline const char* what() const override
+        inline const char* what() const noexcept override
         {
             return message_.c_str();
         }
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "define.h"
+
+namespace niffler {
+
+    enum class io_mode : u8 {
+        // Pages are read into and written from memory owned by the pager
+        buffered,
+        // The file is mapped into memory in MMAP_SEGMENT_SIZE chunks and pages point straight into the mapping
+        mmap,
+        // Like buffered but bypasses the OS page cache(O_DIRECT, FILE_FLAG_NO_BUFFERING) so pages are only cached once, by the pager.
+        // Falls back to buffered I/O on file systems that don't support it
+        direct
+    };
+
+    // What a crash can cost. A clean shutdown(destroying the db) syncs everything regardless of the level
+    enum class durability : u8 {
+        // Every insert and remove is synced before it returns, nothing that has returned is lost in a crash
+        full,
+        // A background thread syncs every options::sync_interval_ms or after options::sync_interval_ops inserts and removes,
+        // whatever comes first. A crash loses at most the changes made since the last sync
+        periodic,
+        // Every change is handed to the OS when it returns but never synced, the OS writes it back when it wants to.
+        // Survives the process crashing, an OS crash or power loss can lose any change that was not checkpointed yet
+        none
+    };
+
+    struct options {
+        // Max number of pages the pager keeps in memory, pages are evicted(and written back if dirty) when the pool is full
+        u32 pager_size = DEFAULT_PAGER_SIZE;
+        // The pool is split into this many shards, each with its own lock. Small pools get fewer shards so every shard has a few frames
+        u32 pager_shards = DEFAULT_PAGER_SHARDS;
+        // Back the pool's frames with huge pages to cut TLB misses on large pools, falls back to normal pages if none are available.
+        // Not used in io_mode::mmap
+        bool huge_pages = false;
+        niffler::io_mode io_mode = niffler::io_mode::buffered;
+        // Max number of page reads/writes the pager keeps in flight when it flushes or prefetches a batch of pages.
+        // Batches are submitted through io_uring on Linux, 0 or 1 issues them one at a time
+        u32 io_queue_depth = DEFAULT_IO_QUEUE_DEPTH;
+        // Only used when a new file is created, has to be 4, 8, 16, 32 or 64 KB. Larger pages give the tree a higher fanout
+        // and fewer levels at the cost of reading and writing more bytes per node
+        u32 page_size = PAGE_SIZE;
+        // Only used when a new file is created. The tree holds key::integer keys instead of strings, keys of the other kind are
+        // never found and can't be inserted. The keys take as much space as string keys
+        bool integer_keys = false;
+        // Commits append the changed pages to a write-ahead log(<db file>-wal) and sync only the log, pages are written to the
+        // db file by a checkpoint. Without it every commit writes the changed pages in place and syncs the db file
+        bool wal = true;
+        // The log is checkpointed once it holds about this many page images
+        u32 wal_checkpoint_pages = DEFAULT_WAL_CHECKPOINT_PAGES;
+        // The file is grown this many pages at a time(fallocate) instead of one page per allocation, so it stays physically
+        // contiguous and the file system updates its metadata once per extent. 0 or 1 grows it page by page
+        u32 file_growth_pages = DEFAULT_FILE_GROWTH_PAGES;
+        // Freed pages give their disk space back(FALLOC_FL_PUNCH_HOLE) once the change that freed them is in the db file, all pages
+        // freed since the last time in one batch: every sync without a write-ahead log, every checkpoint with one. The file keeps its
+        // size and the pages stay free for reuse. Turns itself off on file systems that can't punch holes
+        bool punch_holes = false;
+        niffler::durability durability = niffler::durability::full;
+        // Only used with durability::periodic
+        u32 sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS;
+        u32 sync_interval_ops = DEFAULT_SYNC_INTERVAL_OPS;
+        // A background thread writes dirty pages to the db file whenever more than this percentage of the pool is dirty, so commits,
+        // checkpoints and evictions rarely have to write pages themselves. 0 turns it off, not used in io_mode::mmap
+        u32 writer_dirty_percent = DEFAULT_WRITER_DIRTY_PERCENT;
+        // How often the background writer checks the dirty pages
+        u32 writer_interval_ms = DEFAULT_WRITER_INTERVAL_MS;
+    };
+
+}
@@ -0,0 +1,346 @@
+#include "io_engine.h"
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NIFFLER_IO_URING
+#endif
+#endif
+
+#ifdef NIFFLER_IO_URING
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace niffler {
+
+    static
+    void complete_vectored_sync(const file_handle &handle, io_request &request)
+    {
+        size_t done = 0;
+
+        for (auto i = 0u; i < request.num_buffers; i++)
+        {
+            const auto& buffer = request.buffers[i];
+            if (done + buffer.size <= request.result)
+            {
+                done += buffer.size;
+                continue;
+            }
+
+            // The rest of a buffer that was only partly transferred is finished on its own, everything after it in one call
+            if (done < request.result)
+            {
+                const auto transferred = request.result - done;
+                auto data = static_cast<u8*>(buffer.data) + transferred;
+                const auto remaining = buffer.size - transferred;
+                const auto offset = request.offset + request.result;
+
+                const auto result = request.write ? write_at(handle, data, remaining, offset) : read_at(handle, data, remaining, offset);
+                request.result += result;
+                done += buffer.size;
+
+                if (result < remaining)
+                    return;
+
+                continue;
+            }
+
+            const auto offset = request.offset + request.result;
+            request.result += request.write ? write_vectored_at(handle, request.buffers + i, request.num_buffers - i, offset)
+                : read_vectored_at(handle, request.buffers + i, request.num_buffers - i, offset);
+            return;
+        }
+    }
+
+    static
+    void complete_sync(const file_handle &handle, io_request &request)
+    {
+        if (request.buffers != nullptr)
+        {
+            complete_vectored_sync(handle, request);
+            return;
+        }
+
+        // Finishes whatever part of the request has not been transferred yet
+        const auto remaining = request.size - request.result;
+        auto buffer = static_cast<u8*>(request.buffer) + request.result;
+        const auto offset = request.offset + request.result;
+
+        if (request.write)
+        {
+            request.result += write_at(handle, buffer, remaining, offset);
+        }
+        else
+        {
+            request.result += read_at(handle, buffer, remaining, offset);
+        }
+    }
+
+#ifdef NIFFLER_IO_URING
+
+    // io_uring is used through the raw syscalls so there is no dependency on liburing
+    struct io_ring {
+        int fd = -1;
+        u32 entries = 0;
+
+        void *sq_ptr = nullptr;
+        size_t sq_size = 0;
+        void *cq_ptr = nullptr;
+        size_t cq_size = 0;
+        io_uring_sqe *sqes = nullptr;
+        size_t sqes_size = 0;
+
+        unsigned *sq_tail = nullptr;
+        unsigned *sq_mask = nullptr;
+        unsigned *sq_array = nullptr;
+
+        unsigned *cq_head = nullptr;
+        unsigned *cq_tail = nullptr;
+        unsigned *cq_mask = nullptr;
+        io_uring_cqe *cqes = nullptr;
+    };
+
+    static
+    void destroy_ring(io_ring *ring)
+    {
+        if (ring->sqes != nullptr)
+            munmap(ring->sqes, ring->sqes_size);
+
+        if (ring->cq_ptr != nullptr && ring->cq_ptr != ring->sq_ptr)
+            munmap(ring->cq_ptr, ring->cq_size);
+
+        if (ring->sq_ptr != nullptr)
+            munmap(ring->sq_ptr, ring->sq_size);
+
+        if (ring->fd != -1)
+            close(ring->fd);
+
+        delete ring;
+    }
+
+    static
+    void *map_ring(int fd, size_t size, off_t offset)
+    {
+        auto address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    static
+    io_ring *create_ring(u32 queue_depth)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        const auto fd = static_cast<int>(syscall(__NR_io_uring_setup, queue_depth, &params));
+        if (fd < 0)
+            return nullptr;
+
+        auto ring = new io_ring();
+        ring->fd = fd;
+        ring->entries = params.sq_entries;
+        ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        // Newer kernels map both rings with a single mmap
+        const auto single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap && ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+
+        ring->sq_ptr = map_ring(fd, ring->sq_size, IORING_OFF_SQ_RING);
+        ring->cq_ptr = single_mmap ? ring->sq_ptr : map_ring(fd, ring->cq_size, IORING_OFF_CQ_RING);
+        ring->sqes = static_cast<io_uring_sqe*>(map_ring(fd, ring->sqes_size, IORING_OFF_SQES));
+
+        if (ring->sq_ptr == nullptr || ring->cq_ptr == nullptr || ring->sqes == nullptr)
+        {
+            destroy_ring(ring);
+            return nullptr;
+        }
+
+        auto sq = static_cast<u8*>(ring->sq_ptr);
+        ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        auto cq = static_cast<u8*>(ring->cq_ptr);
+        ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        return ring;
+    }
+
+    io_engine::io_engine(const file_handle &handle, u32 queue_depth)
+        :
+        handle_(handle)
+    {
+        // A queue depth of 1 gains nothing over plain positioned I/O
+        if (queue_depth > 1)
+            ring_ = create_ring(queue_depth);
+    }
+
+    io_engine::~io_engine()
+    {
+        if (ring_ != nullptr)
+        {
+            destroy_ring(ring_);
+            ring_ = nullptr;
+        }
+    }
+
+    bool io_engine::submit_async(io_request *requests, u32 num_requests)
+    {
+        auto next_request = 0u;
+
+        while (next_request < num_requests)
+        {
+            const auto remaining = num_requests - next_request;
+            const auto batch_size = remaining < ring_->entries ? remaining : ring_->entries;
+
+            // Only this thread writes the submission queue tail so a plain read is fine
+            auto tail = *ring_->sq_tail;
+            for (auto i = 0u; i < batch_size; i++)
+            {
+                auto& request = requests[next_request + i];
+                request.result = 0;
+
+                const auto index = tail & *ring_->sq_mask;
+                auto sqe = &ring_->sqes[index];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->fd = handle_.file;
+                sqe->off = request.offset;
+
+                if (request.buffers != nullptr)
+                {
+                    // io_buffer has the same layout as iovec
+                    sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+                    sqe->addr = reinterpret_cast<u64>(request.buffers);
+                    sqe->len = request.num_buffers;
+                }
+                else
+                {
+                    sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+                    sqe->addr = reinterpret_cast<u64>(request.buffer);
+                    sqe->len = request.size;
+                }
+                sqe->user_data = next_request + i;
+
+                ring_->sq_array[index] = index;
+                tail++;
+            }
+
+            __atomic_store_n(ring_->sq_tail, tail, __ATOMIC_RELEASE);
+
+            auto to_submit = batch_size;
+            auto num_completed = 0u;
+
+            while (num_completed < batch_size)
+            {
+                const auto submitted = static_cast<int>(syscall(__NR_io_uring_enter, ring_->fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (submitted < 0)
+                {
+                    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                        continue;
+
+                    // The ring is in an unknown state, tear it down(which waits for in flight requests) and finish synchronously
+                    destroy_ring(ring_);
+                    ring_ = nullptr;
+                    submit_sync(requests + next_request, num_requests - next_request);
+                    break;
+                }
+
+                to_submit -= static_cast<u32>(submitted) < to_submit ? static_cast<u32>(submitted) : to_submit;
+
+                auto head = *ring_->cq_head;
+                const auto cq_tail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+
+                while (head != cq_tail)
+                {
+                    const auto &cqe = ring_->cqes[head & *ring_->cq_mask];
+                    auto& request = requests[cqe.user_data];
+                    request.result = cqe.res > 0 ? static_cast<size_t>(cqe.res) : 0;
+
+                    // Short transfers and kernels without IORING_OP_READ/WRITE(-EINVAL) are finished with a blocking call
+                    if (request.result < request.size)
+                        complete_sync(handle_, request);
+
+                    head++;
+                    num_completed++;
+                }
+
+                __atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+            }
+
+            if (ring_ == nullptr)
+                break;
+
+            next_request += batch_size;
+        }
+
+        for (auto i = 0u; i < num_requests; i++)
+        {
+            if (requests[i].result != requests[i].size)
+                return false;
+        }
+
+        return true;
+    }
+
+#else
+
+    struct io_ring {};
+
+    io_engine::io_engine(const file_handle &handle, u32 queue_depth)
+        :
+        handle_(handle)
+    {
+    }
+
+    io_engine::~io_engine()
+    {
+    }
+
+    bool io_engine::submit_async(io_request *requests, u32 num_requests)
+    {
+        return submit_sync(requests, num_requests);
+    }
+
+#endif
+
+    bool io_engine::async() const
+    {
+        return ring_ != nullptr;
+    }
+
+    bool io_engine::submit(io_request *requests, u32 num_requests)
+    {
+        if (ring_ != nullptr)
+            return submit_async(requests, num_requests);
+
+        return submit_sync(requests, num_requests);
+    }
+
+    bool io_engine::submit_sync(io_request *requests, u32 num_requests)
+    {
+        auto ok = true;
+
+        for (auto i = 0u; i < num_requests; i++)
+        {
+            auto& request = requests[i];
+            request.result = 0;
+            complete_sync(handle_, request);
+
+            ok = ok && request.result == request.size;
+        }
+
+        return ok;
+    }
+
+}
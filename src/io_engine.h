@@ -0,0 +1,46 @@
+#pragma once
+
+#include "include/define.h"
+#include "files.h"
+
+namespace niffler {
+
+    struct io_ring;
+
+    struct io_request {
+        void *buffer = nullptr;
+        u32 size = 0;
+        // If set the request transfers these buffers back to back instead of buffer, size has to be their total size.
+        // They have to stay valid until the request has completed
+        const io_buffer *buffers = nullptr;
+        u32 num_buffers = 0;
+        u64 offset = 0;
+        bool write = false;
+        // Number of bytes transferred, set when the request completes
+        size_t result = 0;
+    };
+
+    // Issues batches of positioned reads/writes against a file. On Linux a batch is submitted through io_uring so up to
+    // queue_depth requests are in flight at the same time, everywhere else(or if io_uring is not available) requests are issued one at a time
+    class io_engine
+    {
+    public:
+        io_engine(const file_handle &handle, u32 queue_depth);
+        ~io_engine();
+
+        io_engine(const io_engine&) = delete;
+        io_engine &operator=(const io_engine&) = delete;
+
+        bool async() const;
+        // Blocks until every request has completed, returns false if any request transferred less than its size
+        bool submit(io_request *requests, u32 num_requests);
+
+    private:
+        bool submit_sync(io_request *requests, u32 num_requests);
+        bool submit_async(io_request *requests, u32 num_requests);
+
+        const file_handle &handle_;
+        io_ring *ring_ = nullptr;
+    };
+
+}
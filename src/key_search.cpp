@@ -0,0 +1,279 @@
+#include "key_search.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+// SSE2 is part of x86-64. AVX2 is only used when a search asks for key_kernel::avx2 and the cpu reports it at runtime
+#define NIFFLER_KEY_SIMD
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(NIFFLER_KEY_SIMD) && !defined(_MSC_VER)
+#define NIFFLER_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define NIFFLER_TARGET_AVX2
+#endif
+
+namespace niffler {
+
+    struct key_search_functions {
+        u32 (*count_not_greater)(const key &probe, const u8 *keys, size_t stride, u32 count);
+        u32 (*upper_bound_key)(const u8 *keys, size_t stride, u32 count, const key &probe);
+    };
+
+    static
+    const key &key_at(const u8 *keys, size_t stride, u32 index)
+    {
+        return *reinterpret_cast<const key*>(keys + index * stride);
+    }
+
+    static
+    u32 count_not_greater_scalar(const key &probe, const u8 *keys, size_t stride, u32 count)
+    {
+        u32 result = 0;
+        for (auto i = 0u; i < count; i++)
+        {
+            result += key_cmp(key_at(keys, stride, i), probe) <= 0;
+        }
+
+        return result;
+    }
+
+    static
+    u32 upper_bound_key_scalar(const u8 *keys, size_t stride, u32 count, const key &probe)
+    {
+        u32 low = 0;
+        u32 high = count;
+
+        while (high - low > KEY_SEARCH_RUN)
+        {
+            const auto mid = low + (high - low) / 2;
+            if (key_cmp(key_at(keys, stride, mid), probe) > 0)
+            {
+                high = mid;
+            }
+            else
+            {
+                low = mid + 1;
+            }
+        }
+
+        return low + count_not_greater_scalar(probe, keys + low * stride, stride, high - low);
+    }
+
+#if defined(NIFFLER_KEY_SIMD)
+    // Decides key <= probe from 16 bit masks of one key: the bytes equal to the probe and the bytes that are less than or
+    // equal to it(unsigned like memcmp). Branch free, the first different byte orders the keys
+    static inline
+    u32 not_greater(u32 equal_mask, u32 less_equal_mask)
+    {
+        const auto diff = ~equal_mask & 0xffff;
+        const auto first_diff = diff & (0u - diff);
+
+        return (diff == 0) | ((less_equal_mask & first_diff) != 0);
+    }
+
+    // The 128 bit helpers are inlined into the AVX2 kernels as well, where they are VEX encoded and don't pay for switching
+    // between SSE and AVX code
+    static inline
+    u32 not_greater(__m128i probe, const u8 *key)
+    {
+        const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+        const auto equal_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, probe));
+        const auto less_equal_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(bytes, probe), bytes));
+
+        return not_greater(static_cast<u32>(equal_mask), static_cast<u32>(less_equal_mask));
+    }
+
+    static inline
+    u32 binary_search_sse2(__m128i probe, const u8 *keys, size_t stride, u32 &low, u32 high)
+    {
+        while (high - low > KEY_SEARCH_RUN)
+        {
+            const auto mid = low + (high - low) / 2;
+            if (not_greater(probe, keys + mid * stride))
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+
+        return high;
+    }
+
+    static
+    u32 count_not_greater_sse2(const key &probe, const u8 *keys, size_t stride, u32 count)
+    {
+        const auto probe_bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(probe.data));
+
+        u32 result = 0;
+        for (auto i = 0u; i < count; i++)
+        {
+            result += not_greater(probe_bytes, keys + i * stride);
+        }
+
+        return result;
+    }
+
+    static
+    u32 upper_bound_key_sse2(const u8 *keys, size_t stride, u32 count, const key &probe)
+    {
+        const auto probe_bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(probe.data));
+
+        u32 low = 0;
+        const auto high = binary_search_sse2(probe_bytes, keys, stride, low, count);
+
+        auto result = low;
+        for (auto i = low; i < high; i++)
+        {
+            result += not_greater(probe_bytes, keys + i * stride);
+        }
+
+        return result;
+    }
+
+    // Two keys per register, the low and high 16 bits of every mask belong to the first and second key
+    NIFFLER_TARGET_AVX2 static inline
+    u32 count_run_avx2(__m128i probe, const u8 *keys, size_t stride, u32 count)
+    {
+        const auto probe_bytes = _mm256_broadcastsi128_si256(probe);
+
+        u32 result = 0;
+        auto i = 0u;
+        for (; i + 2 <= count; i += 2)
+        {
+            const auto first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i * stride));
+            const auto second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + (i + 1) * stride));
+            const auto bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+
+            const auto equal_mask = static_cast<u32>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, probe_bytes)));
+            const auto less_equal_mask = static_cast<u32>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(bytes, probe_bytes), bytes)));
+
+            result += not_greater(equal_mask & 0xffff, less_equal_mask & 0xffff);
+            result += not_greater(equal_mask >> 16, less_equal_mask >> 16);
+        }
+
+        if (i < count)
+            result += not_greater(probe, keys + i * stride);
+
+        return result;
+    }
+
+    NIFFLER_TARGET_AVX2 static
+    u32 count_not_greater_avx2(const key &probe, const u8 *keys, size_t stride, u32 count)
+    {
+        const auto probe_bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(probe.data));
+        return count_run_avx2(probe_bytes, keys, stride, count);
+    }
+
+    NIFFLER_TARGET_AVX2 static
+    u32 upper_bound_key_avx2(const u8 *keys, size_t stride, u32 count, const key &probe)
+    {
+        const auto probe_bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(probe.data));
+
+        u32 low = 0;
+        const auto high = binary_search_sse2(probe_bytes, keys, stride, low, count);
+
+        return low + count_run_avx2(probe_bytes, keys + low * stride, stride, high - low);
+    }
+
+    static
+    bool detect_avx2()
+    {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        // The OS has to save the YMM registers(OSXSAVE and AVX, then XCR0 bits 1 and 2)
+        const auto os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        if (!os_saves_ymm)
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        // Also called while static objects are constructed, before the runtime would have initialized the cpu model
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    static
+    bool cpu_supports_avx2()
+    {
+        // Checked once, the searches that are given a kernel ask on every call
+        static const auto supported = detect_avx2();
+        return supported;
+    }
+#endif
+
+    bool key_kernel_supported(key_kernel kernel)
+    {
+        switch (kernel)
+        {
+#if defined(NIFFLER_KEY_SIMD)
+        case key_kernel::sse2:
+            return true;
+        case key_kernel::avx2:
+            return cpu_supports_avx2();
+#endif
+        case key_kernel::scalar:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    key_kernel default_key_kernel()
+    {
+        // AVX2 compares two keys per instruction but the masks of every key are still decoded one by one, in BENCHMARK.KEY_SEARCH_KERNELS
+        // it is no faster than SSE2 for the runs a search ends with so it is only used when asked for
+        static const auto kernel = key_kernel_supported(key_kernel::sse2) ? key_kernel::sse2 : key_kernel::scalar;
+        return kernel;
+    }
+
+    static
+    key_search_functions kernel_functions(key_kernel kernel)
+    {
+        if (!key_kernel_supported(kernel))
+            return { count_not_greater_scalar, upper_bound_key_scalar };
+
+        switch (kernel)
+        {
+#if defined(NIFFLER_KEY_SIMD)
+        case key_kernel::sse2:
+            return { count_not_greater_sse2, upper_bound_key_sse2 };
+        case key_kernel::avx2:
+            return { count_not_greater_avx2, upper_bound_key_avx2 };
+#endif
+        default:
+            return { count_not_greater_scalar, upper_bound_key_scalar };
+        }
+    }
+
+    static const key_search_functions best_functions = kernel_functions(default_key_kernel());
+
+    u32 upper_bound_key(const u8 *keys, size_t stride, u32 count, const key &probe)
+    {
+        return best_functions.upper_bound_key(keys, stride, count, probe);
+    }
+
+    u32 upper_bound_key(key_kernel kernel, const u8 *keys, size_t stride, u32 count, const key &probe)
+    {
+        return kernel_functions(kernel).upper_bound_key(keys, stride, count, probe);
+    }
+
+    u32 count_not_greater(const key &probe, const u8 *keys, size_t stride, u32 count)
+    {
+        return best_functions.count_not_greater(probe, keys, stride, count);
+    }
+
+    u32 count_not_greater(key_kernel kernel, const key &probe, const u8 *keys, size_t stride, u32 count)
+    {
+        return kernel_functions(kernel).count_not_greater(probe, keys, stride, count);
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "include/db.h"
+#include "include/define.h"
+
+namespace niffler {
+
+    // Kernels that compare a probe key against a run of keys stored stride bytes apart, like the children of a node or the
+    // records of a leaf. They all order keys like key_cmp. Keys fit in one SSE register so the SIMD kernels compare all 16 bytes
+    // of a key(two keys with AVX2) at once and take the order from the first different byte
+    enum class key_kernel : u8 {
+        scalar,
+        sse2,
+        // Never the default, only used by the searches that are given it
+        avx2
+    };
+
+    bool key_kernel_supported(key_kernel kernel);
+    // Kernel used by the searches without a kernel argument: SSE2 where it is supported, otherwise the scalar one
+    key_kernel default_key_kernel();
+
+    // Keys a binary search narrows a search down to before they are compared in one go
+    constexpr u32 KEY_SEARCH_RUN = 16;
+
+    // Index of the first of count sorted keys that is greater than probe, count if there is none. Binary search down to
+    // KEY_SEARCH_RUN keys, then the rest are counted with count_not_greater
+    u32 upper_bound_key(const u8 *keys, size_t stride, u32 count, const key &probe);
+    u32 upper_bound_key(key_kernel kernel, const u8 *keys, size_t stride, u32 count, const key &probe);
+
+    // Number of the count keys that are not greater than probe. For sorted keys that's the index of the first greater key
+    u32 count_not_greater(const key &probe, const u8 *keys, size_t stride, u32 count);
+    // Same with the given kernel, falls back to the scalar one if the cpu doesn't support it
+    u32 count_not_greater(key_kernel kernel, const key &probe, const u8 *keys, size_t stride, u32 count);
+}
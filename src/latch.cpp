@@ -0,0 +1,121 @@
+#include "latch.h"
+
+#include <assert.h>
+#include <thread>
+
+#if (defined _WIN32 || defined __WIN32__)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace niffler {
+
+    constexpr u32 LATCH_SPIN_COUNT = 64;
+
+    static
+    void cpu_relax()
+    {
+#if (defined _WIN32 || defined __WIN32__) || defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    static
+    void backoff(u32 &spins)
+    {
+        if (spins < LATCH_SPIN_COUNT)
+        {
+            spins++;
+            cpu_relax();
+            return;
+        }
+
+        std::this_thread::yield();
+    }
+
+    bool rw_latch::try_lock_shared()
+    {
+        auto state = state_.load(std::memory_order_relaxed);
+
+        if ((state & (WRITER | WRITER_WAITING)) != 0)
+            return false;
+
+        assert((state & READERS_MASK) != READERS_MASK);
+        return state_.compare_exchange_weak(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void rw_latch::lock_shared()
+    {
+        auto spins = 0u;
+        while (!try_lock_shared())
+        {
+            backoff(spins);
+        }
+    }
+
+    void rw_latch::unlock_shared()
+    {
+        assert((state_.load(std::memory_order_relaxed) & READERS_MASK) > 0);
+        state_.fetch_sub(1, std::memory_order_release);
+    }
+
+    bool rw_latch::try_lock()
+    {
+        auto state = state_.load(std::memory_order_relaxed);
+
+        if ((state & (WRITER | READERS_MASK)) != 0)
+            return false;
+
+        // Taking the latch also clears WRITER_WAITING, other waiting writers set it again
+        return state_.compare_exchange_weak(state, WRITER, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void rw_latch::lock()
+    {
+        auto spins = 0u;
+        while (!try_lock())
+        {
+            state_.fetch_or(WRITER_WAITING, std::memory_order_relaxed);
+            backoff(spins);
+        }
+    }
+
+    void rw_latch::unlock()
+    {
+        assert((state_.load(std::memory_order_relaxed) & WRITER) != 0);
+        state_.fetch_and(~WRITER, std::memory_order_release);
+    }
+
+    void rw_latch::lock(latch_mode mode)
+    {
+        switch (mode)
+        {
+        case latch_mode::shared:
+            lock_shared();
+            break;
+        case latch_mode::exclusive:
+            lock();
+            break;
+        default:
+            break;
+        }
+    }
+
+    void rw_latch::unlock(latch_mode mode)
+    {
+        switch (mode)
+        {
+        case latch_mode::shared:
+            unlock_shared();
+            break;
+        case latch_mode::exclusive:
+            unlock();
+            break;
+        default:
+            break;
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+
+#include "include/define.h"
+
+namespace niffler {
+
+    enum class latch_mode : u8 {
+        none,
+        shared,
+        exclusive
+    };
+
+    // Reader/writer latch small enough to live in every pager frame. Waiters spin for a short while and then yield,
+    // latches are only held while a single node is read or changed so they are expected to be released quickly.
+    // A waiting writer keeps new readers out so writers are not starved by a steady stream of readers
+    class rw_latch
+    {
+    public:
+        rw_latch() = default;
+        rw_latch(const rw_latch&) = delete;
+        rw_latch &operator=(const rw_latch&) = delete;
+
+        void lock_shared();
+        void unlock_shared();
+        bool try_lock_shared();
+
+        void lock();
+        void unlock();
+        bool try_lock();
+
+        void lock(latch_mode mode);
+        void unlock(latch_mode mode);
+
+    private:
+        static constexpr u32 WRITER = 1u << 31;
+        static constexpr u32 WRITER_WAITING = 1u << 30;
+        static constexpr u32 READERS_MASK = WRITER_WAITING - 1;
+
+        std::atomic<u32> state_ = { 0 };
+    };
+
+}
@@ -1,50 +1,269 @@
 #include "pager.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <chrono>
+#include <stdio.h>
 #include <string.h>
+#include <thread>
+#include <utility>
 
+#include "include/exceptions.h"
 #include "serialization.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace niffler {
 
-    pager::pager(const char *file_path, bool truncate_existing_file)
+    static
+    u32 lowest_set_bit(u64 word)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, word);
+        return static_cast<u32>(index);
+#else
+        return static_cast<u32>(__builtin_ctzll(word));
+#endif
+    }
+
+    page_guard::page_guard(pager *pager, page *page, latch_mode mode)
+        : pager_(pager), page_(page), mode_(mode)
+    {
+    }
+
+    page_guard::page_guard(page_guard &&other) noexcept
+        : pager_(other.pager_), page_(other.page_), mode_(other.mode_)
+    {
+        other.pager_ = nullptr;
+        other.page_ = nullptr;
+        other.mode_ = latch_mode::none;
+    }
+
+    page_guard &page_guard::operator=(page_guard &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            std::swap(pager_, other.pager_);
+            std::swap(page_, other.page_);
+            std::swap(mode_, other.mode_);
+        }
+
+        return *this;
+    }
+
+    page_guard::~page_guard()
+    {
+        release();
+    }
+
+    page *page_guard::get() const
+    {
+        return page_;
+    }
+
+    page &page_guard::operator*() const
+    {
+        assert(page_ != nullptr);
+        return *page_;
+    }
+
+    page *page_guard::operator->() const
+    {
+        assert(page_ != nullptr);
+        return page_;
+    }
+
+    page_guard::operator bool() const
+    {
+        return page_ != nullptr;
+    }
+
+    void page_guard::lock(latch_mode mode)
+    {
+        assert(page_ != nullptr && mode_ == latch_mode::none);
+        page_->latch.lock(mode);
+        mode_ = mode;
+    }
+
+    latch_mode page_guard::mode() const
+    {
+        return mode_;
+    }
+
+    void page_guard::release()
+    {
+        if (page_ == nullptr)
+            return;
+
+        // Unlatch before unpinning, the frame may be reused as soon as it is unpinned
+        page_->latch.unlock(mode_);
+        pager_->unpin_page(*page_);
+        pager_ = nullptr;
+        page_ = nullptr;
+        mode_ = latch_mode::none;
+    }
+
+    // Shards smaller than this would run out of unpinned frames when a few pages are held at the same time
+    constexpr u32 MIN_FRAMES_PER_SHARD = 8;
+
+    static
+    u32 get_num_shards(const options &opts)
+    {
+        const auto max_shards = opts.pager_size / MIN_FRAMES_PER_SHARD;
+        const auto num_shards = opts.pager_shards < max_shards ? opts.pager_shards : max_shards;
+
+        return num_shards > 0 ? num_shards : 1;
+    }
+
+    pager::pager(const char *file_path, bool truncate_existing_file, const options &opts)
         :
-        file_handle_(file_path, truncate_existing_file ? file_mode::write_update : file_mode::read_update)
+        frames_(opts.pager_size),
+        shards_(get_num_shards(opts)),
+        file_handle_(file_path, truncate_existing_file ? file_mode::write_update : file_mode::read_update, opts.io_mode == io_mode::direct),
+        io_engine_(file_handle_, opts.io_queue_depth)
     {
         if (!file_handle_.ok())
             return;
 
-        pages_.resize(DEFAULT_PAGER_SIZE);
+        assert(opts.pager_size > 0);
+        io_mode_ = opts.io_mode;
+        file_growth_pages_ = opts.file_growth_pages;
+        punch_holes_ = opts.punch_holes;
+
+        if (opts.wal)
+        {
+            // Pages that were committed to the log but not checkpointed are copied into the file before its header is read
+            wal_ = std::make_unique<wal>(file_path, truncate_existing_file);
+            if (!wal_->ok() || (!truncate_existing_file && !wal_->recover(file_handle_)))
+                return;
+        }
+
+        // Spread the frames over the shards, the first shards get one extra frame if they don't divide evenly
+        const auto num_shards = static_cast<u32>(shards_.size());
+        auto first_frame = 0u;
+
+        for (auto i = 0u; i < num_shards; i++)
+        {
+            auto& shard = shards_[i];
+            shard.first_frame = first_frame;
+            shard.num_frames = opts.pager_size / num_shards + (i < opts.pager_size % num_shards ? 1 : 0);
+            first_frame += shard.num_frames;
+        }
 
         if (truncate_existing_file)
         {
-            strcpy_s(header_.version, sizeof(header_.version), "NifflerDB 0.1");
-            header_.page_size = PAGE_SIZE;
+            snprintf(header_.version, sizeof(header_.version), "%s", FILE_VERSION);
+            header_.page_size = opts.page_size;
             header_.num_pages = 1;
-            header_.last_free_list_page = 0;
-            header_.num_free_list_pages = 0;
-            save_header();
+            header_.first_bitmap_page = 0;
+            header_.num_free_pages = 0;
+            header_.num_preallocated_pages = 0;
         }
         else
         {
-            // Don't use get_page here beacuse it relies on header.page_size which has not been loaded yet
-            u8 buffer[file_header::DISK_SIZE()];
-            fseek(file_handle_.file, 0, SEEK_SET);
-            fread(buffer, file_header::DISK_SIZE(), 1, file_handle_.file);
+            // Don't use get_page here beacuse it relies on header.page_size which has not been loaded yet.
+            // Direct I/O can only read whole aligned blocks so the header is read as a full block of the smallest page size
+            auto buffer = static_cast<u8*>(alloc_aligned(MIN_PAGE_SIZE, DIRECT_IO_ALIGNMENT));
+            memset(buffer, 0, MIN_PAGE_SIZE);
+            read_at(file_handle_, buffer, MIN_PAGE_SIZE, 0);
             deserialize_file_header(buffer, header_);
+            free_aligned(buffer);
+        }
+
+        memcpy(opened_version_, header_.version, sizeof(opened_version_));
+
+        // Either an unsupported options::page_size or a file that isn't a db file, frames are not allocated so ok() fails
+        if (!valid_page_size(header_.page_size))
+            return;
+
+        if (wal_ != nullptr)
+        {
+            checkpoint_size_ = static_cast<u64>(opts.wal_checkpoint_pages) * header_.page_size;
+            if (!wal_->reset(header_.page_size))
+                return;
+        }
+
+        if (io_mode_ != io_mode::mmap && !alloc_frames(opts.huge_pages))
+            return;
+
+        if (io_mode_ == io_mode::mmap && !map_pages(header_.num_pages))
+            return;
+
+        if (!truncate_existing_file)
+        {
+            if (strncmp(header_.version, U16_PAGE_SIZE_FILE_VERSION, sizeof(header_.version)) == 0)
+            {
+                // Saved with the page size as a u32 by the first commit, until then the file can still be opened by an older version
+                snprintf(header_.version, sizeof(header_.version), "%s", FILE_VERSION);
+                header_dirty_ = true;
+                load_bitmap();
+            }
+            else if (strncmp(header_.version, FREE_LIST_FILE_VERSION, sizeof(header_.version)) == 0)
+            {
+                // Saved in the new format by the first commit, until then the file can still be opened by an older version
+                const auto last_free_list_page = header_.first_bitmap_page;
+                snprintf(header_.version, sizeof(header_.version), "%s", FILE_VERSION);
+                header_.first_bitmap_page = 0;
+                header_.num_free_pages = 0;
+                // The field didn't exist yet, the bytes may hold anything
+                header_.num_preallocated_pages = 0;
+                header_dirty_ = true;
+
+                convert_free_list(last_free_list_page);
+            }
+            else
+            {
+                load_bitmap();
+            }
+        }
+
+        // A new file can be opened again as soon as it has been created, not only after the first commit
+        if (truncate_existing_file)
+        {
+            save_header();
+            sync();
+        }
+
+        // Pages in a mapping are written back by the OS
+        if (opts.writer_dirty_percent > 0 && io_mode_ != io_mode::mmap)
+        {
+            writer_interval_ms_ = opts.writer_interval_ms > 0 ? opts.writer_interval_ms : 1;
+            writer_max_dirty_pages_ = static_cast<u32>(static_cast<u64>(opts.pager_size) * opts.writer_dirty_percent / 100);
+            writer_io_engine_ = std::make_unique<io_engine>(file_handle_, opts.io_queue_depth);
+            writer_ = std::thread(&pager::run_writer, this);
         }
     }
 
     pager::~pager()
     {
-        for (auto& p : pages_)
+        if (writer_.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(writer_mutex_);
+                stop_writer_ = true;
+            }
+
+            writer_wakeup_.notify_one();
+            writer_.join();
+        }
+
+        if (io_mode_ == io_mode::mmap)
         {
-            if (p.content != nullptr)
+            // Frames point into the mapping, there is nothing to free
+            for (auto segment : segments_)
             {
-                free(p.content);
-                p.content = nullptr;
+                unmap_file(segment, MMAP_SEGMENT_SIZE);
             }
+
+            return;
         }
+
+        if (arena_ != nullptr)
+            free_arena(arena_, arena_size_);
     }
 
     const file_header &pager::header() const
@@ -52,181 +271,1339 @@ namespace niffler {
         return header_;
     }
 
-    page &pager::get_free_page()
+    const char *pager::opened_version() const
     {
-        // No free pages, allocate a new one
-        if (header_.last_free_list_page == 0)
+        return opened_version_;
+    }
+
+    pager_stats pager::stats() const
+    {
+        pager_stats stats;
+
+        for (auto& shard : shards_)
         {
-            return alloc_page();
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.hits += shard.stats.hits;
+            stats.misses += shard.stats.misses;
+            stats.evictions += shard.stats.evictions;
+            stats.writebacks += shard.stats.writebacks;
+            stats.background_writes += shard.stats.background_writes;
         }
 
-        auto& last_free_list_page = get_page(header_.last_free_list_page);
-        free_list_header free_list_header;
-        deserialize_free_list_header(last_free_list_page.content, free_list_header);
+        return stats;
+    }
+
+    u32 pager::capacity() const
+    {
+        return static_cast<u32>(frames_.size());
+    }
+
+    u32 pager::num_shards() const
+    {
+        return static_cast<u32>(shards_.size());
+    }
+
+    page_guard pager::get_free_page(latch_mode mode, page_index hint)
+    {
+        page_guard guard;
 
-        if (free_list_header.num_pages == 0)
         {
-            // TODO: Implement actual truncation of the file to keep the file from growing and growing
-            return alloc_page();
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            guard = take_free_page(hint);
+        }
+
+        // Latch outside of the pager lock like get_page
+        guard.lock(mode);
+
+        return guard;
+    }
+
+    void pager::get_free_pages(page_index *page_indices, u32 num_pages, page_index hint)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            page_indices[i] = static_cast<page_index>(take_free_page(hint)->index);
+            hint = page_indices[i] + 1;
         }
+    }
 
-        assert(free_list_header.num_pages > 0);
-        const auto next_free_page_index = read_free_list_page_index(last_free_list_page.content, free_list_header.num_pages - 1);
+    page_guard pager::take_free_page(page_index hint)
+    {
+        // No free pages, allocate a new one
+        if (header_.num_free_pages == 0)
+            return alloc_page();
 
-        // Update num pages and save changes
-        free_list_header.num_pages--;
-        serialize_free_list_header(last_free_list_page.content, free_list_header);
-        save_page(last_free_list_page.index);
-        sync(false);
+        const auto page_index = find_free_page(hint);
+        mark_used(page_index);
 
-        return get_page(next_free_page_index);
+        return map_zeroed_page(page_index);
     }
 
     void pager::free_page(page_index page_index)
     {
-        // Allocate a new page to keep the list of free pages
-        if (header_.last_free_list_page == 0)
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        mark_free(page_index);
+    }
+
+    void pager::free_pages(const page_index *page_indices, u32 num_pages)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+        for (auto i = 0u; i < num_pages; i++)
         {
-            auto &free_list_page = alloc_page();
-            free_list_header first_free_list_header = { 0 };
-            first_free_list_header.num_pages = 1;
-            write_free_list_page_index(free_list_page.content, 0, page_index);
-            serialize_free_list_header(free_list_page.content, first_free_list_header);
-            save_page(free_list_page.index);
+            mark_free(page_indices[i]);
+        }
+    }
 
-            // Update the file header
-            header_.last_free_list_page = free_list_page.index;
-            header_.num_free_list_pages++;
-            save_header(false);
+    page_index pager::move_page(page_index page_index)
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        assert(header_.num_free_pages > 0);
 
-            sync(false);
-            return;
+        auto target = take_free_page(0);
+
+        {
+            auto source = get_page(page_index);
+            memcpy(target->content, source->content, target->size);
         }
 
-        auto& last_free_list_page = get_page(header_.last_free_list_page);
-        free_list_header current_free_list_header;
-        deserialize_free_list_header(last_free_list_page.content, current_free_list_header);
+        mark_dirty(*target);
+        mark_free(page_index);
+
+        return static_cast<niffler::page_index>(target->index);
+    }
+
+    u32 pager::truncate()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
 
-        // Space left on last_free_list_page?
-        if (current_free_list_header.num_pages < free_list_header::MAX_NUM_PAGES())
+        // Pages before this index are enough for every page in use. Bitmap pages belong to the pager, those past it are moved here
+        const auto num_used_pages = header_.num_pages - header_.num_free_pages;
+        for (size_t i = 0; i < bitmap_pages_.size(); i++)
         {
-            write_free_list_page_index(last_free_list_page.content, current_free_list_header.num_pages, page_index);
-            current_free_list_header.num_pages++;
-            serialize_free_list_header(last_free_list_page.content, current_free_list_header);
-            save_page(last_free_list_page.index);
-            sync(false);
-            return;
+            if (bitmap_pages_[i] < num_used_pages)
+                continue;
+
+            // Rewritten from bitmap_ by the next save
+            bitmap_pages_[i] = move_page(bitmap_pages_[i]);
+            bitmap_dirty_[i] = true;
+
+            if (i == 0)
+            {
+                header_.first_bitmap_page = bitmap_pages_[i];
+            }
+            else
+            {
+                bitmap_dirty_[i - 1] = true;
+            }
+        }
+
+        const auto num_pages = header_.num_pages;
+        while (header_.num_pages > 1)
+        {
+            const auto last_page = header_.num_pages - 1;
+            if ((bitmap_[last_page / 64] & (1ull << (last_page % 64))) == 0 || !discard_page(last_page))
+                break;
+
+            mark_used(last_page);
+            header_.num_pages--;
+        }
+
+        if (header_.num_pages == num_pages && header_.num_preallocated_pages == 0)
+            return 0;
+
+        header_.num_preallocated_pages = 0;
+        header_dirty_ = true;
+        truncate_file_ = io_mode_ != io_mode::mmap;
+
+        return num_pages - header_.num_pages;
+    }
+
+    page_guard pager::get_page(page_index page_index, latch_mode mode)
+    {
+        auto& page = pin_frame(page_index);
+
+        // Latch outside of the pager locks, the thread holding the latch may need them to release it
+        page.latch.lock(mode);
+
+        return page_guard(this, &page, mode);
+    }
+
+    pager_shard &pager::shard_for(size_t page_index)
+    {
+        return shards_[page_index % shards_.size()];
+    }
+
+    page &pager::pin_frame(page_index page_index)
+    {
+        auto& shard = shard_for(page_index);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        for (;;)
+        {
+            const auto it = shard.page_table.find(page_index);
+            if (it == shard.page_table.end())
+                break;
+
+            auto& frame = frames_[it->second];
+            if (!frame.io_pending)
+            {
+                frame.referenced = true;
+                frame.pin_count++;
+                shard.stats.hits++;
+                return frame;
+            }
+
+            // Another thread is reading the page, wait for it to finish
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
         }
 
-        // last_free_list_page is full, allocate a new page
-        auto &new_free_list_page = alloc_page();
-        free_list_header new_free_list_header = { 0 };
-        new_free_list_header.num_pages = 1;
-        new_free_list_header.prev_page = header_.last_free_list_page;
-        serialize_free_list_header(new_free_list_page.content, new_free_list_header);
-        write_free_list_page_index(new_free_list_page.content, 0, page_index);
+        shard.stats.misses++;
+        auto& frame = map_frame(shard, page_index);
+        frame.pin_count++;
+
+        // Mapped frames already point at the page, pages that were evicted before they were committed are read from the log
+        if (io_mode_ == io_mode::mmap || frame.dirty)
+            return frame;
+
+        // Read without holding the shard lock so other pages of the shard can be used in the meantime
+        frame.io_pending = true;
+        lock.unlock();
 
-        save_page(new_free_list_page.index);
+        read_page(frame);
 
-        // Update the file header
-        header_.last_free_list_page = new_free_list_page.index;
-        header_.num_free_list_pages++;
-        save_header(false);
+        lock.lock();
+        frame.io_pending = false;
 
-        sync(false);
+        return frame;
     }
 
-    page &pager::get_page(page_index page_index)
+    void pager::unpin_page(page &page)
     {
-        auto& page = get_page_internal(page_index);
+        auto& shard = shard_for(page.index);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        assert(page.pin_count > 0);
+        page.pin_count--;
+    }
+
+    void pager::prefetch(const page_index *page_indices, u32 num_pages)
+    {
+        // Mapped pages are read by the OS on first access
+        if (io_mode_ == io_mode::mmap)
+            return;
+
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+        // Don't let a single batch evict most of a shard, including the pages it just read
+        vector<u32> num_prefetched(shards_.size(), 0);
+
+        io_requests_.clear();
+        io_frames_.clear();
 
-        if(!page.loaded)
+        for (auto i = 0u; i < num_pages; i++)
         {
-            const auto page_offset = header_.page_size * page_index;
-            fseek(file_handle_.file, page_offset, SEEK_SET);
+            const auto page_index = page_indices[i];
+            if (page_index >= header_.num_pages)
+                continue;
 
-            page.content = static_cast<u8*>(malloc(header_.page_size));
-            page.size = header_.page_size;
-            page.loaded = true;
-            page.index = page_index;
-            page.dirty = false;
+            auto& shard = shard_for(page_index);
+            auto& shard_prefetched = num_prefetched[page_index % shards_.size()];
+            std::lock_guard<std::mutex> shard_lock(shard.mutex);
 
-            fread(page.content, header_.page_size, 1, file_handle_.file);
+            if (shard_prefetched >= shard.num_frames / 2 || shard.page_table.find(page_index) != shard.page_table.end())
+                continue;
+
+            // Pin the frame so reading the rest of the batch can't evict it, io_pending makes get_page wait until it's loaded
+            auto& frame = map_frame(shard, page_index);
+            if (frame.dirty)
+                continue;
+
+            frame.pin_count++;
+            frame.io_pending = true;
+            shard.stats.misses++;
+            shard_prefetched++;
+
+            io_request request;
+            request.buffer = frame.content;
+            request.size = frame.size;
+            request.offset = page_offset(page_index);
+            io_requests_.push_back(request);
+            io_frames_.push_back(&frame);
+        }
+
+        io_engine_.submit(io_requests_.data(), static_cast<u32>(io_requests_.size()));
+
+        for (auto i = 0u; i < io_frames_.size(); i++)
+        {
+            auto& frame = *io_frames_[i];
+            const auto bytes_read = io_requests_[i].result;
+
+            if (bytes_read < frame.size)
+                memset(frame.content + bytes_read, 0, frame.size - bytes_read);
+
+            auto& shard = shard_for(frame.index);
+            std::lock_guard<std::mutex> shard_lock(shard.mutex);
+            frame.io_pending = false;
+            frame.pin_count--;
         }
+    }
+
+    void pager::mark_dirty(page &page)
+    {
+        auto& shard = shard_for(page.index);
+        std::lock_guard<std::mutex> lock(shard.mutex);
 
-        return page;
+        mark_dirty(shard, page);
     }
 
     void pager::save_page(page_index page_index)
     {
-        assert(page_index < pages_.size());
+        auto& shard = shard_for(page_index);
+        std::lock_guard<std::mutex> lock(shard.mutex);
 
-        auto& page = pages_[page_index];
-        const auto page_offset = header_.page_size * page.index;
-        fseek(file_handle_.file, page_offset, SEEK_SET);
+        const auto it = shard.page_table.find(page_index);
+        assert(it != shard.page_table.end());
+
+        auto& frame = frames_[it->second];
+
+        // With a write-ahead log the page is made durable by the next commit instead
+        if (wal_ != nullptr)
+        {
+            mark_dirty(shard, frame);
+            return;
+        }
 
-        fwrite(page.content, page.size, 1, file_handle_.file);
-        page.dirty = false;
+        if (write_page(frame))
+            clear_dirty(shard, frame);
     }
 
     bool pager::sync()
     {
+        if (wal_ != nullptr)
+            return commit_log(true);
+
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (header_dirty_)
+            save_header();
+
         return sync(true);
     }
 
+    bool pager::flush()
+    {
+        if (wal_ != nullptr)
+            return commit_log(false);
+
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (header_dirty_)
+            save_header();
+
+        return flush_dirty_pages();
+    }
+
+    bool pager::checkpoint()
+    {
+        if (wal_ == nullptr)
+            return sync();
+
+        // Only committed pages are written to the db file
+        if (!commit_log(true))
+            return false;
+
+        std::unique_lock<std::shared_mutex> lock(checkpoint_mutex_);
+        return write_checkpoint();
+    }
+
     bool pager::ok() const
     {
-        return file_handle_.ok();
+        return file_handle_.ok() && (wal_ == nullptr || wal_->ok())
+            && (io_mode_ == io_mode::mmap ? !segments_.empty() : arena_ != nullptr);
     }
 
-    page &pager::alloc_page()
+    page_guard pager::alloc_page()
     {
-        auto new_page_index = header_.num_pages++;
-        auto& page = get_page_internal(new_page_index);
-        save_header();
+        // Grow the mapping before num_pages is bumped so we never hand out a page that is not backed by the file
+        if (io_mode_ == io_mode::mmap && !map_pages(header_.num_pages + 1))
+            throw niffler_exception("pager: could not grow the memory mapped file");
 
-        page.content = static_cast<u8*>(malloc(header_.page_size));
-        page.size = header_.page_size;
-        page.loaded = true;
-        page.index = new_page_index;
-        page.dirty = false;
+        // Grow the file by a whole extent once the preallocated pages are used up. If the file system can't preallocate
+        // the file simply grows as pages are written
+        if (header_.num_preallocated_pages == 0 && file_growth_pages_ > 1)
+        {
+            if (fallocate(file_handle_, page_offset(header_.num_pages), static_cast<u64>(file_growth_pages_) * header_.page_size) == 0)
+                header_.num_preallocated_pages = file_growth_pages_;
+        }
+
+        if (header_.num_preallocated_pages > 0)
+            header_.num_preallocated_pages--;
+
+        auto new_page_index = header_.num_pages++;
+        header_dirty_ = true;
 
-        return page;
+        return map_zeroed_page(new_page_index);
     }
 
-    page &pager::get_page_internal(page_index page_index)
+    page_guard pager::map_zeroed_page(page_index page_index)
     {
-        if (page_index >= pages_.size())
+        auto& shard = shard_for(page_index);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        // New and reused pages are zeroed, there is no point in reading them from disk first. Marked as dirty so
+        // the page is written even if it is evicted before it is saved
+        if (shard.page_table.find(page_index) == shard.page_table.end())
         {
-            pages_.resize(pages_.size() * 2);
+            auto& page = map_frame(shard, page_index);
+            memset(page.content, 0, page.size);
+            mark_dirty(shard, page);
+            page.pin_count++;
+
+            return page_guard(this, &page);
         }
 
-        return pages_[page_index];
+        lock.unlock();
+
+        auto guard = get_page(page_index);
+        memset(guard->content, 0, guard->size);
+        mark_dirty(*guard);
+
+        return guard;
     }
 
-    bool pager::sync(bool save_pages)
+    page_index pager::find_free_page(page_index hint) const
     {
-        if (save_pages)
+        assert(header_.num_free_pages > 0);
+
+        const auto num_words = bitmap_.size();
+        const auto first_word = hint / 64 < num_words ? hint / 64 : 0;
+        const auto first_bit = hint / 64 < num_words ? hint % 64 : 0;
+
+        // Forward from the hint so new pages tend to follow their neighbours in the file, then around to the bits before it
+        for (size_t i = 0; i <= num_words; i++)
         {
-            for (const auto& page : pages_)
+            const auto word_index = (first_word + i) % num_words;
+            auto word = bitmap_[word_index];
+
+            if (i == 0)
             {
-                if (page.dirty)
-                {
-                    save_page(page.index);
-                }
+                word &= ~0ull << first_bit;
             }
+            else if (i == num_words)
+            {
+                word &= ~(~0ull << first_bit);
+            }
+
+            if (word != 0)
+                return static_cast<page_index>(word_index * 64 + lowest_set_bit(word));
+        }
+
+        assert(false && "num_free_pages doesn't match the bitmap");
+        return 0;
+    }
+
+    void pager::mark_used(page_index page_index)
+    {
+        const auto bit = 1ull << (page_index % 64);
+        assert((bitmap_[page_index / 64] & bit) != 0);
+
+        bitmap_[page_index / 64] &= ~bit;
+        bitmap_dirty_[page_index / bitmap_page_header::NUM_BITS(header_.page_size)] = true;
+        header_.num_free_pages--;
+        header_dirty_ = true;
+
+        // Reused before its hole was punched
+        if (page_index / 64 < holes_.size() && (holes_[page_index / 64] & bit) != 0)
+        {
+            holes_[page_index / 64] &= ~bit;
+            num_holes_--;
+        }
+    }
+
+    void pager::mark_free(page_index page_index)
+    {
+        assert(page_index > 0 && page_index < header_.num_pages);
+
+        const auto bitmap_page = page_index / bitmap_page_header::NUM_BITS(header_.page_size);
+        if (bitmap_page >= bitmap_pages_.size())
+            add_bitmap_pages(bitmap_page + 1);
+
+        const auto bit = 1ull << (page_index % 64);
+        assert((bitmap_[page_index / 64] & bit) == 0 && "page freed twice");
+
+        bitmap_[page_index / 64] |= bit;
+        bitmap_dirty_[bitmap_page] = true;
+        header_.num_free_pages++;
+        header_dirty_ = true;
+
+        if (punch_holes_)
+        {
+            holes_.resize(bitmap_.size(), 0);
+            holes_[page_index / 64] |= bit;
+            num_holes_++;
         }
+    }
+
+    void pager::add_bitmap_pages(size_t num_bitmap_pages)
+    {
+        const auto num_words = bitmap_page_header::NUM_WORDS(header_.page_size);
+
+        // Bitmap pages are taken from the end of the file, never from the free pages they track
+        while (bitmap_pages_.size() < num_bitmap_pages)
+        {
+            const auto page_index = static_cast<niffler::page_index>(alloc_page()->index);
+
+            if (bitmap_pages_.empty())
+            {
+                header_.first_bitmap_page = page_index;
+            }
+            else
+            {
+                // Its next page changes
+                bitmap_dirty_.back() = true;
+            }
 
-        return fsync(file_handle_.file) == 0;
+            bitmap_pages_.push_back(page_index);
+            bitmap_dirty_.push_back(true);
+            bitmap_.resize(bitmap_pages_.size() * num_words, 0);
+        }
     }
 
-    void pager::save_header(bool fsync)
+    void pager::load_bitmap()
     {
-        auto& header_page = get_page(0);
-        serialize_file_header(header_page.content, header_);
-        save_page(header_page.index);
+        const auto num_words = bitmap_page_header::NUM_WORDS(header_.page_size);
 
-        if(fsync)
-            sync(false);
+        // Bounded by the number of pages in case the chain of a damaged file loops
+        for (auto page_index = header_.first_bitmap_page; page_index != 0 && bitmap_pages_.size() < header_.num_pages;)
+        {
+            auto page = get_page(page_index);
+            bitmap_.resize(bitmap_.size() + num_words);
+
+            bitmap_page_header bitmap_header;
+            deserialize_bitmap_page(page->content, bitmap_header, bitmap_.data() + bitmap_.size() - num_words, num_words);
+
+            bitmap_pages_.push_back(page_index);
+            bitmap_dirty_.push_back(false);
+            page_index = bitmap_header.next_page;
+        }
+    }
+
+    void pager::convert_free_list(page_index last_free_list_page)
+    {
+        vector<page_index> free_pages;
+
+        // Every page on the list is free and so are the pages of the list itself
+        for (auto list_page = last_free_list_page; list_page != 0 && free_pages.size() < header_.num_pages;)
+        {
+            auto page = get_page(list_page);
+            free_list_header list_header;
+            deserialize_free_list_header(page->content, list_header);
+
+            const auto num_pages = std::min(list_header.num_pages, free_list_header::MAX_NUM_PAGES(header_.page_size));
+            for (auto i = 0u; i < num_pages; i++)
+            {
+                free_pages.push_back(read_free_list_page_index(page->content, i, header_.page_size));
+            }
+
+            free_pages.push_back(list_page);
+            list_page = list_header.prev_page;
+        }
+
+        for (auto page_index : free_pages)
+        {
+            mark_free(page_index);
+        }
+    }
+
+    void pager::save_bitmap()
+    {
+        const auto num_words = bitmap_page_header::NUM_WORDS(header_.page_size);
+
+        for (size_t i = 0; i < bitmap_pages_.size(); i++)
+        {
+            if (!bitmap_dirty_[i])
+                continue;
+
+            auto page = get_page(bitmap_pages_[i]);
+            bitmap_page_header bitmap_header = { i + 1 < bitmap_pages_.size() ? bitmap_pages_[i + 1] : 0 };
+            serialize_bitmap_page(page->content, bitmap_header, bitmap_.data() + i * num_words, num_words);
+            save_page(page->index);
+
+            bitmap_dirty_[i] = false;
+        }
+    }
+
+    bool pager::discard_page(page_index page_index)
+    {
+        auto& shard = shard_for(page_index);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        {
+            std::lock_guard<std::mutex> log_pages_lock(log_pages_mutex_);
+            log_pages_.erase(page_index);
+        }
+
+        const auto it = shard.page_table.find(page_index);
+        if (it == shard.page_table.end())
+            return true;
+
+        // Pinned by a sync or the background writer, which would write it past the end of the file
+        auto& frame = frames_[it->second];
+        if (frame.pin_count > 0)
+            return false;
+
+        clear_dirty(shard, frame);
+        shard.page_table.erase(it);
+        frame.loaded = false;
+        frame.logged = false;
+
+        return true;
+    }
+
+    void pager::truncate_file()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+        // Only once the header with the new num_pages has been written, otherwise the file could end before a page the header
+        // on disk still counts. Tried again by the next sync if it fails
+        if (truncate_file_ && !header_dirty_ && ftruncate(file_handle_, page_offset(header_.num_pages + header_.num_preallocated_pages)) == 0)
+            truncate_file_ = false;
+    }
+
+    void pager::punch_holes()
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+        // Only once the bitmap that has the pages as free is in the file, a crash could bring back a tree that still uses them otherwise
+        if (num_holes_ == 0 || header_dirty_)
+            return;
+
+        // Adjacent pages are punched as one range
+        page_index first_page = 0;
+        u32 num_pages = 0;
+        u32 num_skipped_pages = 0;
+
+        for (size_t i = 0; i < holes_.size() && punch_holes_; i++)
+        {
+            u64 skipped = 0;
+
+            for (auto word = holes_[i]; word != 0 && punch_holes_; word &= word - 1)
+            {
+                const auto page_index = static_cast<niffler::page_index>(i * 64 + lowest_set_bit(word));
+
+                // Writing the page back would allocate its blocks again. A page that is pinned right now is punched the next time
+                if (!discard_page(page_index))
+                {
+                    skipped |= word & (0 - word);
+                    num_skipped_pages++;
+                    continue;
+                }
+
+                if (num_pages > 0 && first_page + num_pages == page_index)
+                {
+                    num_pages++;
+                    continue;
+                }
+
+                if (num_pages > 0 && punch_hole(file_handle_, page_offset(first_page), page_offset(num_pages)) != 0)
+                    punch_holes_ = false;
+
+                first_page = page_index;
+                num_pages = 1;
+            }
+
+            holes_[i] = skipped;
+        }
+
+        if (punch_holes_ && num_pages > 0 && punch_hole(file_handle_, page_offset(first_page), page_offset(num_pages)) != 0)
+            punch_holes_ = false;
+
+        if (!punch_holes_)
+            holes_.clear();
+
+        num_holes_ = punch_holes_ ? num_skipped_pages : 0;
+    }
+
+    page &pager::map_frame(pager_shard &shard, page_index page_index)
+    {
+        const auto frame_index = find_victim(shard);
+        auto& frame = frames_[frame_index];
+
+        if (frame.loaded)
+            evict(shard, frame);
+
+        assert(!frame.dirty);
+
+        if (io_mode_ == io_mode::mmap)
+            frame.content = mapped_page(page_index);
+
+        frame.size = header_.page_size;
+        frame.index = page_index;
+        frame.loaded = true;
+        frame.referenced = true;
+        frame.pin_count = 0;
+        shard.page_table[page_index] = frame_index;
+
+        if (wal_ == nullptr)
+            return frame;
+
+        std::lock_guard<std::mutex> log_pages_lock(log_pages_mutex_);
+        const auto it = log_pages_.find(page_index);
+        if (it == log_pages_.end())
+            return frame;
+
+        // Evicted before it was committed, the db file has an older version. A mapped page still holds the evicted one
+        if (io_mode_ != io_mode::mmap && !wal_->read(it->second, frame.content))
+        {
+            shard.page_table.erase(page_index);
+            frame.loaded = false;
+            throw niffler_exception("pager: could not read an evicted page from the write-ahead log");
+        }
+
+        mark_dirty(shard, frame);
+        frame.logged = true;
+        frame.lsn = it->second;
+        log_pages_.erase(it);
+
+        return frame;
+    }
+
+    u32 pager::find_victim(pager_shard &shard)
+    {
+        // With a write-ahead log dirty pages that are not committed yet are evicted last, they have to be read back from the log
+        const auto committed_lsn = wal_ != nullptr ? wal_->committed_lsn() : 0;
+        auto uncommitted_frame = NO_FRAME;
+
+        // Two full turns of the clock hand is enough to clear every reference bit and find an unpinned frame if there is one
+        for (auto i = 0u; i < shard.num_frames * 2; i++)
+        {
+            const auto frame_index = shard.first_frame + shard.clock_hand;
+            auto& frame = frames_[frame_index];
+            shard.clock_hand = (shard.clock_hand + 1) % shard.num_frames;
+
+            if (!frame.loaded)
+                return frame_index;
+
+            if (frame.pin_count > 0)
+                continue;
+
+            if (wal_ != nullptr && frame.dirty && (!frame.logged || frame.lsn > committed_lsn))
+            {
+                if (uncommitted_frame == NO_FRAME)
+                    uncommitted_frame = frame_index;
+
+                continue;
+            }
+
+            if (frame.referenced)
+            {
+                frame.referenced = false;
+                continue;
+            }
+
+            return frame_index;
+        }
+
+        // The shard is too small for the changes since the last commit, evict moves the page to the log
+        if (uncommitted_frame != NO_FRAME)
+            return uncommitted_frame;
+
+        throw niffler_exception("pager: all frames are pinned, increase options::pager_size");
+    }
+
+    void pager::evict(pager_shard &shard, page &frame)
+    {
+        assert(frame.loaded);
+        assert(frame.pin_count == 0);
+
+        if (frame.dirty && wal_ != nullptr && (!frame.logged || frame.lsn > wal_->committed_lsn()))
+        {
+            // The page may hold part of an operation, it must not reach the db file and evicting it must not commit the log.
+            // Its image is appended without a commit record, the next commit covers it. Under the lock so a checkpoint sees it
+            std::lock_guard<std::mutex> log_pages_lock(log_pages_mutex_);
+
+            if (!frame.logged)
+                frame.lsn = wal_->append(static_cast<page_index>(frame.index), frame.content);
+
+            log_pages_[static_cast<page_index>(frame.index)] = frame.lsn;
+            clear_dirty(shard, frame);
+        }
+        else if (frame.dirty)
+        {
+            // Its log records are committed but have to be synced before the page reaches the db file
+            if (wal_ != nullptr && frame.lsn > wal_->durable_lsn() && !wal_->commit(frame.lsn))
+                throw niffler_exception("pager: could not sync the write-ahead log");
+
+            // The frame stays dirty and loaded, the next sync tries to write it again
+            if (!write_page(frame))
+                throw niffler_exception("pager: could not write back an evicted page");
+
+            clear_dirty(shard, frame);
+            shard.stats.writebacks++;
+        }
+
+        shard.page_table.erase(static_cast<page_index>(frame.index));
+        frame.loaded = false;
+        frame.logged = false;
+        shard.stats.evictions++;
+    }
+
+    void pager::read_page(page &frame)
+    {
+        const auto bytes_read = read_at(file_handle_, frame.content, frame.size, page_offset(frame.index));
+
+        // Pages past the end of the file have not been written yet
+        if (bytes_read < frame.size)
+            memset(frame.content + bytes_read, 0, frame.size - bytes_read);
+    }
+
+    bool pager::write_page(page &frame)
+    {
+        if (io_mode_ == io_mode::mmap)
+            return flush_mapped_file(frame.content, frame.size) == 0;
+
+        return write_at(file_handle_, frame.content, frame.size, page_offset(frame.index)) == frame.size;
+    }
+
+    u64 pager::page_offset(size_t page_index) const
+    {
+        return static_cast<u64>(header_.page_size) * page_index;
+    }
+
+    bool pager::alloc_frames(bool huge_pages)
+    {
+        // The arena is page aligned so frames can be read into and written from directly in io_mode::direct
+        const auto frames_size = static_cast<size_t>(frames_.size()) * header_.page_size;
+        arena_size_ = (frames_size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+        arena_ = static_cast<u8*>(alloc_arena(arena_size_, huge_pages));
+        if (arena_ == nullptr)
+            return false;
+
+        for (auto i = 0u; i < frames_.size(); i++)
+        {
+            frames_[i].content = arena_ + static_cast<size_t>(i) * header_.page_size;
+        }
+
+        return true;
+    }
+
+    bool pager::map_pages(u32 num_pages)
+    {
+        const auto required_size = static_cast<u64>(num_pages) * header_.page_size;
+        const auto num_segments = static_cast<size_t>((required_size + MMAP_SEGMENT_SIZE - 1) / MMAP_SEGMENT_SIZE);
+
+        if (num_segments <= segments_.size())
+            return true;
+
+        // Every mapped segment has to be backed by the file, the file is grown a whole segment at a time
+        const auto mapped_size = num_segments * MMAP_SEGMENT_SIZE;
+        if (file_size(file_handle_) < mapped_size && ftruncate(file_handle_, mapped_size) != 0)
+            return false;
+
+        while (segments_.size() < num_segments)
+        {
+            auto address = map_file(file_handle_, segments_.size() * MMAP_SEGMENT_SIZE, MMAP_SEGMENT_SIZE);
+            if (address == nullptr)
+                return false;
+
+            std::lock_guard<std::mutex> lock(segments_mutex_);
+            segments_.push_back(static_cast<u8*>(address));
+        }
+
+        return true;
+    }
+
+    u8 *pager::mapped_page(page_index page_index) const
+    {
+        const auto offset = page_offset(page_index);
+
+        std::lock_guard<std::mutex> lock(segments_mutex_);
+        return segments_[static_cast<size_t>(offset / MMAP_SEGMENT_SIZE)] + (offset % MMAP_SEGMENT_SIZE);
+    }
+
+    void pager::mark_dirty(pager_shard &shard, page &frame)
+    {
+        frame.logged = false;
+        frame.changes++;
+
+        if (frame.dirty)
+            return;
+
+        const auto frame_index = static_cast<u32>(&frame - frames_.data());
+        assert(frame_index >= shard.first_frame && frame_index < shard.first_frame + shard.num_frames);
+
+        frame.dirty = true;
+        shard.num_dirty++;
+        frame.prev_dirty = NO_FRAME;
+        frame.next_dirty = shard.first_dirty;
+
+        if (shard.first_dirty != NO_FRAME)
+            frames_[shard.first_dirty].prev_dirty = frame_index;
+
+        shard.first_dirty = frame_index;
+    }
+
+    void pager::clear_dirty(pager_shard &shard, page &frame)
+    {
+        if (!frame.dirty)
+            return;
+
+        if (frame.prev_dirty != NO_FRAME)
+        {
+            frames_[frame.prev_dirty].next_dirty = frame.next_dirty;
+        }
+        else
+        {
+            shard.first_dirty = frame.next_dirty;
+        }
+
+        if (frame.next_dirty != NO_FRAME)
+            frames_[frame.next_dirty].prev_dirty = frame.prev_dirty;
+
+        frame.prev_dirty = NO_FRAME;
+        frame.next_dirty = NO_FRAME;
+        frame.dirty = false;
+        // Every logged version of the page is in the db file now
+        frame.lsn = 0;
+        shard.num_dirty--;
+    }
+
+    bool pager::flush_dirty_pages()
+    {
+        auto& batch = flush_batch_;
+        batch.frames.clear();
+        const auto committed_lsn = wal_ != nullptr ? wal_->committed_lsn() : 0;
+
+        // Collect the dirty frames of every shard, they are pinned and latched so they can be written without holding the shard locks.
+        // Pages that are being changed right now(latched exclusively) are skipped, they stay dirty and are written by the next sync.
+        // Only try to latch, the writer holding the latch may be waiting for a shard lock
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            for (auto frame_index = shard.first_dirty; frame_index != NO_FRAME; frame_index = frames_[frame_index].next_dirty)
+            {
+                auto& frame = frames_[frame_index];
+
+                // With a write-ahead log only committed pages are written, the others are written once the next commit covered them
+                if (wal_ != nullptr && (!frame.logged || frame.lsn > committed_lsn))
+                    continue;
+
+                if (!frame.latch.try_lock_shared())
+                    continue;
+
+                frame.pin_count++;
+                batch.frames.push_back(&frame);
+            }
+        }
+
+        std::sort(batch.frames.begin(), batch.frames.end(), [](const page *a, const page *b) { return a->index < b->index; });
+
+        if (io_mode_ == io_mode::mmap)
+        {
+            // The mapping is flushed page by page, there is nothing to coalesce
+            coalesce_writes(batch, 1);
+            for (auto i = 0u; i < batch.frames.size(); i++)
+            {
+                batch.requests[i].result = write_page(*batch.frames[i]) ? batch.requests[i].size : 0;
+            }
+        }
+        else
+        {
+            // All dirty pages are written as one batch so they are in flight at the same time
+            coalesce_writes(batch, MAX_WRITE_RUN);
+            io_engine_.submit(batch.requests.data(), static_cast<u32>(batch.requests.size()));
+        }
+
+        auto ok = true;
+        for (auto i = 0u; i < batch.frames.size(); i++)
+        {
+            auto& frame = *batch.frames[i];
+            auto& shard = shard_for(frame.index);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            // Pages that could not be written stay dirty
+            const auto& request = batch.requests[batch.frame_requests[i]];
+            if (request.result == request.size)
+            {
+                clear_dirty(shard, frame);
+            }
+            else
+            {
+                ok = false;
+            }
+
+            frame.latch.unlock_shared();
+            frame.pin_count--;
+        }
+
+        return ok;
+    }
+
+    void pager::coalesce_writes(write_batch &batch, u32 max_run) const
+    {
+        batch.frame_requests.clear();
+        batch.requests.clear();
+        // Sized up front, requests point into it
+        batch.buffers.resize(batch.frames.size());
+
+        for (auto i = 0u; i < batch.frames.size(); i++)
+        {
+            const auto frame = batch.frames[i];
+            batch.buffers[i] = { frame->content, frame->size };
+
+            if (batch.requests.empty() || frame->index != batch.frames[i - 1]->index + 1 || batch.requests.back().num_buffers >= max_run)
+            {
+                io_request request;
+                request.buffers = &batch.buffers[i];
+                request.offset = page_offset(frame->index);
+                request.write = true;
+                batch.requests.push_back(request);
+            }
+
+            auto& request = batch.requests.back();
+            request.num_buffers++;
+            request.size += frame->size;
+            batch.frame_requests.push_back(static_cast<u32>(batch.requests.size() - 1));
+        }
+
+        // Single pages don't need a vectored write
+        for (auto& request : batch.requests)
+        {
+            if (request.num_buffers != 1)
+                continue;
+
+            request.buffer = request.buffers->data;
+            request.buffers = nullptr;
+            request.num_buffers = 0;
+        }
+    }
+
+    bool pager::sync(bool save_pages)
+    {
+        // With a write-ahead log changes are made durable by committing the log, the db file is only synced by checkpoints
+        if (wal_ != nullptr)
+            return true;
+
+        auto ok = true;
+
+        if (save_pages)
+        {
+            ok = flush_dirty_pages();
+        }
+
+        if (fsync(file_handle_) != 0 || !ok)
+            return false;
+
+        truncate_file();
+        punch_holes();
+        return true;
+    }
+
+    std::shared_lock<std::shared_mutex> pager::lock_operation()
+    {
+        return std::shared_lock<std::shared_mutex>(operation_mutex_);
+    }
+
+    bool pager::commit_log(bool fsync)
+    {
+        {
+            std::shared_lock<std::shared_mutex> lock(checkpoint_mutex_);
+
+            {
+                // Writers that are half done are waited for, new ones start after the pages are logged and are not part of
+                // this commit. Not held while the log is written so they don't wait for the sync
+                std::unique_lock<std::shared_mutex> operation_lock(operation_mutex_);
+                log_dirty_pages();
+            }
+
+            if (!wal_->commit(wal_->tail(), fsync))
+                return false;
+        }
+
+        if (wal_->size() < checkpoint_size_)
+            return true;
+
+        std::unique_lock<std::shared_mutex> lock(checkpoint_mutex_);
+
+        // Another thread may have checkpointed while this one was waiting for the lock
+        if (wal_->size() < checkpoint_size_)
+            return true;
+
+        return write_checkpoint();
+    }
+
+    void pager::log_dirty_pages()
+    {
+        {
+            // Page allocations only change the header in memory, it is logged together with the pages it describes
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            if (header_dirty_)
+                save_header();
+        }
+
+        // Pages are latched one at a time without holding a pager lock, the writer holding a latch may need those locks to release it.
+        // Waiting for the latch instead of skipping the page makes sure changes made before this commit are part of it
+        for (auto frame : pin_dirty_pages(true))
+        {
+            frame->latch.lock_shared();
+
+            {
+                // The file header and the bitmap pages are changed under the pager lock instead of a latch
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                auto& shard = shard_for(frame->index);
+                std::lock_guard<std::mutex> shard_lock(shard.mutex);
+
+                if (frame->dirty && !frame->logged)
+                {
+                    frame->lsn = wal_->append(static_cast<page_index>(frame->index), frame->content);
+                    frame->logged = true;
+                }
+            }
+
+            frame->latch.unlock_shared();
+            unpin_page(*frame);
+        }
+    }
+
+    vector<page*> pager::pin_dirty_pages(bool unlogged_only)
+    {
+        vector<page*> dirty_pages;
+
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            for (auto frame_index = shard.first_dirty; frame_index != NO_FRAME; frame_index = frames_[frame_index].next_dirty)
+            {
+                auto& frame = frames_[frame_index];
+                if (unlogged_only && frame.logged)
+                    continue;
+
+                frame.pin_count++;
+                dirty_pages.push_back(&frame);
+            }
+        }
+
+        return dirty_pages;
+    }
+
+    bool pager::write_checkpoint()
+    {
+        auto ok = true;
+        // Pages changed since the last commit are not written. The log can't be emptied while one of them has an older
+        // version that is only in the log, and freed pages can't be cut or punched while the bitmap in the file may be behind
+        auto keep_log = false;
+        auto skipped = false;
+        const auto committed_lsn = wal_->committed_lsn();
+
+        {
+            // Written as a batch, pages that are latched exclusively right now are skipped
+            std::lock_guard<std::recursive_mutex> lock(mutex_);
+            ok = flush_dirty_pages();
+        }
+
+        // Wait for the skipped pages one at a time like log_dirty_pages
+        for (auto frame : pin_dirty_pages(false))
+        {
+            frame->latch.lock_shared();
+
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                auto& shard = shard_for(frame->index);
+                std::lock_guard<std::mutex> shard_lock(shard.mutex);
+
+                if (frame->dirty && (!frame->logged || frame->lsn > committed_lsn))
+                {
+                    skipped = true;
+                    keep_log = keep_log || frame->lsn != 0;
+                }
+                else if (frame->dirty)
+                {
+                    if (write_page(*frame))
+                    {
+                        clear_dirty(shard, *frame);
+                    }
+                    else
+                    {
+                        ok = false;
+                    }
+                }
+            }
+
+            frame->latch.unlock_shared();
+            unpin_page(*frame);
+        }
+
+        {
+            // Held until the log is emptied so no page is evicted to the log in between
+            std::lock_guard<std::mutex> log_pages_lock(log_pages_mutex_);
+
+            ok = ok && write_log_pages(committed_lsn);
+            if (!log_pages_.empty())
+            {
+                skipped = true;
+                keep_log = true;
+            }
+
+            // The log can only be emptied once every page in it is durable in the db file
+            if (!ok || fsync(file_handle_) != 0)
+                return false;
+
+            if (!keep_log && !wal_->reset(header_.page_size))
+                return false;
+        }
+
+        if (skipped)
+            return true;
+
+        truncate_file();
+        punch_holes();
+        return true;
+    }
+
+    bool pager::write_log_pages(u64 committed_lsn)
+    {
+        if (log_pages_.empty())
+            return true;
+
+        // Evicted pages are no longer in a frame, their committed images are copied from the log. A mapped page still holds it
+        auto buffer = static_cast<u8*>(alloc_aligned(header_.page_size, DIRECT_IO_ALIGNMENT));
+        auto ok = buffer != nullptr;
+
+        for (auto it = log_pages_.begin(); it != log_pages_.end() && ok;)
+        {
+            if (it->second > committed_lsn)
+            {
+                ++it;
+                continue;
+            }
+
+            if (io_mode_ == io_mode::mmap)
+            {
+                ok = flush_mapped_file(mapped_page(it->first), header_.page_size) == 0;
+            }
+            else
+            {
+                ok = wal_->read(it->second, buffer)
+                    && write_at(file_handle_, buffer, header_.page_size, page_offset(it->first)) == header_.page_size;
+            }
+
+            if (ok)
+                it = log_pages_.erase(it);
+        }
+
+        free_aligned(buffer);
+
+        return ok;
+    }
+
+    void pager::save_header()
+    {
+        // The bitmap changes together with num_free_pages, it is saved with the header
+        save_bitmap();
+
+        auto header_page = get_page(0);
+        serialize_file_header(header_page->content, header_);
+        save_page(header_page->index);
+        header_dirty_ = false;
+    }
+
+    void pager::run_writer()
+    {
+        std::unique_lock<std::mutex> lock(writer_mutex_);
+
+        while (!stop_writer_)
+        {
+            writer_wakeup_.wait_for(lock, std::chrono::milliseconds(writer_interval_ms_), [this]() { return stop_writer_; });
+            if (stop_writer_)
+                break;
+
+            lock.unlock();
+            trickle_dirty_pages();
+            lock.lock();
+        }
+    }
+
+    void pager::trickle_dirty_pages()
+    {
+        // Keeps checkpoints from emptying the log while pages that are only durable in the log are written
+        std::shared_lock<std::shared_mutex> checkpoint_lock(checkpoint_mutex_, std::defer_lock);
+        if (wal_ != nullptr)
+            checkpoint_lock.lock();
+
+        u32 num_dirty = 0;
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            num_dirty += shard.num_dirty;
+        }
+
+        if (num_dirty <= writer_max_dirty_pages_)
+            return;
+
+        // With a write-ahead log a page may only reach the db file once its log records are durable, otherwise a crash
+        // could leave changes in the file that recovery doesn't know about
+        const auto durable_lsn = wal_ != nullptr ? wal_->durable_lsn() : 0;
+        const auto max_pages = num_dirty - writer_max_dirty_pages_;
+        writer_frames_.clear();
+
+        // Latched and pinned like flush_dirty_pages, pages that are being changed right now are left for the next round
+        for (auto& shard : shards_)
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            for (auto frame_index = shard.first_dirty; frame_index != NO_FRAME && writer_frames_.size() < max_pages; frame_index = frames_[frame_index].next_dirty)
+            {
+                auto& frame = frames_[frame_index];
+                if (wal_ != nullptr && (!frame.logged || frame.lsn > durable_lsn))
+                    continue;
+
+                if (!frame.latch.try_lock_shared())
+                    continue;
+
+                frame.pin_count++;
+                writer_frames_.emplace_back(&frame, frame.changes);
+            }
+        }
+
+        if (writer_frames_.empty())
+            return;
+
+        std::sort(writer_frames_.begin(), writer_frames_.end(), [](const std::pair<page*, u32> &a, const std::pair<page*, u32> &b) {
+            return a.first->index < b.first->index;
+        });
+
+        auto& batch = writer_batch_;
+        batch.frames.clear();
+        for (auto& dirty_frame : writer_frames_)
+        {
+            batch.frames.push_back(dirty_frame.first);
+        }
+
+        coalesce_writes(batch, MAX_WRITE_RUN);
+        writer_io_engine_->submit(batch.requests.data(), static_cast<u32>(batch.requests.size()));
+
+        for (auto i = 0u; i < writer_frames_.size(); i++)
+        {
+            auto& frame = *writer_frames_[i].first;
+            auto& shard = shard_for(frame.index);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+
+            // The header and bitmap pages are changed without a latch, those may have changed during the write
+            const auto& request = batch.requests[batch.frame_requests[i]];
+            if (request.result == request.size && frame.changes == writer_frames_[i].second)
+            {
+                clear_dirty(shard, frame);
+                shard.stats.background_writes++;
+            }
+
+            frame.latch.unlock_shared();
+            frame.pin_count--;
+        }
     }
 }
@@ -1,36 +1,147 @@
 #pragma once
 
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
 #include <stdlib.h>
 
 #include "include/define.h"
+#include "include/options.h"
 #include "files.h"
+#include "io_engine.h"
+#include "latch.h"
+#include "wal.h"
 
 namespace niffler {
 
     using std::vector;
+    using std::unordered_map;
+
+    constexpr u32 NO_FRAME = UINT32_MAX;
+    // Max number of adjacent pages written with a single request
+    constexpr u32 MAX_WRITE_RUN = 128;
 
     struct page
     {
         u8 *content = nullptr;
-        u16 size = 0;
+        u32 size = 0;
+        // Use pager::mark_dirty to set, it also links the frame into the pager's list of dirty frames
         bool dirty = false;
         bool loaded = false;
+        // Set on every access and cleared by the clock hand, frames are only evicted when it is not set
+        bool referenced = false;
+        // Set once the current content is in the write-ahead log, a dirty page still has to be written to the file by the next checkpoint
+        bool logged = false;
+        // Set while the page is read from disk without holding the shard lock, other threads wait for it to be cleared
+        bool io_pending = false;
+        u32 pin_count = 0;
+        // Bumped by every mark_dirty, the background writer only cleans a page if it didn't change while it was written
+        u32 changes = 0;
         size_t index = 0;
+        // lsn of the last log record of the page, it may only be written to the db file once the log is durable up to it.
+        // 0 once the db file has every logged version of the page
+        u64 lsn = 0;
+        u32 prev_dirty = NO_FRAME;
+        u32 next_dirty = NO_FRAME;
+        // Protects content, taken through page_guard. Never acquired while holding the pager lock
+        rw_latch latch;
+    };
+
+    class pager;
+
+    // Keeps a page pinned(and latched if requested) until the guard is destroyed, a pinned page is never evicted so its content stays valid
+    class page_guard
+    {
+    public:
+        page_guard() = default;
+        page_guard(pager *pager, page *page, latch_mode mode = latch_mode::none);
+        page_guard(page_guard &&other) noexcept;
+        page_guard &operator=(page_guard &&other) noexcept;
+        page_guard(const page_guard&) = delete;
+        page_guard &operator=(const page_guard&) = delete;
+        ~page_guard();
+
+        page *get() const;
+        page &operator*() const;
+        page *operator->() const;
+        explicit operator bool() const;
+        latch_mode mode() const;
+        // Unlatches and unpins the page before the guard goes out of scope, the guard is empty afterwards
+        void release();
+
+    private:
+        friend class pager;
+
+        void lock(latch_mode mode);
+
+        pager *pager_ = nullptr;
+        page *page_ = nullptr;
+        latch_mode mode_ = latch_mode::none;
+    };
+
+    struct pager_stats
+    {
+        u64 hits = 0;
+        u64 misses = 0;
+        u64 evictions = 0;
+        u64 writebacks = 0;
+        // Dirty pages written by the background writer
+        u64 background_writes = 0;
     };
 
+    // Each shard owns a slice of the frames and caches the pages whose index maps to it, with its own lock
+    // so threads working on different pages rarely contend
+    struct pager_shard
+    {
+        std::mutex mutex;
+        unordered_map<page_index, u32> page_table;
+        u32 first_frame = 0;
+        u32 num_frames = 0;
+        u32 clock_hand = 0;
+        // Intrusive list of dirty frames so sync only has to visit the pages that have changed
+        u32 first_dirty = NO_FRAME;
+        u32 num_dirty = 0;
+        pager_stats stats;
+    };
+
+    // Scratch space for writing a set of dirty pages, runs of pages with adjacent indices are written with a single request
+    struct write_batch
+    {
+        // Sorted by page index
+        vector<page*> frames;
+        // frame_requests[i] is the request that writes frames[i]
+        vector<u32> frame_requests;
+        vector<io_buffer> buffers;
+        vector<io_request> requests;
+    };
+
+    constexpr char FILE_VERSION[] = "NifflerDB 0.3";
+    // Files of this version keep their free pages in a free list instead of the bitmap
+    constexpr char FREE_LIST_FILE_VERSION[] = "NifflerDB 0.1";
+    // Files of this version and the free list ones store the page size as a u16, which can't hold 64 KB
+    constexpr char U16_PAGE_SIZE_FILE_VERSION[] = "NifflerDB 0.2";
+
     struct file_header
     {
         char version[24];
-        u16 page_size;
+        u32 page_size;
         u32 num_pages;
-        page_index last_free_list_page;
-        u32 num_free_list_pages;
+        // First page of the free space bitmap, 0 until a page is freed. Files written before the bitmap(version NifflerDB 0.1)
+        // store the last page of their free list here and are converted when they are opened
+        page_index first_bitmap_page;
+        u32 num_free_pages;
+        // Pages past num_pages that have already been allocated in the file but not handed out yet. Files written before
+        // this was added have zeros here
+        u32 num_preallocated_pages;
 
         static inline constexpr u32 DISK_SIZE()
         { 
             return sizeof(version) + sizeof(page_size) + sizeof(num_pages)
-                + sizeof(last_free_list_page) + sizeof(num_free_list_pages);
+                + sizeof(first_bitmap_page) + sizeof(num_free_pages) + sizeof(num_preallocated_pages);
         }
     };
 
@@ -42,6 +153,19 @@ namespace niffler {
         static inline constexpr u32 DISK_SIZE() { return sizeof(next_page) + sizeof(prev_page); }
     };
 
+    // The free space bitmap has one bit per page, set if the page is free. It is stored in a chain of pages where the
+    // n-th page holds the bits of pages [n * NUM_BITS, (n + 1) * NUM_BITS)
+    struct bitmap_page_header
+    {
+        page_index next_page;
+
+        // Padded so the bits start at a multiple of 8 bytes
+        static inline constexpr u32 DISK_SIZE() { return sizeof(next_page) + sizeof(u32); }
+        static inline constexpr u32 NUM_WORDS(u32 page_size = PAGE_SIZE) { return (page_size - bitmap_page_header::DISK_SIZE()) / sizeof(u64); }
+        static inline constexpr u32 NUM_BITS(u32 page_size = PAGE_SIZE) { return bitmap_page_header::NUM_WORDS(page_size) * 64; }
+    };
+
+    // Free pages of files written before the bitmap, only read to convert those files
     struct free_list_header
     {
         page_index next_page;
@@ -49,33 +173,152 @@ namespace niffler {
         u32 num_pages;
 
         static inline constexpr u32 DISK_SIZE() { return sizeof(next_page) + sizeof(prev_page) + sizeof(num_pages); }
-        static inline constexpr u32 PAGES_SECTION_SIZE() { return PAGE_SIZE - free_list_header::DISK_SIZE(); }
-        static inline constexpr u32 MAX_NUM_PAGES() { return free_list_header::PAGES_SECTION_SIZE() / sizeof(u32); }
-        static inline constexpr u32 MAX_PAGES_SECTION_OFFSET() { return PAGE_SIZE - sizeof(u32); }
+        static inline constexpr u32 PAGES_SECTION_SIZE(u32 page_size = PAGE_SIZE) { return page_size - free_list_header::DISK_SIZE(); }
+        static inline constexpr u32 MAX_NUM_PAGES(u32 page_size = PAGE_SIZE) { return free_list_header::PAGES_SECTION_SIZE(page_size) / sizeof(u32); }
+        static inline constexpr u32 MAX_PAGES_SECTION_OFFSET(u32 page_size = PAGE_SIZE) { return page_size - sizeof(u32); }
     };
 
     class pager
     {
     public:
-        pager(const char *file_path, bool truncate_existing_file);
+        pager(const char *file_path, bool truncate_existing_file, const options &opts = options());
         ~pager();
 
         const file_header &header() const;
-        page &get_free_page();
+        // Version of the file when it was opened. Older files are converted when they are opened, header().version is always the current one
+        const char *opened_version() const;
+        pager_stats stats() const;
+        u32 capacity() const;
+        u32 num_shards() const;
+        // Hands out the free page closest after hint, wrapping around to the start of the file, and grows the file if there is none.
+        // The content of a reused page is zeroed
+        page_guard get_free_page(latch_mode mode = latch_mode::none, page_index hint = 0);
+        // Reserves num_pages free pages under a single lock, as close together as the free space allows
+        void get_free_pages(page_index *page_indices, u32 num_pages, page_index hint = 0);
         void free_page(page_index page_index);
-        page &get_page(page_index page_index);
+        void free_pages(const page_index *page_indices, u32 num_pages);
+        // Copies the page into the lowest free page and frees it, returns the new index. Whatever points to the page has to be changed
+        // by the caller. Only call it while nothing else uses the page
+        page_index move_page(page_index page_index);
+        // Gives the free pages at the end of the file and the preallocated pages back, returns the number of free pages removed.
+        // The file itself is cut by the next sync, with a write-ahead log by the next checkpoint. The file of io_mode::mmap keeps its size
+        u32 truncate();
+        page_guard get_page(page_index page_index, latch_mode mode = latch_mode::none);
+        void prefetch(const page_index *page_indices, u32 num_pages);
+        void mark_dirty(page &page);
         void save_page(page_index page_index);
+        // Makes every change so far durable. With a write-ahead log the changed pages are appended to the log and only the log is synced,
+        // concurrent calls share that sync. Never call it while holding a latched page or lock_operation
         bool sync();
+        // Like sync but doesn't wait for the changes to reach the disk, they survive the process crashing but not the OS
+        bool flush();
+        // Commits the changes, writes every dirty page to the db file, syncs it and empties the write-ahead log
+        bool checkpoint();
+        // Held by writers that change pages under latches instead of an exclusive tree lock, for the whole change. A commit waits for
+        // them so it never logs part of one, take it before latching the first page
+        std::shared_lock<std::shared_mutex> lock_operation();
         bool ok() const;
 
     private:
-        page &alloc_page();
-        page &get_page_internal(page_index page_index);
+        friend class page_guard;
+
+        pager_shard &shard_for(size_t page_index);
+        page &pin_frame(page_index page_index);
+        void unpin_page(page &page);
+        page_guard take_free_page(page_index hint);
+        page_guard alloc_page();
+        page_guard map_zeroed_page(page_index page_index);
+        page_index find_free_page(page_index hint) const;
+        void mark_free(page_index page_index);
+        void mark_used(page_index page_index);
+        void add_bitmap_pages(size_t num_bitmap_pages);
+        void load_bitmap();
+        void convert_free_list(page_index last_free_list_page);
+        void save_bitmap();
+        bool discard_page(page_index page_index);
+        void truncate_file();
+        void punch_holes();
+        page &map_frame(pager_shard &shard, page_index page_index);
+        u32 find_victim(pager_shard &shard);
+        void evict(pager_shard &shard, page &frame);
+        void read_page(page &frame);
+        bool write_page(page &frame);
+        u64 page_offset(size_t page_index) const;
+        void mark_dirty(pager_shard &shard, page &frame);
+        void clear_dirty(pager_shard &shard, page &frame);
+        bool alloc_frames(bool huge_pages);
+        bool map_pages(u32 num_pages);
+        u8 *mapped_page(page_index page_index) const;
+        bool flush_dirty_pages();
+        void coalesce_writes(write_batch &batch, u32 max_run) const;
         bool sync(bool save_pages);
-        void save_header(bool fsync = true);
+        bool commit_log(bool fsync);
+        void log_dirty_pages();
+        vector<page*> pin_dirty_pages(bool unlogged_only);
+        bool write_checkpoint();
+        // Called with log_pages_mutex_ held
+        bool write_log_pages(u64 committed_lsn);
+        void save_header();
+        void run_writer();
+        void trickle_dirty_pages();
 
         file_header header_;
-        vector<page> pages_;
+        char opened_version_[sizeof(file_header::version)] = { 0 };
+        // header_ changed since it was last written to page 0, it is written with the next commit instead of on every change
+        bool header_dirty_ = false;
+        // Set by truncate until the file has been cut to num_pages
+        bool truncate_file_ = false;
+        // The file is grown by this many pages at a time
+        u32 file_growth_pages_ = DEFAULT_FILE_GROWTH_PAGES;
+        // In memory copy of the free space bitmap, saved with the header. bitmap_dirty_[n] is set if the n-th bitmap page has to be saved
+        vector<u64> bitmap_;
+        vector<page_index> bitmap_pages_;
+        vector<bool> bitmap_dirty_;
+        // Pages freed since the last batch of holes was punched, same layout as bitmap_. Only used with options::punch_holes
+        bool punch_holes_ = false;
+        vector<u64> holes_;
+        u32 num_holes_ = 0;
+        io_mode io_mode_ = io_mode::buffered;
+        // Only used in io_mode::mmap, segments are never remapped so frame content pointers stay valid
+        vector<u8*> segments_;
+        mutable std::mutex segments_mutex_;
+        // Memory for all frames in every mode but io_mode::mmap, each frame always uses the same slice
+        u8 *arena_ = nullptr;
+        size_t arena_size_ = 0;
+        // Sized once in the constructor and never resized, page references and guards stay valid for the lifetime of the pager
+        vector<page> frames_;
+        mutable vector<pager_shard> shards_;
+        // Protects the file header, the free space bitmap and the I/O scratch space. Taken before a shard lock, never while holding one
+        mutable std::recursive_mutex mutex_;
         file_handle file_handle_;
+        io_engine io_engine_;
+        // Null if options::wal is not set
+        std::unique_ptr<wal> wal_;
+        u64 checkpoint_size_ = 0;
+        // Commits hold it shared, a checkpoint holds it exclusively so nothing is logged while the log is emptied
+        std::shared_mutex checkpoint_mutex_;
+        // See lock_operation, commits hold it exclusively while they log the dirty pages
+        std::shared_mutex operation_mutex_;
+        // Pages evicted before a commit covered their changes, with the lsn of their image. The db file keeps the old version until a
+        // checkpoint finds the image committed, until then the page is read back from the log. Taken after a shard lock
+        unordered_map<page_index, u64> log_pages_;
+        std::mutex log_pages_mutex_;
+        // Scratch space for batched reads/writes, kept around to avoid allocating on every sync
+        vector<io_request> io_requests_;
+        vector<page*> io_frames_;
+        write_batch flush_batch_;
+        // Background writer, only running if options::writer_dirty_percent is set. It has its own I/O engine and scratch space
+        // so it never needs the pager lock
+        std::thread writer_;
+        std::mutex writer_mutex_;
+        std::condition_variable writer_wakeup_;
+        bool stop_writer_ = false;
+        u32 writer_interval_ms_ = DEFAULT_WRITER_INTERVAL_MS;
+        // The writer writes pages until no more than this many are dirty
+        u32 writer_max_dirty_pages_ = 0;
+        std::unique_ptr<io_engine> writer_io_engine_;
+        // Dirty pages with their change counter when they were picked
+        vector<std::pair<page*, u32>> writer_frames_;
+        write_batch writer_batch_;
     };
 }
@@ -1,6 +1,7 @@
 #include "serialization.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 namespace niffler {
@@ -65,6 +66,13 @@ namespace niffler {
         v.first_page = read_u32(buffer);
     }
 
+    static
+    bool has_u16_page_size(const file_header &header)
+    {
+        return strncmp(header.version, U16_PAGE_SIZE_FILE_VERSION, sizeof(header.version)) == 0
+            || strncmp(header.version, FREE_LIST_FILE_VERSION, sizeof(header.version)) == 0;
+    }
+
     void serialize_file_header(u8 *buffer, const file_header &header)
     {
         static_assert(sizeof(page_index) == sizeof(u32));
@@ -72,10 +80,19 @@ namespace niffler {
         memcpy(buffer, header.version, sizeof(header.version));
         buffer += sizeof(header.version);
 
-        write_u16(&buffer, header.page_size);
+        if (has_u16_page_size(header))
+        {
+            write_u16(&buffer, static_cast<u16>(header.page_size));
+        }
+        else
+        {
+            write_u32(&buffer, header.page_size);
+        }
+
         write_u32(&buffer, header.num_pages);
-        write_u32(&buffer, header.last_free_list_page);
-        write_u32(&buffer, header.num_free_list_pages);
+        write_u32(&buffer, header.first_bitmap_page);
+        write_u32(&buffer, header.num_free_pages);
+        write_u32(&buffer, header.num_preallocated_pages);
     }
 
     void deserialize_file_header(const u8 *buffer, file_header &header)
@@ -83,10 +100,11 @@ namespace niffler {
         memcpy(header.version, buffer, sizeof(header.version));
         buffer += sizeof(header.version);
 
-        header.page_size = read_u16(&buffer);
+        header.page_size = has_u16_page_size(header) ? read_u16(&buffer) : read_u32(&buffer);
         header.num_pages = read_u32(&buffer);
-        header.last_free_list_page = read_u32(&buffer);
-        header.num_free_list_pages = read_u32(&buffer);
+        header.first_bitmap_page = read_u32(&buffer);
+        header.num_free_pages = read_u32(&buffer);
+        header.num_preallocated_pages = read_u32(&buffer);
     }
 
     void serialize_page_header(u8 *buffer, const page_header &header)
@@ -103,6 +121,20 @@ namespace niffler {
         header.prev_page = read_u32(&buffer);
     }
 
+    void serialize_bitmap_page(u8 *buffer, const bitmap_page_header &header, const u64 *words, u32 num_words)
+    {
+        write_u32(&buffer, header.next_page);
+        write_u32(&buffer, 0);
+        memcpy(buffer, words, num_words * sizeof(u64));
+    }
+
+    void deserialize_bitmap_page(const u8 *buffer, bitmap_page_header &header, u64 *words, u32 num_words)
+    {
+        header.next_page = read_u32(&buffer);
+        read_u32(&buffer);
+        memcpy(words, buffer, num_words * sizeof(u64));
+    }
+
     void serialize_free_list_header(u8 * buffer, const free_list_header &header)
     {
         write_u32(&buffer, header.next_page);
@@ -117,26 +149,60 @@ namespace niffler {
         header.num_pages = read_u32(&buffer);
     }
 
-    void write_free_list_page_index(u8 * buffer, u32 index, page_index page_index)
+    void write_free_list_page_index(u8 * buffer, u32 index, page_index page_index, u32 page_size)
     {
         const auto ptr_offset = free_list_header::DISK_SIZE() + (sizeof(u32) * index);
-        assert(ptr_offset <= free_list_header::MAX_PAGES_SECTION_OFFSET());
+        assert(ptr_offset <= free_list_header::MAX_PAGES_SECTION_OFFSET(page_size));
         assert(ptr_offset >= free_list_header::DISK_SIZE());
 
         const auto page_index_ptr = buffer + ptr_offset;
         *((u32*)page_index_ptr) = page_index;
     }
 
-    u32 read_free_list_page_index(const u8 *buffer, u32 index)
+    u32 read_free_list_page_index(const u8 *buffer, u32 index, u32 page_size)
     {
         const auto ptr_offset = free_list_header::DISK_SIZE() + (sizeof(u32) * index);
-        assert(ptr_offset <= free_list_header::MAX_PAGES_SECTION_OFFSET());
+        assert(ptr_offset <= free_list_header::MAX_PAGES_SECTION_OFFSET(page_size));
         assert(ptr_offset >= free_list_header::DISK_SIZE());
 
         const auto page_index_ptr = buffer + ptr_offset;
         return *((u32*)page_index_ptr);
     }
 
+    void serialize_wal_header(u8 *buffer, const wal_header &header)
+    {
+        memcpy(buffer, header.magic, sizeof(header.magic));
+        buffer += sizeof(header.magic);
+
+        write_u32(&buffer, header.page_size);
+        write_u32(&buffer, header.salt);
+    }
+
+    void deserialize_wal_header(const u8 *buffer, wal_header &header)
+    {
+        memcpy(header.magic, buffer, sizeof(header.magic));
+        buffer += sizeof(header.magic);
+
+        header.page_size = read_u32(&buffer);
+        header.salt = read_u32(&buffer);
+    }
+
+    void serialize_wal_record_header(u8 *buffer, const wal_record_header &header)
+    {
+        write_u32(&buffer, static_cast<u32>(header.type));
+        write_u32(&buffer, header.page);
+        write_u32(&buffer, header.salt);
+        write_u32(&buffer, header.checksum);
+    }
+
+    void deserialize_wal_record_header(const u8 *buffer, wal_record_header &header)
+    {
+        header.type = static_cast<wal_record_type>(read_u32(&buffer));
+        header.page = read_u32(&buffer);
+        header.salt = read_u32(&buffer);
+        header.checksum = read_u32(&buffer);
+    }
+
     void serialize_bp_tree_header(u8 *buffer, const bp_tree_header &header)
     {
         static_assert(sizeof(page_index) == sizeof(u32));
@@ -148,6 +214,7 @@ namespace niffler {
         write_u32(&buffer, header.height);
         write_u32(&buffer, header.root_page);
         write_u32(&buffer, header.leaf_page);
+        write_u32(&buffer, static_cast<u32>(header.key_format));
     }
 
     void deserialize_bp_tree_header(const u8 *buffer, bp_tree_header &header)
@@ -161,6 +228,7 @@ namespace niffler {
         header.height = read_u32(&buffer);
         header.root_page = read_u32(&buffer);
         header.leaf_page = read_u32(&buffer);
+        header.key_format = static_cast<key_format>(read_u32(&buffer));
     }
 
     template<u32 N>
@@ -226,19 +294,35 @@ namespace niffler {
     template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<4> &node);
     template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<6> &node);
     template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<10> &node);
-    template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<DEFAULT_TREE_ORDER> &node);
+    template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<tree_order(4 * 1024)> &node);
+    template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<tree_order(8 * 1024)> &node);
+    template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<tree_order(16 * 1024)> &node);
+    template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<tree_order(32 * 1024)> &node);
+    template void serialize_bp_tree_node(u8 *buffer, const bp_tree_node<tree_order(64 * 1024)> &node);
     template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<4> &node);
     template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<6> &node);
     template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<10> &node);
-    template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<DEFAULT_TREE_ORDER> &node);
+    template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<tree_order(4 * 1024)> &node);
+    template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<tree_order(8 * 1024)> &node);
+    template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<tree_order(16 * 1024)> &node);
+    template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<tree_order(32 * 1024)> &node);
+    template void serialize_bp_tree_leaf(u8 *buffer, const bp_tree_leaf<tree_order(64 * 1024)> &node);
 
     template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<4> &node);
     template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<6> &node);
     template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<10> &node);
-    template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<DEFAULT_TREE_ORDER> &node);
+    template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<tree_order(4 * 1024)> &node);
+    template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<tree_order(8 * 1024)> &node);
+    template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<tree_order(16 * 1024)> &node);
+    template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<tree_order(32 * 1024)> &node);
+    template void deserialize_bp_tree_node(const u8 *buffer, bp_tree_node<tree_order(64 * 1024)> &node);
     template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<4> &node);
     template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<6> &node);
     template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<10> &node);
-    template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<DEFAULT_TREE_ORDER> &node);
+    template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<tree_order(4 * 1024)> &node);
+    template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<tree_order(8 * 1024)> &node);
+    template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<tree_order(16 * 1024)> &node);
+    template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<tree_order(32 * 1024)> &node);
+    template void deserialize_bp_tree_leaf(const u8 *buffer, bp_tree_leaf<tree_order(64 * 1024)> &node);
 
 }
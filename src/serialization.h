@@ -3,6 +3,7 @@
 #include "include/define.h"
 #include "pager.h"
 #include "bp_tree.h"
+#include "wal.h"
 
 namespace niffler {
 
@@ -12,10 +13,19 @@ namespace niffler {
     void serialize_page_header(u8 *buffer, const page_header &header);
     void deserialize_page_header(const u8 *buffer, page_header &header);
 
+    void serialize_bitmap_page(u8 *buffer, const bitmap_page_header &header, const u64 *words, u32 num_words);
+    void deserialize_bitmap_page(const u8 *buffer, bitmap_page_header &header, u64 *words, u32 num_words);
+
     void serialize_free_list_header(u8 *buffer, const free_list_header &header);
     void deserialize_free_list_header(const u8 *buffer, free_list_header &header);
-    void write_free_list_page_index(u8 *buffer, u32 index, page_index page_index);
-    u32 read_free_list_page_index(const u8 *buffer, u32 index);
+    void write_free_list_page_index(u8 *buffer, u32 index, page_index page_index, u32 page_size = PAGE_SIZE);
+    u32 read_free_list_page_index(const u8 *buffer, u32 index, u32 page_size = PAGE_SIZE);
+
+    void serialize_wal_header(u8 *buffer, const wal_header &header);
+    void deserialize_wal_header(const u8 *buffer, wal_header &header);
+
+    void serialize_wal_record_header(u8 *buffer, const wal_record_header &header);
+    void deserialize_wal_record_header(const u8 *buffer, wal_record_header &header);
 
     void serialize_bp_tree_header(u8 *buffer, const bp_tree_header &header);
     void deserialize_bp_tree_header(const u8 *buffer, bp_tree_header &header);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <type_traits>
 
 namespace niffler {
 
@@ -14,4 +15,8 @@ namespace niffler {
         const bool ok;
     };
 
+    // static_assert(false) in a discarded if constexpr branch is ill-formed, this makes the condition depend on T
+    template<class T>
+    struct dependent_false : std::false_type {};
+
 }
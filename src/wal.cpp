@@ -0,0 +1,339 @@
+#include "wal.h"
+
+#include <assert.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+#include "serialization.h"
+
+namespace niffler {
+
+    constexpr char WAL_MAGIC[8] = { 'N', 'i', 'f', 'W', 'A', 'L', '0', '1' };
+
+    static
+    std::string get_wal_path(const char *db_file_path)
+    {
+        return std::string(db_file_path) + "-wal";
+    }
+
+    static
+    u32 checksum(const u8 *data, size_t size, u32 hash)
+    {
+        // FNV-1a over 32 bit words, record headers and page images are always a multiple of 4 bytes
+        for (size_t i = 0; i + sizeof(u32) <= size; i += sizeof(u32))
+        {
+            u32 word;
+            memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * 16777619u;
+        }
+
+        return hash;
+    }
+
+    static
+    u32 record_checksum(const u8 *record, u32 payload_size)
+    {
+        // The checksum field is the last field of the header and is not part of its own checksum
+        const auto hash = checksum(record, wal_record_header::DISK_SIZE() - sizeof(u32), 2166136261u);
+        return checksum(record + wal_record_header::DISK_SIZE(), payload_size, hash);
+    }
+
+    wal::wal(const char *db_file_path, bool truncate_existing_file)
+        :
+        handle_(get_wal_path(db_file_path).c_str(), truncate_existing_file ? file_mode::write_update : file_mode::open_update)
+    {
+    }
+
+    bool wal::ok() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return handle_.ok() && !failed_;
+    }
+
+    bool wal::recover(const file_handle &db_file)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // A new or empty log has nothing to recover
+        const auto log_size = file_size(handle_);
+        if (log_size < wal_header::DISK_SIZE())
+            return true;
+
+        u8 header_buffer[wal_header::DISK_SIZE()];
+        if (read_at(handle_, header_buffer, sizeof(header_buffer), 0) != sizeof(header_buffer))
+            return false;
+
+        wal_header header;
+        deserialize_wal_header(header_buffer, header);
+        if (memcmp(header.magic, WAL_MAGIC, sizeof(WAL_MAGIC)) != 0 || !valid_page_size(header.page_size))
+            return true;
+
+        salt_ = header.salt;
+
+        // Offset of the last image of every page, images only count once a commit record follows them
+        std::unordered_map<page_index, u64> pending;
+        std::unordered_map<page_index, u64> committed;
+        vector<u8> record(wal_record_header::DISK_SIZE() + header.page_size);
+        auto offset = static_cast<u64>(wal_header::DISK_SIZE());
+
+        // Stops at the first record that is incomplete, from an older log or doesn't match its checksum
+        for (;;)
+        {
+            if (read_at(handle_, record.data(), wal_record_header::DISK_SIZE(), offset) != wal_record_header::DISK_SIZE())
+                break;
+
+            wal_record_header record_header;
+            deserialize_wal_record_header(record.data(), record_header);
+            if (record_header.salt != header.salt)
+                break;
+
+            if (record_header.type != wal_record_type::page && record_header.type != wal_record_type::commit)
+                break;
+
+            const auto payload_size = record_header.type == wal_record_type::page ? header.page_size : 0;
+            const auto payload = record.data() + wal_record_header::DISK_SIZE();
+            if (read_at(handle_, payload, payload_size, offset + wal_record_header::DISK_SIZE()) != payload_size)
+                break;
+
+            if (record_checksum(record.data(), payload_size) != record_header.checksum)
+                break;
+
+            if (record_header.type == wal_record_type::page)
+            {
+                pending[record_header.page] = offset + wal_record_header::DISK_SIZE();
+            }
+            else
+            {
+                for (auto& image : pending)
+                {
+                    committed[image.first] = image.second;
+                }
+
+                pending.clear();
+            }
+
+            offset += wal_record_header::DISK_SIZE() + payload_size;
+        }
+
+        if (committed.empty())
+            return true;
+
+        // The db file may have been opened for direct I/O, which only works with aligned buffers
+        auto buffer = static_cast<u8*>(alloc_aligned(header.page_size, DIRECT_IO_ALIGNMENT));
+        auto ok = buffer != nullptr;
+
+        for (auto& image : committed)
+        {
+            if (!ok)
+                break;
+
+            const auto db_offset = static_cast<u64>(image.first) * header.page_size;
+            ok = read_at(handle_, buffer, header.page_size, image.second) == header.page_size
+                && write_at(db_file, buffer, header.page_size, db_offset) == header.page_size;
+        }
+
+        free_aligned(buffer);
+
+        return ok && fsync(db_file) == 0;
+    }
+
+    bool wal::reset(u32 page_size)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        // An evicted page may be syncing the log right now
+        while (flushing_)
+        {
+            flushed_.wait(lock);
+        }
+
+        page_size_ = page_size;
+        salt_++;
+
+        wal_header header;
+        memcpy(header.magic, WAL_MAGIC, sizeof(WAL_MAGIC));
+        header.page_size = page_size_;
+        header.salt = salt_;
+
+        u8 header_buffer[wal_header::DISK_SIZE()];
+        serialize_wal_header(header_buffer, header);
+
+        // Records that are still buffered are written to the new log with the next commit
+        file_size_ = wal_header::DISK_SIZE();
+
+        record_offsets_.clear();
+        for (size_t offset = 0; offset < buffer_.size(); offset += record_size(buffer_.data() + offset))
+        {
+            record_offsets_.push_back(file_size_ + offset);
+        }
+
+        first_lsn_ = next_lsn_ - record_offsets_.size();
+
+        return write_at(handle_, header_buffer, sizeof(header_buffer), 0) == sizeof(header_buffer)
+            && ftruncate(handle_, wal_header::DISK_SIZE()) == 0
+            && fsync(handle_) == 0;
+    }
+
+    u64 wal::append(page_index page_index, const u8 *content)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        assert(page_size_ > 0);
+
+        // Salt and checksum are filled in when the record is written
+        wal_record_header header = { wal_record_type::page, page_index, 0, 0 };
+
+        const auto offset = buffer_.size();
+        buffer_.resize(offset + wal_record_header::DISK_SIZE() + page_size_);
+        serialize_wal_record_header(buffer_.data() + offset, header);
+        memcpy(buffer_.data() + offset + wal_record_header::DISK_SIZE(), content, page_size_);
+        record_offsets_.push_back(file_size_ + offset);
+
+        return next_lsn_++;
+    }
+
+    bool wal::read(u64 lsn, u8 *content)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        // Records that are being written are read from the file once they are there
+        while (flushing_)
+        {
+            flushed_.wait(lock);
+        }
+
+        if (failed_ || lsn < first_lsn_ || lsn - first_lsn_ >= record_offsets_.size())
+            return false;
+
+        const auto offset = record_offsets_[lsn - first_lsn_];
+        if (offset >= file_size_)
+        {
+            memcpy(content, buffer_.data() + (offset - file_size_) + wal_record_header::DISK_SIZE(), page_size_);
+            return true;
+        }
+
+        return read_at(handle_, content, page_size_, offset + wal_record_header::DISK_SIZE()) == page_size_;
+    }
+
+    u64 wal::tail() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return next_lsn_ - 1;
+    }
+
+    bool wal::commit(u64 lsn, bool sync)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        const auto committed = [this, lsn, sync]() { return flushed_lsn_ >= lsn && (!sync || synced_lsn_ >= lsn); };
+
+        while (!committed() && flushing_)
+        {
+            flushed_.wait(lock);
+        }
+
+        if (committed())
+            return !failed_;
+
+        // This thread writes everything buffered so far, including the records of the threads waiting above
+        flushing_ = true;
+        write_buffer_.clear();
+
+        auto commit_lsn = flushed_lsn_;
+        auto write_offset = file_size_;
+        const auto salt = salt_;
+
+        // The records may already be written and only need to be synced
+        if (flushed_lsn_ < lsn)
+        {
+            wal_record_header header = { wal_record_type::commit, 0, 0, 0 };
+            const auto commit_offset = buffer_.size();
+            buffer_.resize(commit_offset + wal_record_header::DISK_SIZE());
+            serialize_wal_record_header(buffer_.data() + commit_offset, header);
+            record_offsets_.push_back(file_size_ + commit_offset);
+
+            commit_lsn = next_lsn_++;
+            std::swap(buffer_, write_buffer_);
+            file_size_ += write_buffer_.size();
+        }
+
+        // Other threads keep appending to buffer_ while the log is written
+        lock.unlock();
+
+        auto ok = true;
+        if (!write_buffer_.empty())
+        {
+            seal(write_buffer_, salt);
+            ok = write_at(handle_, write_buffer_.data(), write_buffer_.size(), write_offset) == write_buffer_.size();
+        }
+
+        if (ok && sync)
+            ok = fsync(handle_) == 0;
+
+        lock.lock();
+
+        flushing_ = false;
+        flushed_lsn_ = commit_lsn;
+        failed_ = failed_ || !ok;
+
+        if (sync)
+        {
+            synced_lsn_ = commit_lsn;
+            num_syncs_++;
+        }
+
+        flushed_.notify_all();
+
+        return !failed_;
+    }
+
+    u64 wal::durable_lsn() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return synced_lsn_;
+    }
+
+    u64 wal::committed_lsn() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return flushed_lsn_;
+    }
+
+    u64 wal::size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return file_size_ + buffer_.size();
+    }
+
+    u64 wal::num_syncs() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return num_syncs_;
+    }
+
+    u32 wal::record_size(const u8 *record) const
+    {
+        wal_record_header header;
+        deserialize_wal_record_header(record, header);
+
+        return wal_record_header::DISK_SIZE() + (header.type == wal_record_type::page ? page_size_ : 0);
+    }
+
+    void wal::seal(vector<u8> &records, u32 salt) const
+    {
+        for (size_t offset = 0; offset < records.size(); offset += record_size(records.data() + offset))
+        {
+            auto record = records.data() + offset;
+
+            wal_record_header header;
+            deserialize_wal_record_header(record, header);
+
+            const auto payload_size = record_size(record) - wal_record_header::DISK_SIZE();
+            header.salt = salt;
+            serialize_wal_record_header(record, header);
+
+            header.checksum = record_checksum(record, payload_size);
+            serialize_wal_record_header(record, header);
+        }
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "include/define.h"
+#include "files.h"
+
+namespace niffler {
+
+    using std::vector;
+
+    struct wal_header
+    {
+        char magic[8];
+        u32 page_size;
+        // Changed every time the log is emptied, records left over from an older log don't match it
+        u32 salt;
+
+        static inline constexpr u32 DISK_SIZE() { return sizeof(magic) + sizeof(page_size) + sizeof(salt); }
+    };
+
+    enum class wal_record_type : u32 {
+        // Followed by a full page image
+        page = 1,
+        // Every record before a commit record is durable, records after the last one are ignored on recovery
+        commit = 2
+    };
+
+    struct wal_record_header
+    {
+        wal_record_type type;
+        page_index page;
+        u32 salt;
+        // Covers the other fields and the page image
+        u32 checksum;
+
+        static inline constexpr u32 DISK_SIZE() { return sizeof(type) + sizeof(page) + sizeof(salt) + sizeof(checksum); }
+    };
+
+    // Write-ahead log kept next to the db file(<db file>-wal). Changed pages are appended as full page images and made durable
+    // with one sequential write and one fsync, the db file itself is only written later by a checkpoint.
+    // Opening a db copies the last committed image of every page in the log back into the db file
+    class wal
+    {
+    public:
+        wal(const char *db_file_path, bool truncate_existing_file);
+
+        wal(const wal&) = delete;
+        wal &operator=(const wal&) = delete;
+
+        bool ok() const;
+        // Writes the last committed image of every page into db_file and syncs it, the log is not changed
+        bool recover(const file_handle &db_file);
+        // Empties the log. Only call once every page in it has been written to the db file and synced
+        bool reset(u32 page_size);
+        // Buffers a page image until the next commit, returns its lsn
+        u64 append(page_index page_index, const u8 *content);
+        // Reads back the page image of the record with lsn, buffered or written. Fails for records from before the last reset
+        bool read(u64 lsn, u8 *content);
+        // lsn of the last appended record
+        u64 tail() const;
+        // Makes every record up to lsn durable. Threads that commit while another thread is writing the log wait for it
+        // and are written together by the next one, a group of concurrent commits shares a single write and fsync.
+        // Without sync the records are only written, they survive the process crashing but not the OS
+        bool commit(u64 lsn, bool sync = true);
+        // Every record up to this lsn has been synced
+        u64 durable_lsn() const;
+        // Every record up to this lsn is followed by a commit record in the log file, synced or not
+        u64 committed_lsn() const;
+        // Bytes in the log, including buffered records
+        u64 size() const;
+        // Number of times the log has been synced
+        u64 num_syncs() const;
+
+    private:
+        u32 record_size(const u8 *record) const;
+        void seal(vector<u8> &records, u32 salt) const;
+
+        file_handle handle_;
+        u32 page_size_ = 0;
+        u32 salt_ = 0;
+        u64 file_size_ = 0;
+        u64 next_lsn_ = 1;
+        // Written to the log / synced to disk
+        u64 flushed_lsn_ = 0;
+        u64 synced_lsn_ = 0;
+        u64 num_syncs_ = 0;
+        // Set while a thread is writing the log, commits wait for it instead of writing on their own
+        bool flushing_ = false;
+        // A failed write or fsync leaves the log in an unknown state, no commit succeeds after that
+        bool failed_ = false;
+        // Offset in the log of every record since first_lsn_, buffered records included
+        u64 first_lsn_ = 1;
+        vector<u64> record_offsets_;
+        // Records appended since the last commit, swapped with write_buffer_ by the thread writing them
+        vector<u8> buffer_;
+        vector<u8> write_buffer_;
+        mutable std::mutex mutex_;
+        std::condition_variable flushed_;
+    };
+}
@@ -0,0 +1,264 @@
+#include <gtest\gtest.h>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "bp_tree.h"
+#include "include/db.h"
+#include "key_search.h"
+#include "serialization.h"
+#include "test_helpers.h"
+
+using namespace niffler;
+
+// Benchmarks are disabled by default, run them with:
+// --gtest_also_run_disabled_tests --gtest_filter=BENCHMARK.*
+
+using bench_clock = std::chrono::high_resolution_clock;
+
+static double elapsed_us(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+TEST(BENCHMARK, DISABLED_INSERT_LATENCY_1M_PAGES)
+{
+    // Every insert allocates a data page so the file grows by at least one page per key
+    constexpr auto num_keys = 1100000;
+    constexpr auto report_interval = 100000;
+
+    auto p = create_pager("files/bench_insert_latency.ndb");
+    auto t = bp_tree<DEFAULT_TREE_ORDER>::create(p.get()).value;
+
+    const char *value = "benchmark value";
+    const auto value_size = static_cast<u32>(strlen(value));
+
+    std::cout << "keys\tfile pages\tavg insert (us)\tmax insert (us)" << std::endl;
+
+    auto total_us = 0.0;
+    auto max_us = 0.0;
+
+    for (auto i = 1; i <= num_keys; i++)
+    {
+        const auto start = bench_clock::now();
+        EXPECT_TRUE(t->insert(i, value, value_size));
+        const auto us = elapsed_us(start);
+
+        total_us += us;
+        max_us = us > max_us ? us : max_us;
+
+        if (i % report_interval == 0)
+        {
+            std::cout << i << "\t" << p->header().num_pages << "\t" << total_us / report_interval << "\t" << max_us << std::endl;
+            total_us = 0.0;
+            max_us = 0.0;
+        }
+    }
+
+    EXPECT_GT(p->header().num_pages, 1000000u);
+}
+
+TEST(BENCHMARK, DISABLED_WAL_INSERT_THROUGHPUT)
+{
+    // Concurrent inserts share the log's fsync through group commit, without the log each insert syncs the db file on its own
+    constexpr auto num_threads = 4;
+    constexpr auto keys_per_thread = 2000;
+
+    const char *value = "benchmark value";
+    const auto value_size = static_cast<u32>(strlen(value));
+
+    std::cout << "wal\tinserts/s" << std::endl;
+
+    for (const auto wal : { false, true })
+    {
+        options opts;
+        opts.wal = wal;
+        auto niffler = std::make_unique<db>("files/bench_wal.ndb", true, opts);
+
+        const auto start = bench_clock::now();
+
+        std::vector<std::thread> threads;
+        for (auto t = 0; t < num_threads; t++)
+        {
+            threads.emplace_back([&niffler, t, value, value_size]() {
+                for (auto i = 0; i < keys_per_thread; i++)
+                {
+                    EXPECT_TRUE(niffler->insert(t * keys_per_thread + i, value, value_size));
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        const auto seconds = elapsed_us(start) / 1000000.0;
+        std::cout << wal << "\t" << num_threads * keys_per_thread / seconds << std::endl;
+    }
+}
+
+TEST(BENCHMARK, DISABLED_FIND_IN_MEMORY)
+{
+    // The pool holds every page so only the work done per tree level is measured, not I/O
+    constexpr auto num_keys = 20000;
+    constexpr auto num_rounds = 20;
+
+    options opts;
+    opts.pager_size = 32 * 1024;
+    auto p = create_pager("files/bench_find.ndb", true, opts);
+    auto t = bp_tree<DEFAULT_TREE_ORDER>::create(p.get()).value;
+
+    const char *value = "benchmark value";
+    const auto value_size = static_cast<u32>(strlen(value));
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        EXPECT_TRUE(t->insert(i, value, value_size));
+    }
+
+    std::cout << "operation\tns/op" << std::endl;
+
+    auto start = bench_clock::now();
+    for (auto round = 0; round < num_rounds; round++)
+    {
+        for (auto i = 0; i < num_keys; i++)
+        {
+            EXPECT_TRUE(t->exists(i));
+        }
+    }
+
+    std::cout << "exists\t" << elapsed_us(start) * 1000.0 / (num_rounds * num_keys) << std::endl;
+
+    start = bench_clock::now();
+    for (auto round = 0; round < num_rounds; round++)
+    {
+        for (auto i = 0; i < num_keys; i++)
+        {
+            EXPECT_TRUE(t->find(i)->found);
+        }
+    }
+
+    std::cout << "find\t" << elapsed_us(start) * 1000.0 / (num_rounds * num_keys) << std::endl;
+}
+
+TEST(BENCHMARK, DISABLED_NODE_SEARCH_FANOUT)
+{
+    // Cost of picking the child of a node by fanout, the binary search against the linear scan it replaced
+    constexpr auto N = tree_order(64 * 1024);
+    constexpr auto num_searches = 200000;
+
+    auto node = std::make_unique<bp_tree_node<N>>();
+    std::vector<u8> content(64 * 1024);
+    const bp_tree_node_view<N> view(content.data());
+
+    std::cout << "fanout\tbinary ns\tlinear ns" << std::endl;
+
+    for (auto fanout : { 8u, 32u, 128u, DEFAULT_TREE_ORDER, N })
+    {
+        // Even keys so half of the searches fall between two children
+        node->num_children = fanout;
+        for (auto i = 0u; i < fanout; i++)
+        {
+            node->children[i].key = static_cast<int>(i * 2);
+            node->children[i].page = i + 1;
+        }
+
+        serialize_bp_tree_node(content.data(), *node);
+
+        std::vector<key> keys;
+        for (auto i = 0; i < num_searches; i++)
+        {
+            keys.emplace_back(static_cast<int>((i * 7919u) % (fanout * 2)));
+        }
+
+        u64 checksum = 0;
+        auto start = bench_clock::now();
+        for (const auto &k : keys)
+        {
+            checksum += view.page_at(view.find_child(k));
+        }
+
+        const auto binary_ns = elapsed_us(start) * 1000.0 / num_searches;
+
+        u64 linear_checksum = 0;
+        start = bench_clock::now();
+        for (const auto &k : keys)
+        {
+            auto index = fanout - 1;
+            for (auto i = 0u; i < fanout; i++)
+            {
+                if (view.key_at(i) > k)
+                {
+                    index = i;
+                    break;
+                }
+            }
+
+            linear_checksum += view.page_at(index);
+        }
+
+        const auto linear_ns = elapsed_us(start) * 1000.0 / num_searches;
+
+        EXPECT_EQ(checksum, linear_checksum);
+        std::cout << fanout << "\t" << binary_ns << "\t" << linear_ns << std::endl;
+    }
+}
+
+TEST(BENCHMARK, DISABLED_KEY_SEARCH_KERNELS)
+{
+    // Comparing a probe against a run of keys laid out like the children of a node, a key_cmp loop against every kernel
+    constexpr auto num_searches = 200000;
+    constexpr auto stride = bp_tree_node_child::DISK_SIZE();
+
+    std::cout << "run\tkernel\tns/search" << std::endl;
+
+    for (auto run : { 4u, KEY_SEARCH_RUN, DEFAULT_TREE_ORDER })
+    {
+        std::vector<u8> keys(run * stride);
+        for (auto i = 0u; i < run; i++)
+        {
+            const key k(static_cast<int>(i * 2));
+            memcpy(keys.data() + i * stride, k.data, sizeof(k.data));
+        }
+
+        std::vector<key> probes;
+        for (auto i = 0; i < num_searches; i++)
+        {
+            probes.emplace_back(static_cast<int>((i * 7919u) % (run * 2)));
+        }
+
+        u64 expected = 0;
+        auto start = bench_clock::now();
+        for (const auto &probe : probes)
+        {
+            for (auto i = 0u; i < run; i++)
+            {
+                expected += key_cmp(*reinterpret_cast<const key*>(keys.data() + i * stride), probe) <= 0;
+            }
+        }
+
+        std::cout << run << "\tkey_cmp\t" << elapsed_us(start) * 1000.0 / num_searches << std::endl;
+
+        const std::pair<key_kernel, const char*> kernels[] = {
+            { key_kernel::scalar, "scalar" }, { key_kernel::sse2, "sse2" }, { key_kernel::avx2, "avx2" }
+        };
+
+        for (const auto &kernel : kernels)
+        {
+            if (!key_kernel_supported(kernel.first))
+                continue;
+
+            u64 result = 0;
+            start = bench_clock::now();
+            for (const auto &probe : probes)
+            {
+                result += count_not_greater(kernel.first, probe, keys.data(), stride, run);
+            }
+
+            std::cout << run << "\t" << kernel.second << "\t" << elapsed_us(start) * 1000.0 / num_searches << std::endl;
+            EXPECT_EQ(expected, result);
+        }
+    }
+}
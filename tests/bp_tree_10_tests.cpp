@@ -1,7 +1,9 @@
 #include <gtest\gtest.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "bp_tree.h"
+#include "serialization.h"
 #include "test_helpers.h"
 
 using namespace niffler;
@@ -566,4 +568,221 @@ TEST(BP_TREE_10, ADD_REMOVE_1000)
         auto result = validate_bp_tree(t);
         EXPECT_EQ(true, result.valid) << result.message << std::endl << "removed key: " << i;
     }
-}
\ No newline at end of file
+}
+TEST(BP_TREE_10, VACUUM)
+{
+    auto p = create_pager("files/test_10.ndb");
+    auto t = bp_tree<10>::create(p.get()).value;
+    const auto num_keys = 1000;
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        const auto data = std::to_string(i);
+        EXPECT_EQ(true, t->insert(i, data.c_str(), static_cast<u32>(data.size())));
+    }
+
+    // Leaves, nodes and data pages that are left are spread over the whole file
+    for (auto i = 0; i < num_keys; i++)
+    {
+        if (i % 4 != 0)
+            EXPECT_EQ(true, t->remove(i)) << "removed key: " << i;
+    }
+
+    const auto num_used_pages = p->header().num_pages - p->header().num_free_pages;
+    auto num_steps = 0;
+
+    while (p->header().num_free_pages > 0 && num_steps < num_keys)
+    {
+        t->vacuum(32);
+        p->truncate();
+        num_steps++;
+
+        auto result = validate_bp_tree(t);
+        ASSERT_EQ(true, result.valid) << result.message << std::endl << "step: " << num_steps;
+    }
+
+    EXPECT_GT(num_steps, 1);
+    EXPECT_EQ(p->header().num_pages, num_used_pages);
+    EXPECT_EQ(p->header().num_free_pages, 0);
+
+    // A step reads only as many nodes and leaves as it may move pages, not the whole tree
+    const auto stats = p->stats();
+    EXPECT_EQ(0, t->vacuum(2));
+    EXPECT_LE(p->stats().hits + p->stats().misses, stats.hits + stats.misses + 2);
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        const auto result = t->find(i);
+        ASSERT_EQ(i % 4 == 0, result->found) << "key: " << i;
+
+        if (result->found)
+        {
+            const auto data = std::to_string(i);
+            ASSERT_EQ(result->size, data.size());
+            EXPECT_EQ(memcmp(result->data, data.c_str(), data.size()), 0) << "key: " << i;
+        }
+    }
+
+    // The compacted tree keeps working
+    for (auto i = 0; i < num_keys; i++)
+    {
+        if (i % 4 != 0)
+            EXPECT_EQ(true, t->insert(i, "", 0)) << "key: " << i;
+    }
+
+    auto result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+}
+
+static
+void write_legacy_key(key &key)
+{
+    const auto chars = key.to_string();
+    memset(key.data, 0, KEY_SIZE);
+    memcpy(key.data, chars.c_str(), chars.size());
+}
+
+TEST(BP_TREE_10, ENCODE_LEGACY_KEYS)
+{
+    const auto num_keys = 500;
+
+    {
+        auto p = create_pager("files/test_10.ndb");
+        auto t = bp_tree<10>::create(p.get()).value;
+
+        for (auto i = 0; i < num_keys; i++)
+        {
+            EXPECT_EQ(true, t->insert(i * 3, "", 0));
+        }
+
+        // Turn the file into one written before keys were encoded, the same walk as encode_legacy_keys
+        auto level_page = t->header_.root_page;
+        for (auto level = 0u; level < t->header_.height; level++)
+        {
+            page_index next_level_page = 0;
+            for (auto node_page = level_page; node_page != 0;)
+            {
+                bp_tree_node<10> node;
+                t->load(node, node_page);
+                for (auto i = 0u; i < node.num_children; i++)
+                {
+                    write_legacy_key(node.children[i].key);
+                }
+
+                t->save(node, node_page);
+                next_level_page = next_level_page == 0 ? node.children[0].page : next_level_page;
+                node_page = node.next_page;
+            }
+
+            level_page = next_level_page;
+        }
+
+        for (auto leaf_page = t->header_.leaf_page; leaf_page != 0;)
+        {
+            bp_tree_leaf<10> leaf;
+            t->load(leaf, leaf_page);
+            for (auto i = 0u; i < leaf.num_children; i++)
+            {
+                write_legacy_key(leaf.children[i].key);
+            }
+
+            t->save(leaf, leaf_page);
+            leaf_page = leaf.next_page;
+        }
+
+        // The header of an old file ends at leaf_page, the key format is read from whatever follows it
+        t->header_.key_format = static_cast<key_format>(0x5a5a5a5a);
+        t->save(t->header_, 1);
+        EXPECT_TRUE(p->sync());
+
+        file_header old_header = p->header();
+        snprintf(old_header.version, sizeof(old_header.version), "%s", U16_PAGE_SIZE_FILE_VERSION);
+        auto header_page = p->get_page(0);
+        serialize_file_header(header_page->content, old_header);
+        p->mark_dirty(*header_page);
+        header_page.release();
+        EXPECT_TRUE(p->sync());
+    }
+
+    auto p = create_pager("files/test_10.ndb", false);
+    auto t = bp_tree<10>::load(p.get()).value;
+    ASSERT_TRUE(t != nullptr);
+    EXPECT_EQ(key_format::ordered_string, t->header().key_format);
+
+    auto result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+
+    for (auto i = 0; i < num_keys * 3; i++)
+    {
+        EXPECT_EQ(i % 3 == 0, t->exists(i)) << "key: " << i;
+    }
+
+    EXPECT_EQ(true, t->insert(1, "", 0));
+    EXPECT_EQ(true, t->remove(0));
+}
+
+TEST(BP_TREE_10, INTEGER_KEYS)
+{
+    auto p = create_pager("files/test_10.ndb");
+    auto t = bp_tree<10>::create(p.get(), key_format::integer).value;
+    const auto num_keys = 1000;
+
+    srand(5);
+    std::vector<i64> values;
+    for (auto i = 0; i < num_keys; i++)
+    {
+        values.push_back((i - num_keys / 2) * 1000003LL);
+    }
+
+    for (auto i = num_keys - 1; i > 0; i--)
+    {
+        std::swap(values[i], values[rand() % (i + 1)]);
+    }
+
+    for (auto value : values)
+    {
+        EXPECT_EQ(true, t->insert(key::integer(value), "", 0)) << "key: " << value;
+    }
+
+    auto result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+
+    // String keys are not part of an integer tree
+    EXPECT_EQ(false, t->insert(1, "", 0));
+    EXPECT_EQ(latched_result::failed, t->try_insert(1, "", 0));
+    EXPECT_EQ(false, t->exists(1));
+
+    // The leaves hold the keys in numeric order
+    i64 previous = INT64_MIN;
+    auto num_found = 0;
+    for (auto leaf_page = t->header().leaf_page; leaf_page != 0;)
+    {
+        bp_tree_leaf<10> leaf;
+        t->load(leaf, leaf_page);
+        for (auto i = 0u; i < leaf.num_children; i++)
+        {
+            EXPECT_TRUE(leaf.children[i].key.is_integer());
+            EXPECT_LT(previous, leaf.children[i].key.to_integer());
+            previous = leaf.children[i].key.to_integer();
+            num_found++;
+        }
+
+        leaf_page = leaf.next_page;
+    }
+
+    EXPECT_EQ(num_keys, num_found);
+
+    for (auto value : values)
+    {
+        EXPECT_EQ(true, t->exists(key::integer(value))) << "key: " << value;
+        EXPECT_EQ(false, t->exists(key::integer(value + 1))) << "key: " << value + 1;
+    }
+
+    for (auto value : values)
+    {
+        EXPECT_EQ(true, t->remove(key::integer(value))) << "key: " << value;
+    }
+
+    result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+}
@@ -1,5 +1,6 @@
 #include <gtest\gtest.h>
 #include <stdlib.h>
+#include <cstring>
 
 #include "bp_tree.h"
 #include "test_helpers.h"
@@ -54,6 +55,8 @@ TEST(BP_TREE_DEFAULT, LOAD_1000)
             auto result = validate_bp_tree(t);
             EXPECT_EQ(true, result.valid) << result.message << std::endl << "key: " << i;
         }
+
+        EXPECT_TRUE(p->sync());
     }
     
     auto loaded_p = create_pager("files/test_default.ndb", false);
@@ -79,6 +82,8 @@ TEST(BP_TREE_DEFAULT, LOAD_5000)
             auto result = validate_bp_tree(t);
             EXPECT_EQ(true, result.valid) << result.message << std::endl << "key: " << i;
         }
+
+        EXPECT_TRUE(p->sync());
     }
 
     auto loaded_p = create_pager("files/test_default.ndb", false);
@@ -139,4 +144,150 @@ TEST(BP_TREE_DEFAULT, BASIC_FIND)
     EXPECT_EQ(false, r77->found) << "found" << std::endl << "key: " << key;
     EXPECT_EQ(0, r77->size) << "wrong size" << std::endl << "key: " << key;
     EXPECT_TRUE(r77->data == nullptr);
-}
\ No newline at end of file
+}
+TEST(BP_TREE_DEFAULT, MULTI_FIND_2000)
+{
+    const auto num_keys = 2000;
+    options opts;
+    opts.pager_size = 32;
+
+    auto p = create_pager("files/test_default.ndb", true, opts);
+    auto t = bp_tree<DEFAULT_TREE_ORDER>::create(p.get()).value;
+
+    for (auto i = 0; i < num_keys; i += 2)
+    {
+        EXPECT_EQ(true, t->insert(i, test_value, test_value_size));
+    }
+
+    // Unsorted, with duplicates and keys that don't exist
+    std::vector<key> keys;
+    for (auto i = num_keys - 1; i >= 0; i--)
+    {
+        keys.push_back(i);
+        if (i % 100 == 0)
+            keys.push_back(i);
+    }
+
+    auto results = t->find(keys.data(), static_cast<u32>(keys.size()));
+    ASSERT_EQ(keys.size(), results.size());
+
+    for (auto i = 0u; i < keys.size(); i++)
+    {
+        const auto k = atoi(keys[i].to_string().c_str());
+        const auto expect_found = k % 2 == 0;
+
+        EXPECT_EQ(expect_found, results[i]->found) << "key: " << k;
+        if (expect_found)
+        {
+            EXPECT_EQ(test_value_size, results[i]->size) << "key: " << k;
+            EXPECT_TRUE(0 == std::memcmp(test_value, results[i]->data, test_value_size)) << "key: " << k;
+        }
+    }
+}
+
+TEST(BP_TREE_DEFAULT, SMALL_PAGER_2000)
+{
+    const auto num_keys = 2000;
+    options opts;
+    opts.pager_size = 16;
+
+    auto p = create_pager("files/test_default.ndb", true, opts);
+    auto t = bp_tree<DEFAULT_TREE_ORDER>::create(p.get()).value;
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        EXPECT_EQ(true, t->insert(i, test_value, test_value_size));
+    }
+
+    auto result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+    EXPECT_GT(p->stats().evictions, 0);
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        auto r = t->find(i);
+        EXPECT_EQ(true, r->found) << "key: " << i;
+        EXPECT_EQ(test_value_size, r->size) << "key: " << i;
+        EXPECT_TRUE(0 == std::memcmp(test_value, r->data, test_value_size)) << "key: " << i;
+    }
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        EXPECT_EQ(true, t->remove(i)) << "removed key: " << i;
+    }
+
+    result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+}
+
+TEST(BP_TREE_DEFAULT, MMAP_LOAD_1000)
+{
+    const auto num_keys = 1000;
+    options opts;
+    opts.io_mode = io_mode::mmap;
+
+    {
+        auto p = create_pager("files/test_default_mmap.ndb", true, opts);
+        auto t = bp_tree<DEFAULT_TREE_ORDER>::create(p.get()).value;
+
+        for (auto i = 0; i < num_keys; i++)
+        {
+            EXPECT_EQ(true, t->insert(i, test_value, test_value_size));
+        }
+
+        auto result = validate_bp_tree(t);
+        EXPECT_EQ(true, result.valid) << result.message;
+        EXPECT_TRUE(p->sync());
+    }
+
+    auto loaded_p = create_pager("files/test_default_mmap.ndb", false, opts);
+    auto loaded_t = bp_tree<DEFAULT_TREE_ORDER>::load(loaded_p.get()).value;
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        auto r = loaded_t->find(i);
+        EXPECT_EQ(true, r->found) << "key: " << i;
+        EXPECT_TRUE(0 == std::memcmp(test_value, r->data, test_value_size)) << "key: " << i;
+    }
+}
+
+TEST(BP_TREE_DEFAULT, ADD_REMOVE_16K_PAGES)
+{
+    constexpr auto order = tree_order(16 * 1024);
+    const auto num_keys = 1500;
+    options opts;
+    opts.page_size = 16 * 1024;
+
+    auto p = create_pager("files/test_default_16k.ndb", true, opts);
+    auto t = bp_tree<order>::create(p.get()).value;
+    ASSERT_TRUE(t);
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        EXPECT_EQ(true, t->insert(i, test_value, test_value_size));
+    }
+
+    auto result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+    EXPECT_LT(1u, t->header().num_leaf_nodes);
+
+    for (auto i = 0; i < num_keys; i += 2)
+    {
+        EXPECT_EQ(true, t->remove(i)) << "removed key: " << i;
+    }
+
+    result = validate_bp_tree(t);
+    EXPECT_EQ(true, result.valid) << result.message;
+
+    EXPECT_TRUE(p->sync());
+
+    // A tree can't be loaded with an order that doesn't match the file
+    auto loaded_p = create_pager("files/test_default_16k.ndb", false, opts);
+    EXPECT_FALSE(bp_tree<DEFAULT_TREE_ORDER>::load(loaded_p.get()).ok);
+
+    auto loaded_t = bp_tree<order>::load(loaded_p.get()).value;
+    for (auto i = 0; i < num_keys; i++)
+    {
+        EXPECT_EQ(i % 2 == 1, loaded_t->exists(i)) << "key: " << i;
+    }
+}
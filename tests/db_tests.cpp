@@ -1,8 +1,13 @@
 #include <gtest\gtest.h>
+#include <chrono>
 #include <stdlib.h>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "include/db.h"
+#include "include/exceptions.h"
+#include "files.h"
 
 using namespace niffler;
 
@@ -99,3 +104,230 @@ TEST(DB, MULTI_THREADED_FIND_REMOVE_INSERT)
     thread3.join();
     thread4.join();
 }
+
+TEST(DB, MULTI_THREADED_INSERT_FIND)
+{
+    auto niffler = std::make_unique<db>("files/db_threaded.ndb", true);
+    constexpr auto num_threads = 4;
+    constexpr auto keys_per_thread = 500;
+
+    // Every thread owns a range of keys, inserts run concurrently as long as they don't split a leaf
+    auto insert_find = [&niffler](int thread) {
+        const auto first_key = thread * keys_per_thread;
+
+        for (auto i = first_key; i < first_key + keys_per_thread; i++)
+        {
+            EXPECT_TRUE(niffler->insert(i, db_test_value, db_test_value_size));
+            EXPECT_TRUE(niffler->exists(i));
+        }
+
+        for (auto i = first_key; i < first_key + keys_per_thread; i += 2)
+        {
+            EXPECT_TRUE(niffler->remove(i));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < num_threads; i++)
+    {
+        threads.emplace_back(insert_find, i);
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (auto i = 0; i < num_threads * keys_per_thread; i++)
+    {
+        auto find_result = niffler->find(i);
+        EXPECT_EQ(i % 2 == 1, find_result->found) << "key: " << i;
+    }
+}
+
+TEST(DB, PAGE_SIZES)
+{
+    const auto num_keys = 1000;
+
+    for (const auto page_size : { 8u * 1024, 16u * 1024, 64u * 1024 })
+    {
+        options opts;
+        opts.page_size = page_size;
+
+        {
+            auto niffler = std::make_unique<db>("files/db_page_size.ndb", true, opts);
+
+            for (auto i = 0; i < num_keys; i++)
+            {
+                EXPECT_TRUE(niffler->insert(i, db_test_value, db_test_value_size));
+            }
+
+            for (auto i = 0; i < num_keys; i += 2)
+            {
+                EXPECT_TRUE(niffler->remove(i));
+            }
+        }
+
+        // Loaded with the default options, the page size comes from the file
+        auto niffler = std::make_unique<db>("files/db_page_size.ndb", false);
+
+        for (auto i = 0; i < num_keys; i++)
+        {
+            auto find_result = niffler->find(i);
+            EXPECT_EQ(i % 2 == 1, find_result->found) << "page size: " << page_size << " key: " << i;
+        }
+    }
+}
+
+TEST(DB, INTEGER_KEYS)
+{
+    const auto num_keys = 1000;
+
+    {
+        options opts;
+        opts.integer_keys = true;
+        auto niffler = std::make_unique<db>("files/db_integer_keys.ndb", true, opts);
+
+        for (auto i = -num_keys; i < num_keys; i++)
+        {
+            EXPECT_TRUE(niffler->insert(key::integer(i), db_test_value, db_test_value_size));
+        }
+
+        EXPECT_FALSE(niffler->insert("string_key", db_test_value, db_test_value_size));
+    }
+
+    // The key kind comes from the file
+    auto niffler = std::make_unique<db>("files/db_integer_keys.ndb", false);
+
+    for (auto i = -num_keys; i < num_keys; i++)
+    {
+        EXPECT_TRUE(niffler->find(key::integer(i))->found) << "key: " << i;
+    }
+
+    EXPECT_FALSE(niffler->insert(1, db_test_value, db_test_value_size));
+    EXPECT_FALSE(niffler->exists(1));
+}
+
+TEST(DB, OVERSIZED_KEYS)
+{
+    auto niffler = std::make_unique<db>("files/db_oversized_keys.ndb", true);
+
+    EXPECT_TRUE(niffler->insert("0123456789abcde", db_test_value, db_test_value_size));
+    EXPECT_FALSE(niffler->insert("0123456789abcdef", db_test_value, db_test_value_size));
+    EXPECT_FALSE(niffler->insert("0123456789abcdefgh", db_test_value, db_test_value_size));
+
+    // Not found under the key it would have been cut to
+    EXPECT_FALSE(niffler->find("0123456789abcdef")->found);
+    EXPECT_FALSE(niffler->exists("0123456789abcdefgh"));
+    EXPECT_FALSE(niffler->remove("0123456789abcdef"));
+    EXPECT_TRUE(niffler->exists("0123456789abcde"));
+}
+
+TEST(DB, INVALID_PAGE_SIZE)
+{
+    options opts;
+    opts.page_size = 1000;
+
+    EXPECT_THROW(db("files/db_invalid_page_size.ndb", true, opts), niffler_exception);
+}
+
+static
+size_t wal_file_size(const char *db_file_path)
+{
+    file_handle handle((std::string(db_file_path) + "-wal").c_str(), file_mode::read);
+    return file_size(handle);
+}
+
+TEST(DB, DURABILITY)
+{
+    const auto num_keys = 500;
+    const auto file_path = "files/db_durability.ndb";
+
+    for (const auto level : { durability::full, durability::periodic, durability::none })
+    {
+        options opts;
+        opts.durability = level;
+        opts.sync_interval_ms = 10;
+
+        {
+            auto niffler = std::make_unique<db>(file_path, true, opts);
+            const auto empty_log_size = wal_file_size(file_path);
+
+            EXPECT_TRUE(niffler->insert(0, db_test_value, db_test_value_size));
+
+            // full and none write the log before insert returns, periodic leaves it to the background thread
+            auto log_size = wal_file_size(file_path);
+            for (auto i = 0; level == durability::periodic && log_size == empty_log_size && i < 200; i++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                log_size = wal_file_size(file_path);
+            }
+
+            EXPECT_GT(log_size, empty_log_size) << "level: " << static_cast<int>(level);
+
+            for (auto i = 1; i < num_keys; i++)
+            {
+                EXPECT_TRUE(niffler->insert(i, db_test_value, db_test_value_size));
+            }
+
+            for (auto i = 0; i < num_keys; i += 2)
+            {
+                EXPECT_TRUE(niffler->remove(i));
+            }
+        }
+
+        auto niffler = std::make_unique<db>(file_path, false);
+
+        for (auto i = 0; i < num_keys; i++)
+        {
+            auto find_result = niffler->find(i);
+            EXPECT_EQ(i % 2 == 1, find_result->found) << "level: " << static_cast<int>(level) << " key: " << i;
+        }
+    }
+}
+
+TEST(DB, VACUUM)
+{
+    const auto num_keys = 2000;
+    const auto file_path = "files/db_vacuum.ndb";
+    const std::string value(1000, 'v');
+
+    {
+        auto niffler = std::make_unique<db>(file_path, true);
+
+        for (auto i = 0; i < num_keys; i++)
+        {
+            EXPECT_TRUE(niffler->insert(i, value.c_str(), static_cast<u32>(value.size())));
+        }
+
+        for (auto i = 0; i < num_keys; i++)
+        {
+            if (i % 10 != 0)
+            {
+                EXPECT_TRUE(niffler->remove(i));
+            }
+        }
+
+        file_handle db_file(file_path, file_mode::read);
+        const auto peak_size = file_size(db_file);
+
+        auto num_steps = 0;
+        u32 num_free_pages = 0;
+        do
+        {
+            num_free_pages = niffler->vacuum(50);
+            num_steps++;
+        } while (num_free_pages > 0 && num_steps < num_keys);
+
+        EXPECT_GT(num_steps, 1);
+        EXPECT_LT(file_size(db_file), peak_size / 4);
+    }
+
+    auto niffler = std::make_unique<db>(file_path, false);
+
+    for (auto i = 0; i < num_keys; i++)
+    {
+        auto find_result = niffler->find(i);
+        EXPECT_EQ(i % 10 == 0, find_result->found) << "key: " << i;
+    }
+}
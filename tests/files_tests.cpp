@@ -0,0 +1,135 @@
+#include <gtest\gtest.h>
+#include <algorithm>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "files.h"
+
+using namespace niffler;
+
+TEST(FILES, READ_WRITE_AT)
+{
+    file_handle handle("files/test_files.ndb", file_mode::write_update);
+    ASSERT_TRUE(handle.ok());
+
+    const char first[] = "first";
+    const char second[] = "second";
+
+    EXPECT_EQ(sizeof(second), write_at(handle, second, sizeof(second), 4096));
+    EXPECT_EQ(sizeof(first), write_at(handle, first, sizeof(first), 0));
+    EXPECT_EQ(4096 + sizeof(second), file_size(handle));
+
+    char buffer[16] = { 0 };
+    EXPECT_EQ(sizeof(second), read_at(handle, buffer, sizeof(second), 4096));
+    EXPECT_STREQ(second, buffer);
+
+    EXPECT_EQ(sizeof(first), read_at(handle, buffer, sizeof(first), 0));
+    EXPECT_STREQ(first, buffer);
+
+    // Reads past the end of the file are short
+    EXPECT_EQ(0, read_at(handle, buffer, sizeof(buffer), 8192));
+
+    EXPECT_EQ(0, fsync(handle));
+    EXPECT_EQ(0, ftruncate(handle, 100));
+    EXPECT_EQ(100, file_size(handle));
+}
+
+TEST(FILES, CONCURRENT_READ_AT)
+{
+    constexpr auto block_size = 512u;
+    constexpr auto num_blocks = 256u;
+    file_handle handle("files/test_files.ndb", file_mode::write_update);
+    ASSERT_TRUE(handle.ok());
+
+    std::vector<unsigned char> block(block_size);
+    for (auto i = 0u; i < num_blocks; i++)
+    {
+        memset(block.data(), static_cast<int>(i), block_size);
+        write_at(handle, block.data(), block_size, static_cast<uint64_t>(i) * block_size);
+    }
+
+    // There is no shared file position so readers can't move each other to the wrong offset
+    auto reader = [&handle, &block_size, &num_blocks](unsigned start) {
+        std::vector<unsigned char> buffer(block_size);
+        for (auto n = 0u; n < num_blocks * 4; n++)
+        {
+            const auto i = (start + n * 7) % num_blocks;
+            EXPECT_EQ(block_size, read_at(handle, buffer.data(), block_size, static_cast<uint64_t>(i) * block_size));
+            EXPECT_EQ(static_cast<unsigned char>(i), buffer[0]);
+            EXPECT_EQ(static_cast<unsigned char>(i), buffer[block_size - 1]);
+        }
+    };
+
+    std::thread thread1(reader, 0);
+    std::thread thread2(reader, 1);
+    std::thread thread3(reader, 2);
+    std::thread thread4(reader, 3);
+
+    thread1.join();
+    thread2.join();
+    thread3.join();
+    thread4.join();
+}
+
+TEST(FILES, VECTORED_READ_WRITE_AT)
+{
+    constexpr auto block_size = 4096u;
+    constexpr auto num_blocks = 8u;
+
+    file_handle handle("files/test_files.ndb", file_mode::write_update);
+    ASSERT_TRUE(handle.ok());
+
+    // Blocks are scattered in memory but written to one range of the file
+    std::vector<std::vector<unsigned char>> blocks;
+    std::vector<io_buffer> buffers;
+    for (auto i = 0u; i < num_blocks; i++)
+    {
+        blocks.emplace_back(block_size, static_cast<unsigned char>(i + 1));
+        buffers.push_back({ blocks.back().data(), block_size });
+    }
+
+    EXPECT_EQ(num_blocks * block_size, write_vectored_at(handle, buffers.data(), buffers.size(), block_size));
+    EXPECT_EQ((num_blocks + 1) * block_size, file_size(handle));
+
+    for (auto& block : blocks)
+    {
+        std::fill(block.begin(), block.end(), 0);
+    }
+
+    EXPECT_EQ(num_blocks * block_size, read_vectored_at(handle, buffers.data(), buffers.size(), block_size));
+    for (auto i = 0u; i < num_blocks; i++)
+    {
+        EXPECT_EQ(static_cast<unsigned char>(i + 1), blocks[i][0]) << "block: " << i;
+        EXPECT_EQ(static_cast<unsigned char>(i + 1), blocks[i][block_size - 1]) << "block: " << i;
+    }
+
+    // Reads past the end of the file are short
+    EXPECT_EQ(block_size, read_vectored_at(handle, buffers.data(), buffers.size(), num_blocks * block_size));
+}
+
+TEST(FILES, PUNCH_HOLE)
+{
+    constexpr auto block_size = 4096u;
+    constexpr auto num_blocks = 4u;
+
+    file_handle handle("files/test_files.ndb", file_mode::write_update);
+    ASSERT_TRUE(handle.ok());
+
+    std::vector<unsigned char> data(num_blocks * block_size, 0xff);
+    EXPECT_EQ(data.size(), write_at(handle, data.data(), data.size(), 0));
+
+    // Not every file system can punch holes
+    if (punch_hole(handle, block_size, 2 * block_size) != 0)
+        return;
+
+    EXPECT_EQ(data.size(), file_size(handle));
+    EXPECT_EQ(data.size(), read_at(handle, data.data(), data.size(), 0));
+
+    for (auto i = 0u; i < num_blocks; i++)
+    {
+        const unsigned char expected = i == 1 || i == 2 ? 0 : 0xff;
+        EXPECT_EQ(expected, data[i * block_size]) << "block: " << i;
+        EXPECT_EQ(expected, data[(i + 1) * block_size - 1]) << "block: " << i;
+    }
+}
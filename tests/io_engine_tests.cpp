@@ -0,0 +1,141 @@
+#include <gtest\gtest.h>
+#include <string.h>
+#include <vector>
+
+#include "io_engine.h"
+
+using namespace niffler;
+
+static
+void batch_write_read(u32 queue_depth)
+{
+    constexpr auto block_size = 4096u;
+    constexpr auto num_blocks = 100u;
+
+    file_handle handle("files/test_io_engine.ndb", file_mode::write_update);
+    ASSERT_TRUE(handle.ok());
+
+    io_engine engine(handle, queue_depth);
+
+    std::vector<u8> blocks(block_size * num_blocks);
+    std::vector<io_request> requests(num_blocks);
+
+    for (auto i = 0u; i < num_blocks; i++)
+    {
+        memset(&blocks[i * block_size], static_cast<int>(i + 1), block_size);
+
+        // Written in reverse order so the file has to grow from the last block
+        auto& request = requests[num_blocks - i - 1];
+        request.buffer = &blocks[i * block_size];
+        request.size = block_size;
+        request.offset = static_cast<u64>(i) * block_size;
+        request.write = true;
+    }
+
+    EXPECT_TRUE(engine.submit(requests.data(), num_blocks));
+    for (auto &request : requests)
+    {
+        EXPECT_EQ(block_size, request.result);
+    }
+
+    std::fill(blocks.begin(), blocks.end(), 0);
+
+    for (auto i = 0u; i < num_blocks; i++)
+    {
+        requests[i].write = false;
+        requests[i].result = 0;
+    }
+
+    EXPECT_TRUE(engine.submit(requests.data(), num_blocks));
+
+    for (auto i = 0u; i < num_blocks; i++)
+    {
+        EXPECT_EQ(static_cast<u8>(i + 1), blocks[i * block_size]) << "block: " << i;
+        EXPECT_EQ(static_cast<u8>(i + 1), blocks[(i + 1) * block_size - 1]) << "block: " << i;
+    }
+
+    // Reads past the end of the file are short
+    u8 buffer[16];
+    io_request past_end;
+    past_end.buffer = buffer;
+    past_end.size = sizeof(buffer);
+    past_end.offset = static_cast<u64>(num_blocks) * block_size;
+
+    EXPECT_FALSE(engine.submit(&past_end, 1));
+    EXPECT_EQ(0, past_end.result);
+}
+
+static
+void vectored_write_read(u32 queue_depth)
+{
+    constexpr auto block_size = 4096u;
+    constexpr auto num_runs = 4u;
+    constexpr auto blocks_per_run = 16u;
+
+    file_handle handle("files/test_io_engine.ndb", file_mode::write_update);
+    ASSERT_TRUE(handle.ok());
+
+    io_engine engine(handle, queue_depth);
+
+    std::vector<u8> blocks(block_size * num_runs * blocks_per_run);
+    std::vector<io_buffer> buffers(num_runs * blocks_per_run);
+    std::vector<io_request> requests(num_runs);
+
+    // Every run writes its blocks in reverse memory order to one contiguous range of the file
+    for (auto run = 0u; run < num_runs; run++)
+    {
+        for (auto i = 0u; i < blocks_per_run; i++)
+        {
+            const auto block = run * blocks_per_run + i;
+            auto data = &blocks[(run * blocks_per_run + blocks_per_run - i - 1) * block_size];
+            memset(data, static_cast<int>(block + 1), block_size);
+            buffers[block] = { data, block_size };
+        }
+
+        auto& request = requests[run];
+        request.buffers = &buffers[run * blocks_per_run];
+        request.num_buffers = blocks_per_run;
+        request.size = block_size * blocks_per_run;
+        request.offset = static_cast<u64>(run) * block_size * blocks_per_run;
+        request.write = true;
+    }
+
+    EXPECT_TRUE(engine.submit(requests.data(), num_runs));
+
+    std::fill(blocks.begin(), blocks.end(), 0);
+
+    for (auto& request : requests)
+    {
+        request.write = false;
+        request.result = 0;
+    }
+
+    EXPECT_TRUE(engine.submit(requests.data(), num_runs));
+
+    for (auto i = 0u; i < buffers.size(); i++)
+    {
+        auto data = static_cast<const u8*>(buffers[i].data);
+        EXPECT_EQ(static_cast<u8>(i + 1), data[0]) << "block: " << i;
+        EXPECT_EQ(static_cast<u8>(i + 1), data[block_size - 1]) << "block: " << i;
+    }
+}
+
+TEST(IO_ENGINE, BATCH_WRITE_READ_SYNC)
+{
+    batch_write_read(0);
+}
+
+TEST(IO_ENGINE, BATCH_WRITE_READ_QUEUE_DEPTH_8)
+{
+    batch_write_read(8);
+}
+
+TEST(IO_ENGINE, VECTORED_WRITE_READ_SYNC)
+{
+    vectored_write_read(0);
+}
+
+TEST(IO_ENGINE, VECTORED_WRITE_READ_QUEUE_DEPTH_8)
+{
+    vectored_write_read(8);
+}
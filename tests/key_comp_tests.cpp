@@ -2,6 +2,7 @@
 #include <vector>
 
 #include "bp_tree.h"
+#include "key_search.h"
 
 using namespace niffler;
 
@@ -76,4 +77,133 @@ TEST(KEY_COMP, KEY_COMP)
     EXPECT_FALSE(k0 > k1);
     EXPECT_TRUE(k0 <= k1);
     EXPECT_FALSE(k0 >= k1);
+}
+
+static
+key random_key(u32 max_length)
+{
+    // Few distinct bytes so keys of the same length often share a prefix, bytes above 127 check the unsigned order
+    const char bytes[] = { 'a', 'b', 'z', '\x80', '\xff' };
+
+    char chars[KEY_SIZE] = { 0 };
+    const auto length = static_cast<u32>(rand()) % (max_length + 1);
+    for (auto i = 0u; i < length; i++)
+    {
+        chars[i] = bytes[rand() % sizeof(bytes)];
+    }
+
+    return key(chars);
+}
+
+static
+int sign(int value)
+{
+    return (value > 0) - (value < 0);
+}
+
+TEST(KEY_COMP, ENCODING)
+{
+    srand(3);
+
+    // Shorter strings first, then strcmp, like keys were compared before they were encoded
+    for (auto i = 0; i < 2000; i++)
+    {
+        const auto k0 = random_key(MAX_KEY_LENGTH);
+        const auto k1 = random_key(MAX_KEY_LENGTH);
+        const auto s0 = k0.to_string();
+        const auto s1 = k1.to_string();
+
+        const auto expected = s0.size() != s1.size() ? (s0.size() < s1.size() ? -1 : 1) : sign(strcmp(s0.c_str(), s1.c_str()));
+        EXPECT_EQ(expected, sign(key_cmp(k0, k1))) << s0 << " " << s1;
+    }
+
+    key k("0123456789abcde");
+    EXPECT_TRUE(k.is_valid());
+    EXPECT_EQ(MAX_KEY_LENGTH, k.length());
+    EXPECT_EQ("0123456789abcde", k.to_string());
+
+    // Longer keys are not cut to a prefix they would share with other keys
+    key oversized("0123456789abcdefgh");
+    EXPECT_FALSE(oversized.is_valid());
+    EXPECT_NE(k, oversized);
+    EXPECT_EQ("", oversized.to_string());
+    EXPECT_EQ("-42", key(-42).to_string());
+}
+
+TEST(KEY_COMP, INTEGER_KEYS)
+{
+    const i64 values[] = { INT64_MIN, -1000, -256, -1, 0, 1, 9, 10, 255, 256, 1000, INT64_MAX };
+    const auto num_values = sizeof(values) / sizeof(values[0]);
+
+    for (auto i = 0u; i < num_values; i++)
+    {
+        const auto k = key::integer(values[i]);
+        EXPECT_TRUE(k.is_integer());
+        EXPECT_EQ(values[i], k.to_integer());
+        EXPECT_EQ(std::to_string(values[i]), k.to_string());
+
+        // Ordered like the numbers, not like their decimal strings
+        for (auto j = 0u; j < num_values; j++)
+        {
+            EXPECT_EQ(values[i] < values[j], k < key::integer(values[j])) << values[i] << " " << values[j];
+            EXPECT_EQ(values[i] == values[j], k == key::integer(values[j])) << values[i] << " " << values[j];
+        }
+    }
+
+    EXPECT_FALSE(key(5).is_integer());
+    EXPECT_NE(key(5), key::integer(5));
+}
+
+TEST(KEY_COMP, KERNELS)
+{
+    srand(7);
+
+    constexpr auto num_keys = 37;
+    std::vector<key> keys;
+    for (auto i = 0; i < num_keys; i++)
+    {
+        keys.push_back(random_key(MAX_KEY_LENGTH));
+    }
+
+    for (auto kernel : { key_kernel::scalar, key_kernel::sse2, key_kernel::avx2 })
+    {
+        if (!key_kernel_supported(kernel))
+            continue;
+
+        for (auto i = 0; i < 500; i++)
+        {
+            const auto probe = i % 2 ? random_key(4) : keys[i % num_keys];
+
+            for (auto count = 0u; count <= num_keys; count++)
+            {
+                u32 expected = 0;
+                for (auto j = 0u; j < count; j++)
+                {
+                    expected += key_cmp(keys[j], probe) <= 0;
+                }
+
+                EXPECT_EQ(expected, count_not_greater(kernel, probe, reinterpret_cast<const u8*>(keys.data()), sizeof(key), count));
+            }
+        }
+    }
+}
+
+TEST(KEY_COMP, UPPER_BOUND)
+{
+    std::vector<key> keys;
+    for (auto i = 0; i < 1000; i += 2)
+    {
+        keys.emplace_back(i);
+    }
+
+    const auto count = static_cast<u32>(keys.size());
+    const auto data = reinterpret_cast<const u8*>(keys.data());
+
+    EXPECT_EQ(0, upper_bound_key(data, sizeof(key), count, key("")));
+    EXPECT_EQ(1, upper_bound_key(data, sizeof(key), count, key(0)));
+    EXPECT_EQ(1, upper_bound_key(data, sizeof(key), count, key(1)));
+    EXPECT_EQ(250, upper_bound_key(data, sizeof(key), count, key(499)));
+    EXPECT_EQ(251, upper_bound_key(data, sizeof(key), count, key(500)));
+    EXPECT_EQ(count, upper_bound_key(data, sizeof(key), count, key(998)));
+    EXPECT_EQ(count, upper_bound_key(data, sizeof(key), count, key(5000)));
 }
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include <gtest\gtest.h>
+#include <thread>
+#include <vector>
+
+#include "latch.h"
+
+using namespace niffler;
+
+TEST(LATCH, SHARED_EXCLUSIVE)
+{
+    rw_latch latch;
+
+    EXPECT_TRUE(latch.try_lock_shared());
+    EXPECT_TRUE(latch.try_lock_shared());
+    EXPECT_FALSE(latch.try_lock());
+
+    latch.unlock_shared();
+    latch.unlock_shared();
+
+    EXPECT_TRUE(latch.try_lock());
+    EXPECT_FALSE(latch.try_lock_shared());
+    EXPECT_FALSE(latch.try_lock());
+
+    latch.unlock();
+    EXPECT_TRUE(latch.try_lock_shared());
+    latch.unlock_shared();
+}
+
+TEST(LATCH, MULTI_THREADED)
+{
+    constexpr auto num_threads = 4;
+    constexpr auto num_iterations = 20000;
+
+    rw_latch latch;
+    // Both values are only changed together under the exclusive latch, readers must never see them differ
+    u64 first = 0;
+    u64 second = 0;
+
+    auto writer = [&]() {
+        for (auto i = 0; i < num_iterations; i++)
+        {
+            latch.lock();
+            first++;
+            second++;
+            latch.unlock();
+        }
+    };
+
+    auto reader = [&]() {
+        for (auto i = 0; i < num_iterations; i++)
+        {
+            latch.lock_shared();
+            EXPECT_EQ(first, second);
+            latch.unlock_shared();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < num_threads; i++)
+    {
+        threads.emplace_back(writer);
+        threads.emplace_back(reader);
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    EXPECT_EQ(first, static_cast<u64>(num_threads) * num_iterations);
+    EXPECT_EQ(second, first);
+}
@@ -1,7 +1,12 @@
 #include <gtest\gtest.h>
+#include <chrono>
+#include <thread>
 #include <vector>
+#include <string.h>
 
+#include "include/exceptions.h"
 #include "pager.h"
+#include "serialization.h"
 
 using namespace niffler;
 
@@ -10,82 +15,1063 @@ TEST(PAGER, CREATE_PAGER)
     pager pager("files/test_pager.ndb", true);
     const auto &h = pager.header();
 
-    ASSERT_STREQ(h.version, "NifflerDB 0.1");
+    ASSERT_STREQ(h.version, "NifflerDB 0.3");
     EXPECT_EQ(h.page_size, PAGE_SIZE);
     EXPECT_EQ(h.num_pages, 1);
-    EXPECT_EQ(h.last_free_list_page, 0);
-    EXPECT_EQ(h.num_free_list_pages, 0);
+    EXPECT_EQ(h.first_bitmap_page, 0);
+    EXPECT_EQ(h.num_free_pages, 0);
 }
 
-TEST(PAGER, FREE_PAGE_LIST)
+TEST(PAGER, FREE_PAGES)
 {
-    pager pager("files/test_pager.ndb", true);
-    const auto &h = pager.header();
+    constexpr auto num_pages = 100u;
+    options opts;
+    opts.file_growth_pages = 0;
 
-    EXPECT_EQ(h.num_free_list_pages, 0);
-    EXPECT_EQ(h.num_pages, 1);
+    {
+        pager pager("files/test_pager.ndb", true, opts);
+        const auto &h = pager.header();
+
+        EXPECT_EQ(h.num_free_pages, 0);
+        EXPECT_EQ(h.num_pages, 1);
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            pager.get_free_page();
+        }
+
+        EXPECT_EQ(h.num_pages, num_pages + 1);
+
+        std::vector<page_index> freed;
+        for (page_index i = 10; i < 20; i++)
+        {
+            freed.push_back(i);
+        }
+
+        // The first free page adds a page for the bitmap
+        pager.free_pages(freed.data(), static_cast<u32>(freed.size()));
+        EXPECT_EQ(h.num_free_pages, 10);
+        EXPECT_EQ(h.num_pages, num_pages + 2);
+        EXPECT_EQ(h.first_bitmap_page, num_pages + 1);
+
+        // Free pages are handed out closest after the hint, then from the start of the file
+        EXPECT_EQ(pager.get_free_page(latch_mode::none, 15)->index, 15);
+        EXPECT_EQ(pager.get_free_page(latch_mode::none, 15)->index, 16);
+        EXPECT_EQ(pager.get_free_page()->index, 10);
+
+        page_index batch[7];
+        pager.get_free_pages(batch, 7);
+        const page_index expected[7] = { 11, 12, 13, 14, 17, 18, 19 };
+        for (auto i = 0u; i < 7; i++)
+        {
+            EXPECT_EQ(batch[i], expected[i]);
+        }
+
+        // No free pages left, the file grows
+        EXPECT_EQ(h.num_free_pages, 0);
+        EXPECT_EQ(pager.get_free_page()->index, num_pages + 2);
+
+        pager.free_page(5);
+        EXPECT_EQ(pager.get_free_page(latch_mode::none, 50)->index, 5);
+
+        auto p = pager.get_page(30);
+        memset(p->content, 0xff, p->size);
+        pager.mark_dirty(*p);
+        p.release();
+
+        pager.free_page(30);
+        EXPECT_TRUE(pager.sync());
+    }
+
+    pager pager("files/test_pager.ndb", false, opts);
+    EXPECT_EQ(pager.header().num_free_pages, 1);
+    EXPECT_EQ(pager.header().num_pages, num_pages + 3);
+
+    // Reused pages are zeroed
+    auto p = pager.get_free_page();
+    EXPECT_EQ(p->index, 30);
+    EXPECT_EQ(p->content[0], 0);
+    EXPECT_EQ(p->content[p->size - 1], 0);
+}
+
+TEST(PAGER, CONVERT_FREE_LIST)
+{
+    constexpr auto num_pages = 10u;
+    options opts;
+    opts.wal = false;
+    opts.file_growth_pages = 0;
+
+    {
+        pager pager("files/test_pager.ndb", true, opts);
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            pager.get_free_page();
+        }
+
+        EXPECT_TRUE(pager.sync());
+
+        // Header and free list of a file written before the bitmap, pages 3, 5 and 7 are on the list on page 10
+        file_header old_header = pager.header();
+        snprintf(old_header.version, sizeof(old_header.version), "%s", "NifflerDB 0.1");
+        old_header.first_bitmap_page = num_pages;
+        old_header.num_free_pages = 1;
+        // Whatever was in the page after the header of an old file
+        old_header.num_preallocated_pages = 7;
+
+        auto header_page = pager.get_page(0);
+        serialize_file_header(header_page->content, old_header);
+        pager.mark_dirty(*header_page);
+        header_page.release();
+
+        auto list_page = pager.get_page(num_pages);
+        free_list_header list_header = {};
+        list_header.num_pages = 3;
+        serialize_free_list_header(list_page->content, list_header);
+        write_free_list_page_index(list_page->content, 0, 3);
+        write_free_list_page_index(list_page->content, 1, 5);
+        write_free_list_page_index(list_page->content, 2, 7);
+        pager.mark_dirty(*list_page);
+        list_page.release();
+
+        EXPECT_TRUE(pager.sync());
+    }
+
+    {
+        // The list and the pages on it are free, the bitmap goes at the end of the file
+        pager pager("files/test_pager.ndb", false, opts);
+        EXPECT_STREQ(pager.header().version, "NifflerDB 0.3");
+        EXPECT_EQ(pager.header().num_free_pages, 4);
+        EXPECT_EQ(pager.header().first_bitmap_page, num_pages + 1);
+        EXPECT_EQ(pager.header().num_preallocated_pages, 0);
+        EXPECT_TRUE(pager.sync());
+    }
+
+    pager pager("files/test_pager.ndb", false, opts);
+    EXPECT_EQ(pager.header().num_free_pages, 4);
+
+    for (const auto expected : { 3u, 5u, 7u, num_pages })
+    {
+        EXPECT_EQ(pager.get_free_page()->index, expected);
+    }
+}
+
+TEST(PAGER, CONVERT_U16_PAGE_SIZE)
+{
+    options opts;
+    opts.wal = false;
+    opts.page_size = 8192;
+
+    {
+        pager pager("files/test_pager.ndb", true, opts);
+        pager.get_free_page();
+
+        // Header of a file that stores the page size as a u16
+        file_header old_header = pager.header();
+        snprintf(old_header.version, sizeof(old_header.version), "%s", "NifflerDB 0.2");
+
+        auto header_page = pager.get_page(0);
+        serialize_file_header(header_page->content, old_header);
+        pager.mark_dirty(*header_page);
+        header_page.release();
+
+        EXPECT_TRUE(pager.sync());
+    }
+
+    {
+        pager pager("files/test_pager.ndb", false, opts);
+        EXPECT_STREQ(pager.header().version, "NifflerDB 0.3");
+        EXPECT_EQ(pager.header().page_size, 8192);
+        EXPECT_EQ(pager.header().num_pages, 2);
+        EXPECT_TRUE(pager.sync());
+    }
+
+    pager pager("files/test_pager.ndb", false, opts);
+    EXPECT_STREQ(pager.header().version, "NifflerDB 0.3");
+    EXPECT_EQ(pager.header().page_size, 8192);
+}
+
+TEST(PAGER, EVICTION)
+{
+    options opts;
+    opts.pager_size = 4;
+    pager pager("files/test_pager.ndb", true, opts);
+
+    constexpr auto num_pages = 32u;
+    std::vector<page_index> page_indices;
+
+    for (auto i = 0u; i < num_pages; i++)
+    {
+        auto p = pager.get_free_page();
+        memset(p->content, static_cast<int>(i + 1), p->size);
+        pager.mark_dirty(*p);
+        page_indices.push_back(static_cast<page_index>(p->index));
+    }
+
+    EXPECT_EQ(pager.capacity(), 4);
+    EXPECT_GT(pager.stats().evictions, 0);
+    EXPECT_GT(pager.stats().writebacks, 0);
+
+    // Every page should survive being evicted and read back from disk
+    for (auto i = 0u; i < num_pages; i++)
+    {
+        auto p = pager.get_page(page_indices[i]);
+        EXPECT_EQ(p->content[0], static_cast<u8>(i + 1));
+        EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i + 1));
+    }
+}
+
+TEST(PAGER, EVICTION_HITS_MISSES)
+{
+    options opts;
+    opts.pager_size = 4;
+    pager pager("files/test_pager.ndb", true, opts);
+
+    for (auto i = 0u; i < 8; i++)
+    {
+        pager.get_free_page();
+    }
+
+    pager.sync();
+
+    const auto misses = pager.stats().misses;
+    const auto hits = pager.stats().hits;
+
+    pager.get_page(1);
+    EXPECT_EQ(pager.stats().misses, misses + 1);
+
+    pager.get_page(1);
+    EXPECT_EQ(pager.stats().hits, hits + 1);
+    EXPECT_EQ(pager.stats().misses, misses + 1);
+}
+
+TEST(PAGER, PINNED_PAGES_ARE_NOT_EVICTED)
+{
+    options opts;
+    opts.pager_size = 4;
+    pager pager("files/test_pager.ndb", true, opts);
+
+    for (auto i = 0u; i < 8; i++)
+    {
+        pager.get_free_page();
+    }
+
+    auto pinned = pager.get_page(1);
+    const auto pinned_content = pinned->content;
+
+    for (auto i = 2u; i < 9; i++)
+    {
+        pager.get_page(i);
+    }
+
+    EXPECT_EQ(pinned->index, 1);
+    EXPECT_EQ(pinned->content, pinned_content);
+    EXPECT_EQ(pinned->pin_count, 1);
+
+    // Moving the guard keeps the page pinned, releasing it unpins it
+    auto moved = std::move(pinned);
+    EXPECT_FALSE(pinned);
+    EXPECT_EQ(moved->pin_count, 1);
+
+    auto &page = *moved;
+    moved.release();
+    EXPECT_EQ(page.pin_count, 0);
+}
+
+TEST(PAGER, ALL_FRAMES_PINNED)
+{
+    options opts;
+    opts.pager_size = 2;
+    pager pager("files/test_pager.ndb", true, opts);
+
+    auto first = pager.get_free_page();
+    auto second = pager.get_free_page();
+
+    EXPECT_THROW(pager.get_free_page(), niffler_exception);
+
+    second.release();
+    EXPECT_TRUE(pager.get_free_page());
+}
+
+TEST(PAGER, SYNC_DIRTY_PAGES)
+{
+    constexpr auto num_pages = 16u;
+    // Without a write-ahead log sync writes the pages to the file
+    options opts;
+    opts.wal = false;
+
+    {
+        pager pager("files/test_pager.ndb", true, opts);
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            pager.get_free_page();
+        }
+
+        pager.sync();
+
+        // Only every other page is changed
+        for (auto i = 1u; i <= num_pages; i += 2)
+        {
+            auto p = pager.get_page(i);
+            memset(p->content, static_cast<int>(i), p->size);
+            pager.mark_dirty(*p);
+        }
+
+        EXPECT_TRUE(pager.sync());
+
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            EXPECT_FALSE(pager.get_page(i)->dirty);
+        }
+    }
+
+    pager pager("files/test_pager.ndb", false, opts);
+    for (auto i = 1u; i <= num_pages; i++)
+    {
+        const auto expected = i % 2 == 1 ? static_cast<u8>(i) : 0;
+        EXPECT_EQ(pager.get_page(i)->content[0], expected) << "page: " << i;
+    }
+}
+
+TEST(PAGER, PREFETCH)
+{
+    constexpr auto num_pages = 16u;
+    options opts;
+    opts.pager_size = 64;
+
+    {
+        pager pager("files/test_pager.ndb", true, opts);
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            auto p = pager.get_free_page();
+            memset(p->content, static_cast<int>(p->index), p->size);
+            pager.mark_dirty(*p);
+        }
+
+        EXPECT_TRUE(pager.sync());
+    }
+
+    pager pager("files/test_pager.ndb", false, opts);
 
-    constexpr auto num_pages_to_create = free_list_header::MAX_NUM_PAGES() * 3;
     std::vector<page_index> page_indices;
+    for (auto i = 1u; i <= num_pages; i++)
+    {
+        page_indices.push_back(i);
+    }
+
+    // Out of range pages are skipped
+    page_indices.push_back(num_pages + 10);
+
+    pager.prefetch(page_indices.data(), static_cast<u32>(page_indices.size()));
+    EXPECT_EQ(pager.stats().misses, num_pages);
+
+    for (auto i = 1u; i <= num_pages; i++)
+    {
+        auto p = pager.get_page(i);
+        EXPECT_EQ(p->content[0], static_cast<u8>(i));
+        EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i));
+    }
+
+    EXPECT_EQ(pager.stats().misses, num_pages);
+    EXPECT_EQ(pager.stats().hits, num_pages);
+}
+
+TEST(PAGER, DIRECT_IO)
+{
+    constexpr auto num_pages = 32u;
+    options opts;
+    opts.pager_size = 8;
+    opts.io_mode = io_mode::direct;
+
+    {
+        pager pager("files/test_pager_direct.ndb", true, opts);
+        ASSERT_TRUE(pager.ok());
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            auto p = pager.get_free_page();
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(p->content) % DIRECT_IO_ALIGNMENT, 0);
+            memset(p->content, static_cast<int>(p->index), p->size);
+            pager.mark_dirty(*p);
+        }
+
+        EXPECT_TRUE(pager.sync());
+    }
+
+    pager pager("files/test_pager_direct.ndb", false, opts);
+    EXPECT_EQ(pager.header().num_pages, num_pages + 1);
+
+    for (auto i = 1u; i <= num_pages; i++)
+    {
+        auto p = pager.get_page(i);
+        EXPECT_EQ(p->content[0], static_cast<u8>(i));
+        EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i));
+    }
+}
+
+TEST(PAGER, SHARDS)
+{
+    options opts;
+    opts.pager_size = 4;
+    opts.pager_shards = 8;
+    EXPECT_EQ(pager("files/test_pager.ndb", true, opts).num_shards(), 1);
+
+    constexpr auto num_threads = 4u;
+    constexpr auto num_pages = 256u;
+    opts.pager_size = 64;
+    opts.pager_shards = 4;
+    pager pager("files/test_pager.ndb", true, opts);
+    EXPECT_EQ(pager.num_shards(), 4);
+
+    for (auto i = 0u; i < num_pages; i++)
+    {
+        auto p = pager.get_free_page();
+        memset(p->content, static_cast<int>(p->index), p->size);
+        pager.mark_dirty(*p);
+    }
+
+    EXPECT_TRUE(pager.sync());
+
+    // Every thread reads all pages, most of them are evicted and read again while other threads use the same shards
+    auto read_pages = [&pager](u32 thread) {
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            const auto page_index = 1 + (i + thread * 17) % num_pages;
+            auto p = pager.get_page(page_index, latch_mode::shared);
+            EXPECT_EQ(p->content[0], static_cast<u8>(page_index));
+            EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(page_index));
+        }
+    };
+
+    const auto stats = pager.stats();
+
+    std::vector<std::thread> threads;
+    for (auto i = 0u; i < num_threads; i++)
+    {
+        threads.emplace_back(read_pages, i);
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    const auto new_stats = pager.stats();
+    EXPECT_EQ(new_stats.hits + new_stats.misses, stats.hits + stats.misses + num_threads * num_pages);
+}
+
+TEST(PAGER, HUGE_PAGES)
+{
+    constexpr auto num_pages = 64u;
+    options opts;
+    opts.pager_size = 1024;
+    opts.huge_pages = true;
+
+    // Falls back to normal pages if the system has no huge pages
+    pager pager("files/test_pager.ndb", true, opts);
+    ASSERT_TRUE(pager.ok());
 
-    for (auto i = 0; i < num_pages_to_create; i++)
+    for (auto i = 0u; i < num_pages; i++)
     {
-        auto &p = pager.get_free_page();
-        page_indices.push_back(p.index);
+        auto p = pager.get_free_page();
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(p->content) % DIRECT_IO_ALIGNMENT, 0);
+        memset(p->content, static_cast<int>(p->index), p->size);
+        pager.mark_dirty(*p);
     }
 
-    EXPECT_EQ(h.num_pages, num_pages_to_create + 1);
+    EXPECT_TRUE(pager.sync());
 
-    EXPECT_EQ(h.num_free_list_pages, 0);
-    auto last = page_indices.back();
-    page_indices.pop_back();
-    pager.free_page(last);
-    EXPECT_EQ(h.num_free_list_pages, 1);
-    EXPECT_EQ(h.last_free_list_page, num_pages_to_create + 1);
+    for (auto i = 1u; i <= num_pages; i++)
+    {
+        auto p = pager.get_page(i);
+        EXPECT_EQ(p->content[0], static_cast<u8>(i));
+        EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i));
+    }
+}
+
+TEST(PAGER, MMAP)
+{
+    constexpr auto num_pages = 64u;
+    options opts;
+    opts.pager_size = 8;
+    opts.io_mode = io_mode::mmap;
+
+    {
+        pager pager("files/test_pager_mmap.ndb", true, opts);
+        ASSERT_TRUE(pager.ok());
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            auto p = pager.get_free_page();
+            memset(p->content, static_cast<int>(p->index), p->size);
+            pager.mark_dirty(*p);
+        }
+
+        EXPECT_TRUE(pager.sync());
+        EXPECT_EQ(pager.header().num_pages, num_pages + 1);
+    }
+
+    // The file format is the same regardless of how it was written
+    opts.io_mode = io_mode::buffered;
+    pager buffered_pager("files/test_pager_mmap.ndb", false, opts);
+    EXPECT_EQ(buffered_pager.header().num_pages, num_pages + 1);
+
+    for (auto i = 1u; i <= num_pages; i++)
+    {
+        auto p = buffered_pager.get_page(i);
+        EXPECT_EQ(p->content[0], static_cast<u8>(i));
+        EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i));
+    }
+}
+
+TEST(PAGER, PAGE_SIZE)
+{
+    constexpr auto num_pages = 40u;
+    constexpr auto num_freed_pages = 20u;
+
+    for (const auto page_size : { 8u * 1024, 16u * 1024, 64u * 1024 })
+    {
+        options opts;
+        opts.pager_size = 16;
+        opts.page_size = page_size;
+
+        {
+            pager pager("files/test_pager_page_size.ndb", true, opts);
+            ASSERT_TRUE(pager.ok());
+            EXPECT_EQ(pager.header().page_size, page_size);
+
+            for (auto i = 0u; i < num_pages; i++)
+            {
+                auto p = pager.get_free_page();
+                EXPECT_EQ(p->size, page_size);
+                memset(p->content, static_cast<int>(p->index), p->size);
+                pager.mark_dirty(*p);
+            }
+
+            EXPECT_TRUE(pager.sync());
+
+            for (auto i = 1u; i <= num_freed_pages; i++)
+            {
+                pager.free_page(i);
+            }
+
+            EXPECT_EQ(pager.header().num_free_pages, num_freed_pages);
+            EXPECT_TRUE(pager.sync());
+        }
+
+        // The page size of an existing file wins over the options
+        opts.page_size = PAGE_SIZE;
+        pager pager("files/test_pager_page_size.ndb", false, opts);
+        ASSERT_TRUE(pager.ok());
+        EXPECT_EQ(pager.header().page_size, page_size);
+        EXPECT_EQ(pager.header().num_pages, num_pages + 2);
+
+        for (auto i = num_freed_pages + 1; i <= num_pages; i++)
+        {
+            auto p = pager.get_page(i);
+            EXPECT_EQ(p->content[0], static_cast<u8>(i));
+            EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i));
+        }
+
+        // Free pages are reused before the file grows
+        pager.get_free_page();
+        EXPECT_EQ(pager.header().num_pages, num_pages + 2);
+    }
+}
+
+TEST(PAGER, INVALID_PAGE_SIZE)
+{
+    options opts;
+    opts.page_size = 12 * 1024;
+
+    pager pager("files/test_pager_invalid_page_size.ndb", true, opts);
+    EXPECT_FALSE(pager.ok());
+}
+
+TEST(PAGER, WAL_RECOVERY)
+{
+    constexpr auto num_pages = 32u;
+    options opts;
+    opts.pager_size = 64;
+    // Committed pages would otherwise be written to the file in the background, and grown in extents the file size
+    // wouldn't show what has been written
+    opts.writer_dirty_percent = 0;
+    opts.file_growth_pages = 0;
+
+    {
+        pager pager("files/test_pager_wal.ndb", true, opts);
+        ASSERT_TRUE(pager.ok());
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            auto p = pager.get_free_page();
+            memset(p->content, static_cast<int>(p->index), p->size);
+            pager.mark_dirty(*p);
+        }
+
+        EXPECT_TRUE(pager.sync());
+
+        // Committed to the log, the pages themselves have not been written to the file yet
+        file_handle db_file("files/test_pager_wal.ndb", file_mode::read);
+        EXPECT_LT(file_size(db_file), num_pages * PAGE_SIZE);
+
+        // Not committed, lost when the pager goes away
+        auto p = pager.get_page(1);
+        memset(p->content, 0xff, p->size);
+        pager.mark_dirty(*p);
+    }
+
+    pager pager("files/test_pager_wal.ndb", false, opts);
+    ASSERT_TRUE(pager.ok());
+    EXPECT_EQ(pager.header().num_pages, num_pages + 1);
+
+    for (auto i = 1u; i <= num_pages; i++)
+    {
+        auto p = pager.get_page(i);
+        EXPECT_EQ(p->content[0], static_cast<u8>(i));
+        EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i));
+    }
+
+    // Recovered pages are written to the file and the log starts over
+    file_handle log_file("files/test_pager_wal.ndb-wal", file_mode::read);
+    EXPECT_EQ(file_size(log_file), wal_header::DISK_SIZE());
+}
+
+TEST(PAGER, UNCOMMITTED_PAGES_ARE_NOT_EVICTED)
+{
+    constexpr auto num_pages = 16u;
+    const auto file_path = "files/test_pager_wal.ndb";
+    options opts;
+    opts.pager_size = 4;
+    opts.writer_dirty_percent = 0;
+
+    pager pager(file_path, true, opts);
+    for (auto i = 0u; i < num_pages; i++)
+    {
+        auto p = pager.get_free_page();
+        memset(p->content, 0xab, p->size);
+        pager.mark_dirty(*p);
+    }
+
+    EXPECT_TRUE(pager.checkpoint());
+
+    auto p = pager.get_page(1);
+    memset(p->content, 0xcd, p->size);
+    pager.mark_dirty(*p);
+    p.release();
+
+    // Committed pages are evicted in its place
+    for (auto i = 2u; i <= num_pages; i++)
+    {
+        pager.get_page(i);
+    }
+
+    file_handle db_file(file_path, file_mode::read);
+    u8 value = 0;
+    read_at(db_file, &value, sizeof(value), PAGE_SIZE);
+    EXPECT_EQ(value, 0xab);
+    EXPECT_EQ(pager.get_page(1)->content[0], 0xcd);
+}
+
+TEST(PAGER, UNCOMMITTED_PAGES_ARE_EVICTED_TO_THE_LOG)
+{
+    constexpr auto num_pages = 16u;
+    const auto file_path = "files/test_pager_wal.ndb";
+    options opts;
+    opts.pager_size = 4;
+    opts.writer_dirty_percent = 0;
+
+    {
+        pager pager(file_path, true, opts);
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            auto p = pager.get_free_page();
+            memset(p->content, 0xab, p->size);
+            pager.mark_dirty(*p);
+        }
+
+        EXPECT_TRUE(pager.checkpoint());
+
+        // Every frame holds uncommitted changes, they are evicted to the log without committing it
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            auto p = pager.get_page(i);
+            memset(p->content, 0xcd, p->size);
+            pager.mark_dirty(*p);
+        }
+
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            EXPECT_EQ(pager.get_page(i)->content[0], 0xcd);
+        }
+
+        file_handle db_file(file_path, file_mode::read);
+        u8 value = 0;
+        read_at(db_file, &value, sizeof(value), PAGE_SIZE);
+        EXPECT_EQ(value, 0xab);
+    }
+
+    // Nothing was committed
+    {
+        pager pager(file_path, false, opts);
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            EXPECT_EQ(pager.get_page(i)->content[0], 0xab);
+        }
+
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            auto p = pager.get_page(i);
+            memset(p->content, 0xcd, p->size);
+            pager.mark_dirty(*p);
+        }
+
+        // The checkpoint copies the evicted pages from the log
+        EXPECT_TRUE(pager.checkpoint());
+
+        file_handle db_file(file_path, file_mode::read);
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            u8 value = 0;
+            read_at(db_file, &value, sizeof(value), static_cast<u64>(PAGE_SIZE) * i);
+            EXPECT_EQ(value, 0xcd);
+        }
+    }
+}
+
+TEST(PAGER, HEADER_IS_SAVED_WITH_COMMIT)
+{
+    constexpr auto num_pages = 8u;
 
-    for (auto i = 0u; i < free_list_header::MAX_NUM_PAGES() - 1; i++)
+    for (const auto use_wal : { true, false })
     {
-        last = page_indices.back();
-        page_indices.pop_back();
-        pager.free_page(last);
+        options opts;
+        opts.wal = use_wal;
+
+        {
+            pager pager("files/test_pager_header.ndb", true, opts);
+            ASSERT_TRUE(pager.ok());
+
+            // Allocating only changes the header in memory
+            for (auto i = 0u; i < num_pages; i++)
+            {
+                pager.get_free_page();
+            }
+
+            EXPECT_EQ(pager.header().num_pages, num_pages + 1);
+        }
+
+        {
+            pager pager("files/test_pager_header.ndb", false, opts);
+            EXPECT_EQ(pager.header().num_pages, 1) << "wal: " << use_wal;
+
+            for (auto i = 0u; i < num_pages; i++)
+            {
+                pager.get_free_page();
+            }
+
+            pager.free_page(num_pages);
+            EXPECT_TRUE(pager.sync());
+        }
+
+        pager pager("files/test_pager_header.ndb", false, opts);
+        EXPECT_EQ(pager.header().num_pages, num_pages + 2) << "wal: " << use_wal;
+        EXPECT_EQ(pager.header().num_free_pages, 1) << "wal: " << use_wal;
     }
+}
 
-    EXPECT_EQ(h.num_free_list_pages, 1);
+TEST(PAGER, WAL_CHECKPOINT)
+{
+    constexpr auto num_pages = 64u;
+    options opts;
+    opts.pager_size = 128;
+    opts.wal_checkpoint_pages = 16;
 
-    for (auto i = 0u; i < free_list_header::MAX_NUM_PAGES(); i++)
     {
-        last = page_indices.back();
-        page_indices.pop_back();
-        pager.free_page(last);
+        pager pager("files/test_pager_wal.ndb", true, opts);
+        ASSERT_TRUE(pager.ok());
+
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            auto p = pager.get_free_page();
+            memset(p->content, static_cast<int>(p->index), p->size);
+            pager.mark_dirty(*p);
+            p.release();
+
+            EXPECT_TRUE(pager.sync());
+        }
+
+        // The log never grows much past the checkpoint size
+        file_handle log_file("files/test_pager_wal.ndb-wal", file_mode::read);
+        EXPECT_LT(file_size(log_file), 2 * opts.wal_checkpoint_pages * (PAGE_SIZE + wal_record_header::DISK_SIZE()));
+
+        EXPECT_TRUE(pager.checkpoint());
+        EXPECT_EQ(file_size(log_file), wal_header::DISK_SIZE());
+
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            EXPECT_FALSE(pager.get_page(i)->dirty);
+        }
     }
-    
-    EXPECT_EQ(h.num_free_list_pages, 2);
 
-    for (auto i = 0u; i < free_list_header::MAX_NUM_PAGES(); i++)
+    // Opened without a log, everything is in the file
+    opts.wal = false;
+    pager pager("files/test_pager_wal.ndb", false, opts);
+    EXPECT_EQ(pager.header().num_pages, num_pages + 1);
+
+    for (auto i = 1u; i <= num_pages; i++)
     {
-        last = page_indices.back();
-        page_indices.pop_back();
-        pager.free_page(last);
+        auto p = pager.get_page(i);
+        EXPECT_EQ(p->content[0], static_cast<u8>(i));
+        EXPECT_EQ(p->content[p->size - 1], static_cast<u8>(i));
     }
+}
 
-    EXPECT_EQ(h.num_free_list_pages, 3);
-    EXPECT_EQ(h.num_pages, h.num_free_list_pages + 1 + num_pages_to_create);
+TEST(PAGER, BACKGROUND_WRITER)
+{
+    constexpr auto num_pages = 64u;
 
-    EXPECT_EQ(page_indices.size(), 0);
-    for (auto i = 0; i < num_pages_to_create; i++)
+    for (const auto use_wal : { true, false })
     {
-        auto &p = pager.get_free_page();
-        page_indices.push_back(p.index);
+        options opts;
+        opts.pager_size = 128;
+        opts.wal = use_wal;
+        opts.writer_dirty_percent = 25;
+        opts.writer_interval_ms = 1;
+
+        {
+            pager pager("files/test_pager_writer.ndb", true, opts);
+            ASSERT_TRUE(pager.ok());
+
+            for (auto i = 0u; i < num_pages; i++)
+            {
+                auto p = pager.get_free_page();
+                memset(p->content, static_cast<int>(p->index), p->size);
+                pager.mark_dirty(*p);
+            }
+
+            // With a log pages are only written once they are committed
+            if (use_wal)
+            {
+                EXPECT_TRUE(pager.sync());
+            }
+
+            // Half of the pool is dirty, the writer brings it down to a quarter
+            for (auto i = 0; i < 200 && pager.stats().background_writes < num_pages - 32; i++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+
+            EXPECT_GE(pager.stats().background_writes, num_pages - 32) << "wal: " << use_wal;
+
+            auto num_dirty = 0u;
+            for (auto i = 1u; i <= num_pages; i++)
+            {
+                num_dirty += pager.get_page(i)->dirty ? 1 : 0;
+            }
+
+            EXPECT_LE(num_dirty, 32) << "wal: " << use_wal;
+            EXPECT_TRUE(pager.sync());
+            EXPECT_TRUE(pager.checkpoint());
+        }
+
+        pager pager("files/test_pager_writer.ndb", false, opts);
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            EXPECT_EQ(pager.get_page(i)->content[0], static_cast<u8>(i)) << "wal: " << use_wal << " page: " << i;
+        }
     }
+}
 
-    // This should fail once actual file truncation is implemented since we have a bunch of pages that can be used in the free pages list
-    EXPECT_EQ(h.num_free_list_pages, 3);
-    EXPECT_EQ(h.num_pages, 1 + (num_pages_to_create * 2 - free_list_header::MAX_NUM_PAGES()) + h.num_free_list_pages);
+TEST(PAGER, FILE_GROWTH)
+{
+    options opts;
+    opts.file_growth_pages = 64;
+
+    {
+        pager pager("files/test_pager_growth.ndb", true, opts);
+        ASSERT_TRUE(pager.ok());
 
-    last = page_indices.back();
-    page_indices.pop_back();
-    pager.free_page(last);
+        // The first allocation grows the file by a whole extent
+        pager.get_free_page();
+        EXPECT_EQ(pager.header().num_pages, 2);
+        EXPECT_EQ(pager.header().num_preallocated_pages, 63);
+
+        file_handle db_file("files/test_pager_growth.ndb", file_mode::read);
+        EXPECT_EQ(file_size(db_file), 65 * PAGE_SIZE);
+
+        for (auto i = 0u; i < 63; i++)
+        {
+            pager.get_free_page();
+        }
+
+        EXPECT_EQ(pager.header().num_preallocated_pages, 0);
+        EXPECT_EQ(file_size(db_file), 65 * PAGE_SIZE);
+
+        pager.get_free_page();
+        EXPECT_EQ(pager.header().num_preallocated_pages, 63);
+        EXPECT_EQ(file_size(db_file), 129 * PAGE_SIZE);
+        EXPECT_TRUE(pager.sync());
+    }
+
+    pager pager("files/test_pager_growth.ndb", false, opts);
+    EXPECT_EQ(pager.header().num_pages, 66);
+    EXPECT_EQ(pager.header().num_preallocated_pages, 63);
+}
+
+TEST(PAGER, TRUNCATE)
+{
+    constexpr auto num_pages = 40u;
 
-    EXPECT_EQ(h.num_free_list_pages, 3);
-    EXPECT_EQ(h.num_pages, 1 + (num_pages_to_create * 2 - free_list_header::MAX_NUM_PAGES()) + h.num_free_list_pages);
-}
\ No newline at end of file
+    for (const auto use_wal : { false, true })
+    {
+        options opts;
+        opts.wal = use_wal;
+        opts.file_growth_pages = 64;
+
+        {
+            pager pager("files/test_pager_truncate.ndb", true, opts);
+            for (auto i = 0u; i < num_pages; i++)
+            {
+                pager.get_free_page();
+            }
+
+            // The bitmap page goes at the end, after the pages that are freed
+            for (auto i = 31u; i <= num_pages; i++)
+            {
+                pager.free_page(i);
+            }
+
+            pager.free_page(5);
+            EXPECT_EQ(pager.header().first_bitmap_page, num_pages + 1) << "wal: " << use_wal;
+
+            // The bitmap page moves into the free page before the end, every page after the last one in use is given back
+            EXPECT_EQ(pager.truncate(), 11) << "wal: " << use_wal;
+            EXPECT_EQ(pager.header().num_pages, 31) << "wal: " << use_wal;
+            EXPECT_EQ(pager.header().num_free_pages, 0) << "wal: " << use_wal;
+            EXPECT_EQ(pager.header().num_preallocated_pages, 0) << "wal: " << use_wal;
+            EXPECT_EQ(pager.header().first_bitmap_page, 5) << "wal: " << use_wal;
+            EXPECT_EQ(pager.truncate(), 0) << "wal: " << use_wal;
+
+            EXPECT_TRUE(pager.sync());
+            EXPECT_TRUE(pager.checkpoint());
+
+            file_handle db_file("files/test_pager_truncate.ndb", file_mode::read);
+            EXPECT_EQ(file_size(db_file), 31 * PAGE_SIZE) << "wal: " << use_wal;
+        }
+
+        pager pager("files/test_pager_truncate.ndb", false, opts);
+        EXPECT_EQ(pager.header().num_pages, 31) << "wal: " << use_wal;
+        EXPECT_EQ(pager.header().first_bitmap_page, 5) << "wal: " << use_wal;
+
+        pager.free_page(10);
+        EXPECT_EQ(pager.get_free_page()->index, 10) << "wal: " << use_wal;
+        EXPECT_EQ(pager.get_free_page()->index, 31) << "wal: " << use_wal;
+    }
+}
+
+TEST(PAGER, PUNCH_HOLES)
+{
+    constexpr auto num_pages = 20u;
+    const auto file_path = "files/test_pager_holes.ndb";
+
+    for (const auto use_wal : { false, true })
+    {
+        options opts;
+        opts.wal = use_wal;
+        opts.punch_holes = true;
+
+        pager pager(file_path, true, opts);
+        for (auto i = 0u; i < num_pages; i++)
+        {
+            auto p = pager.get_free_page();
+            memset(p->content, 0xab, p->size);
+            pager.mark_dirty(*p);
+        }
+
+        EXPECT_TRUE(pager.checkpoint());
+
+        for (auto i = 5u; i <= 10; i++)
+        {
+            pager.free_page(i);
+        }
+
+        // Reused before the holes are punched, its content stays
+        auto reused = pager.get_free_page(latch_mode::none, 7);
+        ASSERT_EQ(reused->index, 7);
+        memset(reused->content, 0xcd, reused->size);
+        pager.mark_dirty(*reused);
+        reused.release();
+
+        file_handle db_file(file_path, file_mode::read);
+        auto read_page_byte = [&db_file](page_index page_index) {
+            u8 value = 0;
+            read_at(db_file, &value, sizeof(value), static_cast<u64>(page_index) * PAGE_SIZE + PAGE_SIZE / 2);
+            return value;
+        };
+
+        // With a write-ahead log the holes wait for the checkpoint
+        EXPECT_TRUE(pager.sync());
+        if (use_wal)
+        {
+            EXPECT_EQ(read_page_byte(5), 0xab);
+            EXPECT_TRUE(pager.checkpoint());
+        }
+
+        // Not every file system can punch holes
+        const auto expected_free_byte = read_page_byte(5) == 0 ? 0 : 0xab;
+
+        for (auto i = 1u; i <= num_pages; i++)
+        {
+            const auto expected = i == 7 ? 0xcd : i >= 5 && i <= 10 ? expected_free_byte : 0xab;
+            EXPECT_EQ(read_page_byte(i), expected) << "wal: " << use_wal << " page: " << i;
+        }
+
+        // Punched pages are still free
+        EXPECT_EQ(pager.header().num_free_pages, 5);
+        EXPECT_EQ(pager.get_free_page()->index, 5);
+    }
+}
+
+TEST(PAGER, PUNCH_HOLES_SKIPS_PINNED_PAGES)
+{
+    constexpr auto num_pages = 8u;
+    const auto file_path = "files/test_pager_holes.ndb";
+    options opts;
+    opts.wal = false;
+    opts.punch_holes = true;
+
+    pager pager(file_path, true, opts);
+    for (auto i = 0u; i < num_pages; i++)
+    {
+        auto p = pager.get_free_page();
+        memset(p->content, 0xab, p->size);
+        pager.mark_dirty(*p);
+    }
+
+    EXPECT_TRUE(pager.sync());
+
+    file_handle db_file(file_path, file_mode::read);
+    auto read_page_byte = [&db_file](page_index page_index) {
+        u8 value = 0;
+        read_at(db_file, &value, sizeof(value), static_cast<u64>(page_index) * PAGE_SIZE + PAGE_SIZE / 2);
+        return value;
+    };
+
+    pager.free_page(3);
+    pager.free_page(4);
+
+    // A pinned page is neither dropped from the pool nor punched
+    auto pinned = pager.get_page(4);
+    EXPECT_TRUE(pager.sync());
+    EXPECT_EQ(read_page_byte(4), 0xab);
+    EXPECT_EQ(pinned->content[0], 0xab);
+
+    // Not every file system can punch holes
+    const auto expected_free_byte = read_page_byte(3) == 0 ? 0 : 0xab;
+
+    pinned.release();
+    EXPECT_TRUE(pager.sync());
+    EXPECT_EQ(read_page_byte(4), expected_free_byte);
+}
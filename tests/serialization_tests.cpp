@@ -1,5 +1,6 @@
 #include <gtest\gtest.h>
 #include <string.h>
+#include <vector>
 
 #include "serialization.h"
 
@@ -11,8 +12,9 @@ TEST(SERIALIZATION, FILE_HEADER)
     strcpy_s(h1.version, sizeof(h1.version), "NifflerDB 0.1");
     h1.page_size = 1;
     h1.num_pages = 2;
-    h1.last_free_list_page = 3;
-    h1.num_free_list_pages = 4;
+    h1.first_bitmap_page = 3;
+    h1.num_free_pages = 4;
+    h1.num_preallocated_pages = 5;
 
     u8 buffer[1024] = { 0 };
     serialize_file_header(buffer, h1);
@@ -23,8 +25,33 @@ TEST(SERIALIZATION, FILE_HEADER)
     ASSERT_STREQ(h2.version, "NifflerDB 0.1");
     EXPECT_EQ(h2.page_size, 1);
     EXPECT_EQ(h2.num_pages, 2);
-    EXPECT_EQ(h2.last_free_list_page, 3);
-    EXPECT_EQ(h2.num_free_list_pages, 4);
+    EXPECT_EQ(h2.first_bitmap_page, 3);
+    EXPECT_EQ(h2.num_free_pages, 4);
+    EXPECT_EQ(h2.num_preallocated_pages, 5);
+}
+
+TEST(SERIALIZATION, FILE_HEADER_64K_PAGES)
+{
+    file_header h1 = { 0 };
+    strcpy_s(h1.version, sizeof(h1.version), FILE_VERSION);
+    h1.page_size = MAX_PAGE_SIZE;
+    h1.num_pages = 2;
+    h1.first_bitmap_page = 3;
+    h1.num_free_pages = 4;
+    h1.num_preallocated_pages = 5;
+
+    u8 buffer[1024] = { 0 };
+    serialize_file_header(buffer, h1);
+
+    file_header h2 = { 0 };
+    deserialize_file_header(buffer, h2);
+
+    ASSERT_STREQ(h2.version, FILE_VERSION);
+    EXPECT_EQ(h2.page_size, MAX_PAGE_SIZE);
+    EXPECT_EQ(h2.num_pages, 2);
+    EXPECT_EQ(h2.first_bitmap_page, 3);
+    EXPECT_EQ(h2.num_free_pages, 4);
+    EXPECT_EQ(h2.num_preallocated_pages, 5);
 }
 
 TEST(SERIALIZATION, PAGE_HEADER)
@@ -43,6 +70,27 @@ TEST(SERIALIZATION, PAGE_HEADER)
     EXPECT_EQ(h2.prev_page, 2);
 }
 
+TEST(SERIALIZATION, BITMAP_PAGE)
+{
+    const auto num_words = bitmap_page_header::NUM_WORDS();
+    std::vector<u64> words1(num_words, 0);
+    words1[0] = 0x8000000000000001ull;
+    words1[num_words - 1] = 0x0123456789abcdefull;
+
+    bitmap_page_header h1 = { 0 };
+    h1.next_page = 7;
+
+    u8 buffer[PAGE_SIZE] = { 0 };
+    serialize_bitmap_page(buffer, h1, words1.data(), num_words);
+
+    bitmap_page_header h2 = { 0 };
+    std::vector<u64> words2(num_words, 0);
+    deserialize_bitmap_page(buffer, h2, words2.data(), num_words);
+
+    EXPECT_EQ(h2.next_page, 7);
+    EXPECT_EQ(words2, words1);
+}
+
 TEST(SERIALIZATION, FREE_LIST_HEADER)
 {
     free_list_header h1 = { 0 };
@@ -84,6 +132,41 @@ TEST(SERIALIZATION, FREE_LIST_READ_WRITE_PAGE_INDEX)
     EXPECT_EQ(index_1020, 5);
 }
 
+TEST(SERIALIZATION, WAL_HEADER)
+{
+    wal_header h1 = { 0 };
+    memcpy(h1.magic, "NifWAL01", sizeof(h1.magic));
+    h1.page_size = 1;
+    h1.salt = 2;
+
+    u8 buffer[1024] = { 0 };
+    serialize_wal_header(buffer, h1);
+
+    wal_header h2 = { 0 };
+    deserialize_wal_header(buffer, h2);
+    EXPECT_EQ(0, memcmp(h2.magic, "NifWAL01", sizeof(h2.magic)));
+    EXPECT_EQ(h2.page_size, 1);
+    EXPECT_EQ(h2.salt, 2);
+}
+
+TEST(SERIALIZATION, WAL_RECORD_HEADER)
+{
+    wal_record_header h1 = { wal_record_type::page };
+    h1.page = 1;
+    h1.salt = 2;
+    h1.checksum = 3;
+
+    u8 buffer[1024] = { 0 };
+    serialize_wal_record_header(buffer, h1);
+
+    wal_record_header h2 = { wal_record_type::commit };
+    deserialize_wal_record_header(buffer, h2);
+    EXPECT_EQ(h2.type, wal_record_type::page);
+    EXPECT_EQ(h2.page, 1);
+    EXPECT_EQ(h2.salt, 2);
+    EXPECT_EQ(h2.checksum, 3);
+}
+
 TEST(SERIALIZATION, BP_TREE_HEADER)
 {
     bp_tree_header h1 = { 0 };
@@ -94,6 +177,7 @@ TEST(SERIALIZATION, BP_TREE_HEADER)
     h1.height = 5;
     h1.root_page = 6;
     h1.leaf_page = 7;
+    h1.key_format = key_format::ordered_string;
 
     u8 buffer[1024] = { 0 };
     serialize_bp_tree_header(buffer, h1);
@@ -108,6 +192,7 @@ TEST(SERIALIZATION, BP_TREE_HEADER)
     EXPECT_EQ(h2.height, 5);
     EXPECT_EQ(h2.root_page, 6);
     EXPECT_EQ(h2.leaf_page, 7);
+    EXPECT_EQ(h2.key_format, key_format::ordered_string);
 }
 
 TEST(SERIALIZATION, BP_TREE_NODE)
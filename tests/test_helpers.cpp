@@ -201,4 +201,5 @@ bp_tree_validation_result validate_bp_tree(std::unique_ptr<bp_tree<N>> &tree)
 template bp_tree_validation_result validate_bp_tree(std::unique_ptr<bp_tree<4>> &tree);
 template bp_tree_validation_result validate_bp_tree(std::unique_ptr<bp_tree<6>> &tree);
 template bp_tree_validation_result validate_bp_tree(std::unique_ptr<bp_tree<10>> &tree);
-template bp_tree_validation_result validate_bp_tree(std::unique_ptr<bp_tree<DEFAULT_TREE_ORDER>> &tree);
\ No newline at end of file
+template bp_tree_validation_result validate_bp_tree(std::unique_ptr<bp_tree<DEFAULT_TREE_ORDER>> &tree);
+template bp_tree_validation_result validate_bp_tree(std::unique_ptr<bp_tree<tree_order(16 * 1024)>> &tree);
\ No newline at end of file
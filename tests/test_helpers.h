@@ -37,6 +37,11 @@ inline std::unique_ptr<pager> create_pager(const char *file_path, bool truncate_
     return std::make_unique<pager>(file_path, truncate_existing_file);
 }
 
+inline std::unique_ptr<pager> create_pager(const char *file_path, bool truncate_existing_file, const options &opts)
+{
+    return std::make_unique<pager>(file_path, truncate_existing_file, opts);
+}
+
 inline void random_keys_test(std::size_t rand_seed, std::size_t num_keys)
 {
     auto p = create_pager("files/random_keys_test.ndb");
@@ -0,0 +1,144 @@
+#include <gtest\gtest.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "wal.h"
+
+using namespace niffler;
+
+static
+std::vector<u8> make_page(u8 value)
+{
+    return std::vector<u8>(PAGE_SIZE, value);
+}
+
+static
+u8 read_page_byte(const file_handle &handle, page_index page_index)
+{
+    u8 value = 0;
+    read_at(handle, &value, sizeof(value), static_cast<u64>(page_index) * PAGE_SIZE);
+    return value;
+}
+
+TEST(WAL, COMMIT_RECOVER)
+{
+    {
+        wal log("files/test_wal.ndb", true);
+        ASSERT_TRUE(log.ok());
+        ASSERT_TRUE(log.reset(PAGE_SIZE));
+
+        log.append(1, make_page(1).data());
+        log.append(2, make_page(1).data());
+        EXPECT_TRUE(log.commit(log.tail()));
+
+        log.append(1, make_page(2).data());
+        log.append(3, make_page(2).data());
+        EXPECT_TRUE(log.commit(log.tail()));
+
+        // Already durable, nothing is written
+        EXPECT_TRUE(log.commit(log.tail()));
+        EXPECT_EQ(log.num_syncs(), 2);
+    }
+
+    {
+        file_handle db_file("files/test_wal.ndb", file_mode::write_update);
+        wal log("files/test_wal.ndb", false);
+        EXPECT_TRUE(log.recover(db_file));
+
+        EXPECT_EQ(read_page_byte(db_file, 1), 2);
+        EXPECT_EQ(read_page_byte(db_file, 2), 1);
+        EXPECT_EQ(read_page_byte(db_file, 3), 2);
+    }
+}
+
+TEST(WAL, TORN_COMMIT_IS_IGNORED)
+{
+    {
+        wal log("files/test_wal.ndb", true);
+        ASSERT_TRUE(log.reset(PAGE_SIZE));
+
+        log.append(1, make_page(1).data());
+        EXPECT_TRUE(log.commit(log.tail()));
+
+        log.append(1, make_page(2).data());
+        log.append(2, make_page(2).data());
+        EXPECT_TRUE(log.commit(log.tail()));
+    }
+
+    // Damage the checksum of the last commit record like a write that didn't make it to disk
+    {
+        file_handle log_file("files/test_wal.ndb-wal", file_mode::read_update);
+        const u32 garbage = 0xdeadbeef;
+        write_at(log_file, &garbage, sizeof(garbage), file_size(log_file) - sizeof(garbage));
+    }
+
+    file_handle db_file("files/test_wal.ndb", file_mode::write_update);
+    wal log("files/test_wal.ndb", false);
+    EXPECT_TRUE(log.recover(db_file));
+
+    EXPECT_EQ(read_page_byte(db_file, 1), 1);
+    EXPECT_EQ(file_size(db_file), 2 * PAGE_SIZE);
+}
+
+TEST(WAL, RESET)
+{
+    {
+        wal log("files/test_wal.ndb", true);
+        ASSERT_TRUE(log.reset(PAGE_SIZE));
+
+        log.append(1, make_page(1).data());
+        EXPECT_TRUE(log.commit(log.tail()));
+        EXPECT_GT(log.size(), PAGE_SIZE);
+
+        ASSERT_TRUE(log.reset(PAGE_SIZE));
+        EXPECT_EQ(log.size(), wal_header::DISK_SIZE());
+    }
+
+    file_handle db_file("files/test_wal.ndb", file_mode::write_update);
+    wal log("files/test_wal.ndb", false);
+    EXPECT_TRUE(log.recover(db_file));
+    EXPECT_EQ(file_size(db_file), 0);
+}
+
+TEST(WAL, GROUP_COMMIT)
+{
+    constexpr auto num_threads = 8u;
+    constexpr auto commits_per_thread = 50u;
+
+    {
+        wal log("files/test_wal.ndb", true);
+        ASSERT_TRUE(log.reset(PAGE_SIZE));
+
+        auto commit = [&log](u32 thread_index) {
+            for (auto i = 0u; i < commits_per_thread; i++)
+            {
+                // Every thread keeps overwriting its own page
+                const auto lsn = log.append(thread_index + 1, make_page(static_cast<u8>(i)).data());
+                EXPECT_TRUE(log.commit(lsn));
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (auto i = 0u; i < num_threads; i++)
+        {
+            threads.emplace_back(commit, i);
+        }
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        EXPECT_LE(log.num_syncs(), num_threads * commits_per_thread);
+    }
+
+    file_handle db_file("files/test_wal.ndb", file_mode::write_update);
+    wal log("files/test_wal.ndb", false);
+    EXPECT_TRUE(log.recover(db_file));
+
+    for (auto i = 0u; i < num_threads; i++)
+    {
+        EXPECT_EQ(read_page_byte(db_file, i + 1), commits_per_thread - 1);
+    }
+}